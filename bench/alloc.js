@@ -0,0 +1,75 @@
+// # bench/alloc.js #
+//
+// Count the allocations each request makes. For each case, run `set`
+// and `get` on a memory database and print, per operation, the
+// request objects made and how many of them needed a fresh
+// allocation, and the keys and values copied from arguments and how
+// many of them needed the heap or a persistent handle. Before request
+// pooling and inline buffers, every request and every key or value
+// cost at least one. Run with `node bench/alloc.js [--count=100000]
+// [--concurrency=16]`.
+
+var Kyoto = require('../kyoto'),
+    C = require('./common'),
+    options = C.parseArgs(process.argv.slice(2), {
+      count: 100000,
+      concurrency: 16
+    }),
+    cases = [
+      ['short strings', 16, 32, false],
+      ['long strings', 16, 1000, false],
+      ['short buffers', 16, 32, true]
+    ];
+
+Kyoto.open('-', 'w+', function(err) {
+  if (err) throw err;
+  var db = this;
+
+  C.series(cases.map(function(item) {
+    return function(next) {
+      var label = item[0],
+          value = C.value(item[2]);
+
+      if (item[3]) value = new Buffer(value);
+
+      measure(label + ' set', function(i, done) {
+        db.set(key(i, item), value, done);
+      }, function() {
+        measure(label + ' get', function(i, done) {
+          db.get(key(i, item), done);
+        }, next);
+      });
+    };
+  }), function() {
+    db.close(function(err) {
+      if (err) throw err;
+    });
+  });
+});
+
+function key(i, item) {
+  var text = C.key('k', i, item[1]);
+  return item[3] ? new Buffer(text) : text;
+}
+
+function measure(label, op, next) {
+  var before = Kyoto.allocStats();
+
+  C.concurrent(options.concurrency, options.count, op, function() {
+    var after = Kyoto.allocStats(),
+        count = options.count;
+
+    console.log('%s: %s requests/op (%s allocated), %s keys+values/op (%s heap, %s held)',
+                label,
+                perOp(after.requests.made - before.requests.made),
+                perOp(after.requests.allocated - before.requests.allocated),
+                perOp(after.bytes.made - before.bytes.made),
+                perOp(after.bytes.heap - before.bytes.heap),
+                perOp(after.bytes.held - before.bytes.held));
+    next();
+  });
+}
+
+function perOp(total) {
+  return (total / options.count).toFixed(3);
+}
@@ -0,0 +1,211 @@
+// # bench/common.js #
+//
+// Helpers shared by the benchmarks: timing, latency summaries,
+// temporary databases, generated keys and values, and command-line
+// options.
+
+var Fs = require('fs');
+
+exports.now = now;
+exports.Latencies = Latencies;
+exports.concurrent = concurrent;
+exports.series = series;
+exports.key = key;
+exports.value = value;
+exports.tempDir = tempDir;
+exports.removeDir = removeDir;
+exports.parseArgs = parseArgs;
+
+// Milliseconds, with sub-millisecond precision where available.
+function now() {
+  if (process.hrtime) {
+    var t = process.hrtime();
+    return t[0] * 1e3 + t[1] / 1e6;
+  }
+  return Date.now();
+}
+
+
+// ## Latencies ##
+
+// Collect latency samples in milliseconds and summarize them in
+// microseconds.
+function Latencies() {
+  this.samples = [];
+}
+
+Latencies.prototype.add = function(ms) {
+  this.samples.push(ms);
+  return this;
+};
+
+Latencies.prototype.summary = function() {
+  var sorted = this.samples.slice().sort(function(a, b) { return a - b; }),
+      count = sorted.length,
+      sum = 0;
+
+  for (var i = 0; i < count; i++)
+    sum += sorted[i];
+
+  return {
+    count: count,
+    mean: count ? round(sum / count * 1000) : null,
+    p50: percentile(sorted, 50),
+    p99: percentile(sorted, 99),
+    p999: percentile(sorted, 99.9),
+    max: count ? round(sorted[count - 1] * 1000) : null
+  };
+};
+
+function percentile(sorted, percent) {
+  if (sorted.length === 0)
+    return null;
+  var index = Math.ceil(percent / 100 * sorted.length) - 1;
+  return round(sorted[Math.max(0, index)] * 1000);
+}
+
+function round(num) {
+  return Math.round(num * 100) / 100;
+}
+
+
+// ## Running ##
+
+// Run `count` operations, keeping `concurrency` of them in flight.
+// Each operation is called as `op(i, next)` and must call `next` when
+// it's finished. `done` is called with the Latencies and the elapsed
+// time in milliseconds.
+function concurrent(concurrency, count, op, done) {
+  var latencies = new Latencies(),
+      issued = 0,
+      finished = 0,
+      start = now();
+
+  if (count === 0)
+    return done(latencies, 0);
+
+  for (var i = 0; i < concurrency && issued < count; i++)
+    issue();
+
+  function issue() {
+    var began = now();
+    op(issued++, function(err) {
+      if (err) throw err;
+      latencies.add(now() - began);
+      if (++finished == count)
+        done(latencies, now() - start);
+      else if (issued < count)
+        issue();
+    });
+  }
+}
+
+// Run asynchronous steps one after another. Each step is called with
+// a `next` function.
+function series(steps, done) {
+  var index = 0;
+
+  next();
+
+  function next(err) {
+    if (err) throw err;
+    if (index < steps.length)
+      steps[index++](next);
+    else if (done)
+      done();
+  }
+}
+
+
+// ## Data ##
+
+// A key of `size` characters: `prefix` and zero-padded `i`.
+function key(prefix, i, size) {
+  var digits = String(i),
+      pad = size - prefix.length - digits.length;
+  return prefix + (pad > 0 ? zeros(pad) : '') + digits;
+}
+
+function zeros(count) {
+  return new Array(count + 1).join('0');
+}
+
+var VALUES = {};
+
+// A value of `size` characters. Different `variant`s give different
+// values of the same size.
+function value(size, variant) {
+  var name = size + ':' + (variant || 0),
+      chars = 'abcdefghijklmnopqrstuvwxyz0123456789',
+      result = [];
+
+  if (!(name in VALUES)) {
+    for (var i = 0; i < size; i++)
+      result.push(chars.charAt((i * 7 + (variant || 0)) % chars.length));
+    VALUES[name] = result.join('');
+  }
+
+  return VALUES[name];
+}
+
+
+// ## Files ##
+
+var tempCount = 0;
+
+// Make an empty directory for benchmark databases.
+function tempDir() {
+  var base = process.env.TMPDIR || '/tmp',
+      dir = base + '/kyoto-bench-' + process.pid + '-' + (tempCount++);
+
+  Fs.mkdirSync(dir, 0755);
+  return dir;
+}
+
+// Remove a directory and everything in it.
+function removeDir(dir) {
+  Fs.readdirSync(dir).forEach(function(name) {
+    var path = dir + '/' + name;
+    if (Fs.statSync(path).isDirectory())
+      removeDir(path);
+    else
+      Fs.unlinkSync(path);
+  });
+  Fs.rmdirSync(dir);
+}
+
+
+// ## Options ##
+
+// Parse `--name=value` arguments over a set of defaults. If the
+// default is an Array, the value is a comma-separated list; numbers
+// are converted if the default is a number (or a list of them).
+function parseArgs(argv, defaults) {
+  var options = {}, name;
+
+  for (name in defaults)
+    options[name] = defaults[name];
+
+  argv.forEach(function(arg) {
+    var probe = /^--([^=]+)=(.*)$/.exec(arg);
+
+    if (!probe || !(probe[1] in defaults))
+      throw new Error('Unknown option: ' + arg);
+
+    options[probe[1]] = convert(defaults[probe[1]], probe[2]);
+  });
+
+  return options;
+}
+
+function convert(example, text) {
+  if (Array.isArray(example))
+    return text.split(',').map(function(item) {
+      return convert(example[0], item);
+    });
+  else if (typeof example == 'number')
+    return Number(text);
+  else if (typeof example == 'boolean')
+    return text == 'true';
+  return text;
+}
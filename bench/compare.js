@@ -0,0 +1,55 @@
+// # bench/compare.js #
+//
+// Compare two result files from `bench/suite.js`, usually from two
+// commits. Run with `node bench/compare.js before.json after.json`.
+// For each result in both files, print the throughput and p99 latency
+// before and after, and the change in percent.
+
+var Fs = require('fs'),
+    before = load(process.argv[2]),
+    after = load(process.argv[3]);
+
+console.log(['case', 'ops/s before', 'ops/s after', 'change',
+             'p99 before', 'p99 after', 'change'].join('\t'));
+
+Object.keys(after).forEach(function(name) {
+  var a = before[name],
+      b = after[name];
+
+  if (!a)
+    return;
+
+  console.log([
+    name,
+    a.opsPerSec, b.opsPerSec, change(a.opsPerSec, b.opsPerSec),
+    p99(a), p99(b), change(p99(a), p99(b))
+  ].join('\t'));
+});
+
+function load(path) {
+  var byName = {};
+
+  JSON.parse(Fs.readFileSync(path, 'utf8')).results.forEach(function(result) {
+    byName[caseName(result)] = result;
+  });
+
+  return byName;
+}
+
+function caseName(result) {
+  return [
+    result.backend, result.op + (result.batch ? 'x' + result.batch : ''),
+    result.keySize, result.valueSize, result.concurrency
+  ].join('/');
+}
+
+function p99(result) {
+  return result.latency ? result.latency.p99 : null;
+}
+
+function change(from, to) {
+  if (!from || to === null)
+    return '';
+  var percent = (to - from) / from * 100;
+  return (percent >= 0 ? '+' : '') + percent.toFixed(1) + '%';
+}
@@ -0,0 +1,39 @@
+// # bench/convert.js #
+//
+// Time the native conversion helpers (see src/bench.cc) on arrays
+// and objects of several sizes, and print nanoseconds per call and
+// per item. Build with `node-waf configure --bench build` first. Run
+// with `node bench/convert.js [--sizes=10,100,1000,10000]
+// [--keySize=16] [--valueSize=100] [--items=1000000]`; each case
+// converts about `items` items in total.
+
+var B = require('../build/default/_kyoto_bench'),
+    C = require('./common'),
+    options = C.parseArgs(process.argv.slice(2), {
+      sizes: [10, 100, 1000, 10000],
+      keySize: 16,
+      valueSize: 100,
+      items: 1000000
+    });
+
+options.sizes.forEach(function(size) {
+  var keys = [],
+      items = {},
+      iterations = Math.max(1, Math.floor(options.items / size));
+
+  for (var i = 0; i < size; i++) {
+    keys.push(C.key('k', i, options.keySize));
+    items[keys[i]] = C.value(options.valueSize);
+  }
+
+  B.cases.forEach(function(name) {
+    var input = /^array|^list/.test(name) ? keys : items;
+
+    // Warm up, then measure.
+    B.run(name, input, Math.max(1, Math.floor(iterations / 10)));
+    var nanos = B.run(name, input, iterations);
+
+    console.log('%s x%d: %s ns/call, %s ns/item', name, size,
+                nanos.toFixed(0), (nanos / size).toFixed(1));
+  });
+});
@@ -0,0 +1,63 @@
+// # bench/memory.js #
+//
+// Compare per-operation latency for a memory database when requests
+// go through the thread pool and when they run inline on the main
+// thread. Run with `node bench/memory.js [count]`.
+
+var Kyoto = require('../kyoto'),
+    now = require('./common').now,
+    count = parseInt(process.argv[2] || '100000', 10);
+
+run([
+  ['pool', '-', {}],
+  ['inline', '-', { inline: true }]
+]);
+
+function run(cases) {
+  if (cases.length === 0)
+    return;
+
+  var item = cases.shift(),
+      label = item[0];
+
+  Kyoto.open(item[1], 'w+', item[2], function(err) {
+    if (err) throw err;
+    var db = this;
+    sequential(db, 'set', function(i, next) {
+      db.set('key' + i, 'value' + i, next);
+    }, function() {
+      sequential(db, 'get', function(i, next) {
+        db.get('key' + i, next);
+      }, function() {
+        db.close(function(err) {
+          if (err) throw err;
+          run(cases);
+        });
+      });
+    });
+  });
+
+  // Issue `count` operations one at a time, so the time per operation
+  // is its latency.
+  function sequential(db, name, op, done) {
+    var i = 0,
+        start = now();
+
+    next();
+
+    function next(err) {
+      if (err) throw err;
+      if (i < count)
+        op(i++, next);
+      else {
+        report(name, now() - start);
+        done();
+      }
+    }
+  }
+
+  function report(name, elapsed) {
+    console.log('%s %s: %d ops, %s us/op',
+                label, name, count, (elapsed * 1000 / count).toFixed(2));
+  }
+}
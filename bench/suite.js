@@ -0,0 +1,230 @@
+// # bench/suite.js #
+//
+// Measure every API path against every backend and write the results
+// as JSON. Each combination of backend, key size, value size and
+// concurrency gets a fresh database, which runs through the point
+// operations, the bulk operations at each batch size, key matching,
+// and iteration. Run with:
+//
+//     node bench/suite.js [--count=20000] [--backends=-,+,kch,kct,kcd,kcf]
+//       [--keySizes=16] [--valueSizes=100,1000] [--concurrency=1,16]
+//       [--batches=10,100,1000] [--matchOps=1000] [--regexOps=10]
+//       [--out=results.json]
+//
+// Results go to `--out` or to stdout; progress goes to stderr. Use
+// `bench/compare.js` to compare two result files. Latencies are in
+// microseconds.
+
+var Kyoto = require('../kyoto'),
+    Fs = require('fs'),
+    C = require('./common'),
+    options = C.parseArgs(process.argv.slice(2), {
+      count: 20000,
+      backends: ['-', '+', 'kch', 'kct', 'kcd', 'kcf'],
+      keySizes: [16],
+      valueSizes: [100, 1000],
+      concurrency: [1, 16],
+      batches: [10, 100, 1000],
+      matchOps: 1000,
+      regexOps: 10,
+      out: ''
+    }),
+    results = [],
+    cases = [];
+
+options.backends.forEach(function(backend) {
+  options.keySizes.forEach(function(keySize) {
+    options.valueSizes.forEach(function(valueSize) {
+      options.concurrency.forEach(function(concurrency) {
+        cases.push(function(next) {
+          runCase(backend, keySize, valueSize, concurrency, next);
+        });
+      });
+    });
+  });
+});
+
+C.series(cases, function() {
+  var output = JSON.stringify({
+    date: new Date().toISOString(),
+    node: process.version,
+    platform: process.platform,
+    options: options,
+    results: results
+  }, null, 2);
+
+  if (options.out)
+    Fs.writeFileSync(options.out, output);
+  else
+    console.log(output);
+});
+
+function runCase(backend, keySize, valueSize, concurrency, done) {
+  var isFile = !/^[-+]$/.test(backend),
+      dir = isFile && C.tempDir(),
+      path = isFile ? (dir + '/bench.' + backend) : backend,
+      count = options.count,
+      label = [backend, keySize, valueSize, concurrency].join('/'),
+      db;
+
+  console.error('# %s', label);
+
+  Kyoto.open(path, 'w+', function(err) {
+    if (err) throw err;
+    db = this;
+    C.series(steps(), function() {
+      db.close(function(err) {
+        if (err) throw err;
+        if (dir) C.removeDir(dir);
+        done();
+      });
+    });
+  });
+
+  function steps() {
+    var list = [
+      point('set', count, function(i, next) {
+        db.set(key('k', i), C.value(valueSize), next);
+      }),
+      point('get', count, function(i, next) {
+        db.get(key('k', i), next);
+      }),
+      point('cas', count, function(i, next) {
+        db.cas(key('k', i), C.value(valueSize), C.value(valueSize, 1), next);
+      }),
+      point('append', count, function(i, next) {
+        db.append(key('k', i), 'x', next);
+      }),
+      point('add', count, function(i, next) {
+        db.add(key('a', i), C.value(valueSize), next);
+      }),
+      point('increment', count, function(i, next) {
+        db.increment(key('n', i), 1, next);
+      }),
+      point('matchPrefix', options.matchOps, function(i, next) {
+        db.matchPrefix(key('k', i * 10 % count).slice(0, -1), next);
+      }),
+      point('matchRegex', options.regexOps, function(i, next) {
+        db.matchRegex('^' + key('k', i * 10 % count).slice(0, -1), next);
+      }),
+      each,
+      keyBlocks
+    ];
+
+    options.batches.forEach(function(batch) {
+      var ops = Math.ceil(count / batch);
+      list.push(
+        point('getBulk', ops, function(i, next) {
+          db.getBulk(keys('k', i * batch, batch), next);
+        }, { batch: batch }),
+        point('setBulk', ops, function(i, next) {
+          db.setBulk(items('b' + batch + '-', i * batch, batch), next);
+        }, { batch: batch }),
+        point('removeBulk', ops, function(i, next) {
+          db.removeBulk(keys('b' + batch + '-', i * batch, batch), next);
+        }, { batch: batch })
+      );
+    });
+
+    list.push(point('remove', count, function(i, next) {
+      db.remove(key('k', i), next);
+    }));
+
+    return list;
+  }
+
+  // A step that runs `ops` operations at the case's concurrency.
+  function point(name, ops, op, extra) {
+    return function(next) {
+      C.concurrent(concurrency, ops, op, function(latencies, elapsed) {
+        record(name, ops, elapsed, latencies.summary(), extra);
+        next();
+      });
+    };
+  }
+
+  // One pass over the whole database. Each record is an operation.
+  function each(next) {
+    var records = 0,
+        start = C.now();
+
+    db.each(function(err) {
+      if (err) throw err;
+      record('each', records, C.now() - start, null);
+      next();
+    }, function(val, key) {
+      records++;
+    });
+  }
+
+  // One pass over all keys with `getKeyBlock`. Each block is an
+  // operation.
+  function keyBlocks(next) {
+    var cursor = db.cursor(),
+        latencies = new C.Latencies(),
+        records = 0,
+        start = C.now(),
+        began;
+
+    cursor.jump(function(err) {
+      if (err) throw err;
+      fetch();
+    });
+
+    function fetch() {
+      began = C.now();
+      cursor.getKeyBlock(1000, function(err, block) {
+        if (err) throw err;
+        latencies.add(C.now() - began);
+        if (block && block.length) {
+          records += block.length;
+          fetch();
+        }
+        else {
+          record('getKeyBlock', latencies.samples.length, C.now() - start,
+                 latencies.summary(), { batch: 1000, records: records });
+          next();
+        }
+      });
+    }
+  }
+
+  function record(name, ops, elapsed, latency, extra) {
+    var result = {
+      backend: backend,
+      op: name,
+      keySize: keySize,
+      valueSize: valueSize,
+      concurrency: concurrency,
+      ops: ops,
+      elapsed: Math.round(elapsed * 100) / 100,
+      opsPerSec: elapsed ? Math.round(ops / elapsed * 1000) : null,
+      latency: latency
+    };
+
+    for (var field in extra)
+      result[field] = extra[field];
+
+    console.error('%s%s: %d ops/s', result.op,
+                  result.batch ? ' x' + result.batch : '', result.opsPerSec);
+    results.push(result);
+  }
+
+  function key(prefix, i) {
+    return C.key(prefix, i, keySize);
+  }
+
+  function keys(prefix, start, size) {
+    var list = [];
+    for (var i = start; i < start + size; i++)
+      list.push(key(prefix, i));
+    return list;
+  }
+
+  function items(prefix, start, size) {
+    var obj = {};
+    for (var i = start; i < start + size; i++)
+      obj[key(prefix, i)] = C.value(valueSize);
+    return obj;
+  }
+}
@@ -0,0 +1,452 @@
+// # bench/ycsb.js #
+//
+// A YCSB-style workload driver. It loads a database in a temporary
+// directory, warms it up, and then runs a mix of reads, updates,
+// inserts, scans and read-modify-writes for a while, printing
+// throughput and latency percentiles for each interval. Run with:
+//
+//     node bench/ycsb.js [--workload=a] [--backend=kct] [--records=100000]
+//       [--distribution=zipfian] [--concurrency=16] [--rate=0]
+//       [--warmup=5] [--duration=30] [--interval=1] [--slo=10]
+//       [--syncEvery=0] [--valueSize=100] [--out=results.json]
+//
+// Workloads `a` to `f` are the YCSB core workloads; `--read`,
+// `--update`, `--insert`, `--scan` and `--rmw` override their
+// proportions. Keys are chosen with the `zipfian`, `uniform` or
+// `latest` distribution.
+//
+// With `--rate=0` the driver is closed-loop: `--concurrency` callers
+// each start a new operation as soon as the last one finishes. With a
+// rate, it's open-loop: operations start on a fixed schedule whatever
+// the latency, and latency is measured from the scheduled start, so a
+// stall shows up in every operation that should have started during
+// it. `--slo` is a latency target in milliseconds; the report gives
+// the fraction of operations that met it. `--syncEvery` calls
+// `synchronize()` every so many seconds during the run.
+//
+// Intervals go to stderr as they finish; the summary (and the
+// intervals) go to `--out` or stdout as JSON.
+
+var Kyoto = require('../kyoto'),
+    Fs = require('fs'),
+    C = require('./common'),
+    WORKLOADS = {
+      a: { read: 0.5, update: 0.5, distribution: 'zipfian' },
+      b: { read: 0.95, update: 0.05, distribution: 'zipfian' },
+      c: { read: 1, distribution: 'zipfian' },
+      d: { read: 0.95, insert: 0.05, distribution: 'latest' },
+      e: { scan: 0.95, insert: 0.05, distribution: 'zipfian' },
+      f: { read: 0.5, rmw: 0.5, distribution: 'zipfian' }
+    },
+    OPS = ['read', 'update', 'insert', 'scan', 'rmw'],
+    options = C.parseArgs(process.argv.slice(2), {
+      workload: 'a',
+      backend: 'kct',
+      records: 100000,
+      distribution: '',
+      read: -1,
+      update: -1,
+      insert: -1,
+      scan: -1,
+      rmw: -1,
+      maxScan: 100,
+      concurrency: 16,
+      rate: 0,
+      maxInflight: 10000,
+      warmup: 5,
+      duration: 30,
+      interval: 1,
+      slo: 10,
+      syncEvery: 0,
+      keySize: 16,
+      valueSize: 100,
+      out: ''
+    }),
+    mix = makeMix(),
+    ordered = /^(\+|%|kct|kcf)$/.test(options.backend),
+    isFile = !/^[-+*%]$/.test(options.backend),
+    dir = isFile && C.tempDir(),
+    path = isFile ? (dir + '/ycsb.' + options.backend) : options.backend,
+    inserted = options.records,
+    chooser,
+    db;
+
+Kyoto.open(path, 'w+', function(err) {
+  if (err) throw err;
+  db = this;
+  chooser = makeChooser(mix.distribution);
+
+  load(function() {
+    console.error('# warm-up %ds', options.warmup);
+    run(options.warmup, false, function() {
+      console.error('# run %ds', options.duration);
+      run(options.duration, true, finish);
+    });
+  });
+});
+
+function finish(intervals, total) {
+  var output = JSON.stringify({
+    date: new Date().toISOString(),
+    node: process.version,
+    options: options,
+    mix: mix,
+    summary: total,
+    intervals: intervals
+  }, null, 2);
+
+  db.close(function(err) {
+    if (err) throw err;
+    if (dir) C.removeDir(dir);
+    if (options.out)
+      Fs.writeFileSync(options.out, output);
+    else
+      console.log(output);
+  });
+}
+
+
+// ## Workload ##
+
+// The proportions of each operation and the key distribution, from
+// the workload with any overrides.
+function makeMix() {
+  var base = WORKLOADS[options.workload],
+      result = {},
+      total = 0;
+
+  if (!base)
+    throw new Error('Unknown workload: ' + options.workload);
+
+  result.distribution = options.distribution || base.distribution;
+
+  OPS.forEach(function(op) {
+    result[op] = (options[op] >= 0) ? options[op] : (base[op] || 0);
+    total += result[op];
+  });
+
+  if (total <= 0)
+    throw new Error('The workload has no operations.');
+
+  OPS.forEach(function(op) {
+    result[op] /= total;
+  });
+
+  return result;
+}
+
+function chooseOp() {
+  var pick = Math.random(), sum = 0;
+
+  for (var i = 0; i < OPS.length; i++) {
+    sum += mix[OPS[i]];
+    if (pick < sum)
+      return OPS[i];
+  }
+
+  return OPS[OPS.length - 1];
+}
+
+// Start operation `op`, calling `next` when it's finished.
+function perform(op, next) {
+  var index, len, cursor;
+
+  switch (op) {
+  case 'read':
+    return db.get(key(chooser()), next);
+
+  case 'update':
+    return db.set(key(chooser()), value(), next);
+
+  case 'insert':
+    return db.set(key(inserted++), value(), next);
+
+  case 'scan':
+    index = chooser();
+    len = 1 + Math.floor(Math.random() * options.maxScan);
+    if (ordered)
+      return db.range({ gte: key(index), limit: len }, next);
+    cursor = db.cursor();
+    return cursor.jump(key(index), function(err) {
+      if (err && err.code != Kyoto.NOREC) return next(err);
+      cursor.getBlock(len, next);
+    });
+
+  case 'rmw':
+    index = chooser();
+    return db.get(key(index), function(err) {
+      if (err) return next(err);
+      db.set(key(index), value(), next);
+    });
+  }
+}
+
+function key(index) {
+  return C.key('user', index, options.keySize);
+}
+
+function value() {
+  return C.value(options.valueSize, Math.floor(Math.random() * 8));
+}
+
+
+// ## Key Distributions ##
+
+// Return a function that picks the index of an existing record.
+function makeChooser(name) {
+  var zipf;
+
+  switch (name) {
+  case 'uniform':
+    return function() {
+      return Math.floor(Math.random() * inserted);
+    };
+
+  case 'zipfian':
+    // Popular items are spread over the keyspace, as in YCSB's
+    // scrambled zipfian generator.
+    zipf = new Zipfian(0.99);
+    return function() {
+      return fnv(zipf.next(inserted)) % inserted;
+    };
+
+  case 'latest':
+    // The most recent inserts are the most popular.
+    zipf = new Zipfian(0.99);
+    return function() {
+      return Math.max(0, inserted - 1 - zipf.next(inserted));
+    };
+
+  default:
+    throw new Error('Unknown distribution: ' + name);
+  }
+}
+
+// Zipfian-distributed integers in [0, n), from Gray et al., "Quickly
+// Generating Billion-Record Synthetic Databases". `n` may grow between
+// calls; the zeta sum is extended as it does.
+function Zipfian(theta) {
+  this.theta = theta;
+  this.alpha = 1 / (1 - theta);
+  this.zeta2 = 1 + Math.pow(0.5, theta);
+  this.n = 0;
+  this.zetan = 0;
+}
+
+Zipfian.prototype.next = function(n) {
+  if (n != this.n)
+    this.grow(n);
+
+  var u = Math.random(),
+      uz = u * this.zetan;
+
+  if (uz < 1)
+    return 0;
+  if (uz < this.zeta2)
+    return 1;
+  return Math.min(n - 1, Math.floor(n * Math.pow(this.eta * u - this.eta + 1, this.alpha)));
+};
+
+Zipfian.prototype.grow = function(n) {
+  for (var i = this.n + 1; i <= n; i++)
+    this.zetan += 1 / Math.pow(i, this.theta);
+  this.n = n;
+  this.eta = (1 - Math.pow(2 / n, 1 - this.theta)) / (1 - this.zeta2 / this.zetan);
+};
+
+// 32-bit FNV-1a of an integer's digits.
+function fnv(num) {
+  var text = String(num), hash = 0x811c9dc5;
+
+  for (var i = 0; i < text.length; i++) {
+    hash ^= text.charCodeAt(i);
+    // Multiply by the FNV prime with shifts, which stay exact.
+    hash = (hash + (hash << 1) + (hash << 4) + (hash << 7) +
+            (hash << 8) + (hash << 24)) >>> 0;
+  }
+
+  return hash;
+}
+
+
+// ## Phases ##
+
+// Insert the initial records in batches.
+function load(done) {
+  var batch = 1000,
+      start = C.now();
+
+  console.error('# load %d records', options.records);
+  C.concurrent(4, Math.ceil(options.records / batch), function(i, next) {
+    var items = {};
+    for (var j = i * batch; j < Math.min(options.records, (i + 1) * batch); j++)
+      items[key(j)] = value();
+    db.setBulk(items, next);
+  }, function() {
+    console.error('# loaded in %dms', Math.round(C.now() - start));
+    done();
+  });
+}
+
+// Run the workload for `seconds`. If `measure` is true, report each
+// interval and pass the intervals and a summary to `done`.
+function run(seconds, measure, done) {
+  var start = C.now(),
+      end = start + seconds * 1000,
+      current = new Interval(start),
+      total = new Interval(start),
+      intervals = [],
+      inflight = 0,
+      dropped = 0,
+      issued = 0,
+      stopping = false,
+      completed = false,
+      ticker,
+      syncer;
+
+  ticker = setInterval(tick, options.interval * 1000);
+  if (options.syncEvery > 0)
+    syncer = setInterval(sync, options.syncEvery * 1000);
+
+  if (options.rate > 0)
+    openLoop();
+  else
+    for (var i = 0; i < options.concurrency; i++)
+      closedLoop();
+
+  // Each caller starts another operation when the last one finishes.
+  function closedLoop() {
+    if (C.now() >= end)
+      return stop();
+    start1(chooseOp(), C.now(), closedLoop);
+  }
+
+  // Start operations on schedule. Timers are coarse, so each tick
+  // starts every operation that's due; their latency still counts
+  // from when they were due.
+  function openLoop() {
+    var interval = 1000 / options.rate,
+        timer = setInterval(function() {
+          var time = C.now();
+
+          if (time >= end) {
+            clearInterval(timer);
+            return stop();
+          }
+
+          while (start + issued * interval <= time) {
+            var due = start + issued * interval;
+            issued++;
+            if (inflight >= options.maxInflight)
+              dropped++;
+            else
+              start1(chooseOp(), due, noop);
+          }
+        }, 1);
+  }
+
+  function start1(op, due, next) {
+    inflight++;
+    perform(op, function(err) {
+      if (err && err.code != Kyoto.NOREC) throw err;
+      var latency = C.now() - due;
+      inflight--;
+      current.add(op, latency);
+      total.add(op, latency);
+      next();
+      if (stopping && inflight === 0) finished();
+    });
+  }
+
+  function sync() {
+    var began = C.now();
+    db.synchronize(function(err) {
+      if (err) throw err;
+      current.add('sync', C.now() - began);
+      total.add('sync', C.now() - began);
+    });
+  }
+
+  function tick() {
+    var time = C.now(),
+        report = current.report(time);
+
+    if (measure) {
+      intervals.push(report);
+      console.error('%ds %d ops/s %s', Math.round((time - start) / 1000),
+                    report.opsPerSec, describe(report));
+    }
+    current = new Interval(time);
+  }
+
+  function stop() {
+    if (stopping)
+      return;
+    stopping = true;
+    if (inflight === 0)
+      finished();
+  }
+
+  function finished() {
+    if (!stopping || inflight !== 0 || completed)
+      return;
+    completed = true;
+    clearInterval(ticker);
+    if (syncer) clearInterval(syncer);
+
+    var summary = total.report(C.now());
+    summary.dropped = dropped;
+    if (measure)
+      console.error('# total %d ops/s %s', summary.opsPerSec, describe(summary));
+    done(intervals, summary);
+  }
+}
+
+function describe(report) {
+  return Object.keys(report.ops).map(function(op) {
+    var latency = report.ops[op];
+    return op + ' p50=' + latency.p50 + ' p99=' + latency.p99 + ' p999=' + latency.p999;
+  }).join(' ') + ' slo=' + report.sloMet;
+}
+
+function noop() {}
+
+
+// ## Intervals ##
+
+// Latencies for each kind of operation over a period of time.
+function Interval(start) {
+  this.start = start;
+  this.count = 0;
+  this.met = 0;
+  this.latencies = {};
+}
+
+Interval.prototype.add = function(op, latency) {
+  if (!(op in this.latencies))
+    this.latencies[op] = new C.Latencies();
+  this.latencies[op].add(latency);
+
+  if (op != 'sync') {
+    this.count++;
+    if (latency <= options.slo) this.met++;
+  }
+};
+
+// Throughput, percentiles in microseconds, and the fraction of
+// operations that met the SLO.
+Interval.prototype.report = function(time) {
+  var elapsed = time - this.start,
+      ops = {};
+
+  for (var op in this.latencies)
+    ops[op] = this.latencies[op].summary();
+
+  return {
+    elapsed: Math.round(elapsed),
+    ops: ops,
+    count: this.count,
+    opsPerSec: elapsed ? Math.round(this.count / elapsed * 1000) : 0,
+    sloMet: this.count ? Math.round(this.met / this.count * 10000) / 10000 : 1
+  };
+};
@@ -5,13 +5,47 @@
 // possible to do all of this in the bindings, but it's easier this
 // way.
 
-var K = require('./build/default/_kyoto'),
+var Util = require('util'),
+    Stream = require('stream'),
+    K = require('./build/default/_kyoto'),
     LOGIC = K.PolyDB.LOGIC,
-    NOREC = K.PolyDB.NOREC;
+    NOREC = K.PolyDB.NOREC,
+    BLOCK_RECORDS = 1024,
+    BLOCK_BYTES = 1048576,
+    BATCH_OPS = {
+      set: K.PolyDB.BSET,
+      add: K.PolyDB.BADD,
+      replace: K.PolyDB.BREPLACE,
+      append: K.PolyDB.BAPPEND,
+      remove: K.PolyDB.BREMOVE,
+      increment: K.PolyDB.BINCREMENT,
+      cas: K.PolyDB.BCAS
+    },
+    UPDATE_OPS = {
+      max: K.PolyDB.UMAX,
+      min: K.PolyDB.UMIN,
+      push: K.PolyDB.UPUSH,
+      pop: K.PolyDB.UPOP,
+      addToSet: K.PolyDB.USETADD,
+      removeFromSet: K.PolyDB.USETREMOVE,
+      count: K.PolyDB.UCOUNT,
+      merge: K.PolyDB.UMERGE,
+      mergeJSON: K.PolyDB.UMERGEJSON
+    };
 
 exports.open = open;
 exports.KyotoDB = KyotoDB;
+exports.openSharded = openSharded;
+exports.ShardedKyotoDB = ShardedKyotoDB;
+exports.shardOf = K.shardOf;
+exports.allocStats = K.allocStats;
+exports.completionStats = K.completionStats;
 exports.Cursor = Cursor;
+exports.Batch = Batch;
+exports.pack = pack;
+exports.unpack = unpack;
+exports.PackedEncoder = PackedEncoder;
+exports.PackedDecoder = PackedDecoder;
 
 // Re-export all constants.
 for (var name in K.PolyDB) {
@@ -52,13 +86,20 @@ for (var name in K.PolyDB) {
 //     }
 
 // Create a new KyotoDB instance and open it.
-function open(path, mode, next) {
-  return (new KyotoDB()).open(path, mode, next);
+function open(path, mode, options, next) {
+  return (new KyotoDB()).open(path, mode, options, next);
 }
 
 // Construct a new database hande.
 function KyotoDB() {
   this.db = null;
+  this.binary = false;
+  this.coalescer = null;
+  this.durability = null;
+  this.inline = false;
+  this.cache = null;
+  this.tierTimer = null;
+  this.bloom = false;
 }
 
 // Open a database.
@@ -75,6 +116,9 @@ function KyotoDB() {
 //
 //   + `-` - memory hash
 //   + `+` - memory tree
+//   + `:` - stash
+//   + `*` - cache hash
+//   + `%` - cache tree
 //
 // The `path` can also have tuning parameters appended to
 // it. Parameters should be given in a `#key1=value1#key2=value2...`
@@ -88,37 +132,123 @@ function KyotoDB() {
 //   + `w+` - read/write (always make a new file)
 //   + `a+` - read/write (make a new file if it doesn't exist)
 //
-// open(path, mode='r', next)
-//
-//   + path - String database file.
-//   + mode - String open mode (optional, default: 'r' or 'w+' if memory-only)
-//   + next - Function(Error) callback
+// These `options` are understood:
+//
+//   + binary   - Boolean return values as Buffers (default: false)
+//   + bloom    - Boolean or Object, see `bloomStats()` (default: off)
+//   + coalesce - Object or true, see `setCoalescing()` (default: off)
+//   + durability - Object or String policy, see `setDurability()`
+//                (default: off)
+//   + cache    - Number bytes or Object, see `setCache()` (default: off)
+//   + inline   - Boolean run `get()`, `set()`, `remove()`, and
+//                `getBulk()` on the main thread if the database is
+//                memory-only and has no `tier` (default: false)
+//   + pageCache - Number bytes of page cache for a file tree
+//                (`#pccap`), e.g. for a bulk load (default: Kyoto's)
+//   + tier     - Object { mode: 'through', count: 0, bytes: 64MB,
+//                flushInterval: 1000 } hot tier, see below; a limit
+//                of 0 means none (default: off)
+//   + workers  - Number of threads or Object { foreground: 2,
+//                background: 1 } for a dedicated thread pool
+//                (default: use the shared libeio pool)
+//
+// Inline operations skip the thread pool entirely, which is much
+// faster for memory databases. Callbacks are still called on a later
+// tick.
+//
+// With a dedicated pool, the database's requests don't wait behind
+// `fs` calls or other databases. Low priority jobs run on the
+// background threads so they don't hold up ordinary requests; see
+// `priority()`. See `workerStats()` to size the pool.
+//
+// The `tier` option puts a bounded in-memory cache database in front
+// of the file. `get()` checks it first and promotes what it finds in
+// the file; `set()`, `add()`, `replace()`, `append()` and `remove()`
+// go through it. Both tiers are used in the same request, so a miss
+// costs no more than it would without the tier. Unlike the read
+// cache, hits still go through the thread pool.
+//
+// In `through` mode, writes go to the file and then to the tier, so
+// the file always has everything. In `back` mode, writes only go to
+// the tier and are written to the file by `flushTier()`, every
+// `flushInterval` milliseconds, when records are demoted to make
+// room, and before any other request (bulk operations, cursors,
+// `synchronize()`, ...) so those always see every write. A crash
+// loses unflushed writes.
+//
+// open(path, mode='r', options={}, next)
+//
+//   + path    - String database file.
+//   + mode    - String open mode (optional, default: 'r' or 'w+' if memory-only)
+//   + options - Object binding options (optional)
+//   + next    - Function(Error) callback
 //
 // Returns self.
-KyotoDB.prototype.open = function(path, mode, next) {
+KyotoDB.prototype.open = function(path, mode, options, next) {
   var self = this;
 
-  if (this.db !== null) {
-    next.call(this, null);
-    return this;
-  }
-
   if (typeof mode == 'function') {
     next = mode;
-    mode = (path == '-' || path == '+') ? 'w+' : 'r';
+    mode = options = undefined;
+  }
+  else if (typeof options == 'function') {
+    next = options;
+    options = undefined;
+  }
+
+  if (mode !== null && typeof mode == 'object') {
+    options = mode;
+    mode = undefined;
   }
 
   if (!next)
     next = noop;
 
+  if (this.db !== null) {
+    next.call(this, null);
+    return this;
+  }
+
+  if (mode === undefined)
+    mode = isMemory(path) ? 'w+' : 'r';
+
+  options = options || {};
+  if (options.binary !== undefined)
+    this.binary = !!options.binary;
+  if (options.coalesce)
+    this.setCoalescing(options.coalesce);
+  if (options.durability)
+    this.setDurability(options.durability);
+  // The inline methods go straight to the database, past the tier.
+  this.inline = !!options.inline && isMemory(path) && !options.tier;
+
   var omode = parseMode(mode);
   if (!omode) {
     next.call(this, new Error('Badly formatted mode: `' + mode + '`.'));
     return this;
   }
 
+  if (options.pageCache)
+    path += '#pccap=' + options.pageCache;
+
   var db = new K.PolyDB();
+  db.setBinary(this.binary);
+  this.bloom = !!options.bloom;
+  if (options.bloom)
+    db.setBloom(options.bloom.bits || 8388608, options.bloom.hashes || 7);
+  if (options.cache)
+    this._startCache(db, options.cache);
+  if (options.workers) {
+    var workers = options.workers;
+    if (typeof workers == 'number')
+      workers = { foreground: workers };
+    db.startWorkers(workers.foreground || 1, workers.background || 1);
+  }
+
   db.open(path, omode, function(err) {
+    if (!err && options.tier)
+      err = self._startTier(db, options.tier);
+
     if (err)
       next.call(self, err);
     else {
@@ -146,6 +276,20 @@ KyotoDB.prototype.close = function(next) {
     return this;
   }
 
+  // Batches run on the thread pool, so the close has to wait for them.
+  if (this.coalescer && (this.coalescer.callbacks.length || this.coalescer.pending)) {
+    this.coalescer.drain(function() { self.close(next); });
+    return this;
+  }
+
+  if (this.durability) {
+    var durability = this.durability;
+    this.durability = null;
+    durability.stop(function() { self.close(next); });
+    return this;
+  }
+
+  this._stopTier();
   this.db.close(function(err) {
     if (err)
       next.call(self, err);
@@ -159,6 +303,13 @@ KyotoDB.prototype.close = function(next) {
 };
 
 KyotoDB.prototype.closeSync = function() {
+  if (this.coalescer)
+    this.coalescer.abort(new Error('closeSync: database closed before write.'));
+  if (this.durability) {
+    this.durability.abort(new Error('closeSync: database closed before sync.'));
+    this.durability = null;
+  }
+  this._stopTier();
   if (this.db) {
     this.db.closeSync();
     this.db = null;
@@ -185,17 +336,30 @@ KyotoDB.prototype.clear = function(next) {
 // Get a value from the database.
 //
 // If the value does not exist, `next` is called with a `null` error
-// and an undefined `value`.
+// and an undefined `value`. In binary mode, `value` is a Buffer.
 //
-// + key  - String key
+// + key  - String or Buffer key
 // + next - Function(Error, String value, String key) callback
 //
 // Returns self.
 KyotoDB.prototype.get = function(key, next) {
-  var self = this;
+  var self = this,
+      cached;
 
   if (this.db === null)
     next.call(this, new Error('get: database is closed.'));
+  else if (this.cache && (cached = this.db.getCached(key)) !== undefined) {
+    if (this.cache.sync)
+      next.call(this, null, cached, key);
+    else
+      process.nextTick(function() { next.call(self, null, cached, key); });
+  }
+  else if (this.bloom && !this.db.mayContain(key))
+    process.nextTick(function() { next.call(self, null, undefined, key); });
+  else if (this.inline)
+    this._inline(next, 'getSync', key, function(val) {
+      return [null, val, key];
+    });
   else
     this.db.get(key, function(err, val) {
       if (err && err.code == NOREC)
@@ -209,21 +373,130 @@ KyotoDB.prototype.get = function(key, next) {
   return this;
 };
 
+// Get a value from the database as a Buffer.
+//
+// This is `get()` in binary mode for a single call; the mode of the
+// handle is unchanged.
+//
+// + key  - String or Buffer key
+// + next - Function(Error, Buffer value, String key) callback
+//
+// Returns self.
+KyotoDB.prototype.getBuffer = function(key, next) {
+  if (this.db === null)
+    return this.get(key, next);
+
+  this.db.setBinary(true);
+  this.get(key, next);
+  this.db.setBinary(this.binary);
+
+  return this;
+};
+
+// Switch binary mode on or off.
+//
+// In binary mode, values, matched keys, and cursor results are
+// returned as Buffers instead of Strings. Keys and values can be
+// given as Buffers in either mode; they're passed to Kyoto Cabinet
+// as-is without being transcoded.
+//
+// + flag - Boolean binary mode
+//
+// Returns self.
+KyotoDB.prototype.setBinary = function(flag) {
+  this.binary = !!flag;
+  if (this.db !== null)
+    this.db.setBinary(this.binary);
+  return this;
+};
+
 // Get a set of values from the database.
 //
 // Look up each key in the `keys` array; call `next` with a result
 // object that maps each key to its value. If the item doesn't exist,
 // `key` will not be in the result object.
 //
-// + keys   - Array of keys
+// The keys may also be a packed list (see pack()). Then the result is
+// a packed list of alternating keys and values for the items found,
+// and no JavaScript value is made for any item.
+//
+// + keys   - Array|Buffer of keys
 // + atomic - Boolean fetch all keys atomically (optional, default: false)
-// + next   - Function(Error, Object items, Array keys)
+// + next   - Function(Error, Object|Buffer items, Array|Buffer keys)
 //
 // Returns self
 KyotoDB.prototype.getBulk = function(keys, atomic, next) {
+  var self = this;
+
+  if (this.bloom && this.db && Array.isArray(keys)) {
+    if (typeof atomic == 'function') {
+      next = atomic;
+      atomic = undefined;
+    }
+
+    var maybe = this.db.filterKeys(keys);
+    if (maybe.length === 0) {
+      process.nextTick(function() { next.call(self, null, {}, keys); });
+      return this;
+    }
+
+    return this._bulk('getBulk', maybe, atomic, function(err, items) {
+      next.call(self, err, items, keys);
+    });
+  }
+
   return this._bulk('getBulk', keys, atomic, next);
 };
 
+// Get a set of values as an Array.
+//
+// Unlike getBulk(), the values come back in the same order as `keys`,
+// and keys don't need to be valid property names. A missing item is
+// a hole in the Array. The keys may also be a packed list (see
+// pack()).
+//
+// + keys   - Array|Buffer keys
+// + atomic - Boolean fetch all keys atomically (optional, default: false)
+// + next   - Function(Error, Array values)
+//
+// Returns self
+KyotoDB.prototype.getColumns = function(keys, atomic, next) {
+  if (typeof atomic == 'function') {
+    next = atomic;
+    atomic = false;
+  }
+
+  return this._columns('getColumns', [keys, !!atomic], next);
+};
+
+// Set several items at once from parallel Arrays.
+//
+// The items may also be given as one packed list of alternating keys
+// and values (see pack()), leaving out `values`; it's read in a worker
+// thread. Upon success, `next` is called with the number of items
+// written.
+//
+// + keys   - Array|Buffer keys, or a packed list of items
+// + values - Array values (not given with a packed list)
+// + atomic - Boolean perform atomic operation (optional, default: false)
+// + next   - Function(Error, Integer written)
+//
+// Returns self
+KyotoDB.prototype.setColumns = function(keys, values, atomic, next) {
+  if (Buffer.isBuffer(keys)) {
+    next = atomic;
+    atomic = values;
+    values = null;
+  }
+
+  if (typeof atomic == 'function') {
+    next = atomic;
+    atomic = false;
+  }
+
+  return this._columns('setColumns', [keys, values, !!atomic], next || noop);
+};
+
 // Find a set of keys that start with the given prefix.
 //
 // If `max` is given, the list of keys returned will be at most `max`
@@ -256,6 +529,65 @@ KyotoDB.prototype.matchRegex = function(pattern, max, next) {
   return this._match('matchRegex', pattern, max, next);
 };
 
+// Scan the whole database with several threads at once.
+//
+// Records are filtered in the worker threads; only those that match
+// every filter given are passed back, in batches, while the scan is
+// running. If `onBatch` isn't given, the matches are collected and
+// passed to `done`. The scan's statistics include the number of
+// records and bytes scanned, the elapsed time in milliseconds, and
+// the throughput.
+//
+// The order of records and batches is undefined.
+//
+// + options - Object scan options:
+//   + threads       - Integer scanning threads (optional, default: 4)
+//   + keyPrefix     - String keys must start with this (optional)
+//   + keyRegex      - String|RegExp keys must match this (optional)
+//   + valueContains - String values must contain this (optional)
+//   + limit         - Integer stop after this many matches (optional)
+//   + batch         - Integer matches per batch (optional, default: 1024)
+// + onBatch - Function(Array keys, Array values) batch handler (optional)
+// + done    - Function(Error, Object stats, Array keys, Array values) callback
+//
+// Returns self
+KyotoDB.prototype.scanParallel = function(options, onBatch, done) {
+  var self = this,
+      regex = options.keyRegex || '',
+      limit = (options.limit === undefined) ? -1 : options.limit,
+      keys,
+      values;
+
+  if (!done) {
+    done = onBatch;
+    keys = [];
+    values = [];
+    onBatch = function(k, v) {
+      keys.push.apply(keys, k);
+      values.push.apply(values, v);
+    };
+  }
+
+  if (regex instanceof RegExp)
+    regex = regex.source;
+
+  if (this.db === null)
+    done.call(this, new Error('scanParallel: database is closed.'));
+  else
+    this.db.scanParallel(
+      options.threads || 4,
+      options.keyPrefix || '',
+      regex,
+      options.valueContains || '',
+      limit,
+      options.batch || BLOCK_RECORDS,
+      function(k, v) { onBatch.call(self, k, v); },
+      function(err, stats) { done.call(self, err, stats, keys, values); }
+    );
+
+  return this;
+};
+
 // Append to a value in the database.
 //
 // + key    - String key
@@ -340,11 +672,18 @@ KyotoDB.prototype.replace = function(key, val, next) {
 KyotoDB.prototype.remove = function(key, next) {
   var self = this;
 
-  if (!next)
-    next = noop;
+  next = this._durable(next || noop, key.length);
 
   if (this.db === null)
     next.call(this, new Error('remove: database is closed.'));
+  else if (this.inline)
+    this._inline(next, 'removeSync', key, function(removed) {
+      return [removed ? null : noRecord('remove')];
+    });
+  else if (this.coalescer)
+    this.coalescer.push(BATCH_OPS.remove, key, null, function(err) {
+      next.call(self, err);
+    });
   else
     this.db.remove(key, function(err) {
       next.call(self, err);
@@ -364,8 +703,7 @@ KyotoDB.prototype.remove = function(key, next) {
 KyotoDB.prototype.cas = function(key, ovalue, nvalue, next) {
   var self = this;
 
-  if (!next)
-    next = noop;
+  next = this._durable(next || noop, key.length + (nvalue ? nvalue.length : 0));
 
   if (this.db === null)
     next.call(this, new Error('cas: database is closed.'));
@@ -377,12 +715,122 @@ KyotoDB.prototype.cas = function(key, ovalue, nvalue, next) {
   return this;
 };
 
+// Update a record in place.
+//
+// The update is read, changed and written in one request, atomically,
+// so concurrent updates never need to retry the way a `get()` and
+// `cas()` loop does. These operations are understood:
+//
+//   + max, min      - Number; keep the larger (smaller) of the record
+//                     and `arg`, as decimal text. Result: the record.
+//   + push          - item or Object { value: item, limit: 0 }; add
+//                     the item to the end of a packed list (see
+//                     pack()), dropping items from the front to keep
+//                     at most `limit`. Result: the record.
+//   + pop           - no `arg`; take the last item off a packed list.
+//                     The record is removed once it's empty. Result:
+//                     the item, or undefined if there wasn't one.
+//   + addToSet      - item; add it to a packed list of distinct items.
+//                     Result: true if it was added.
+//   + removeFromSet - item; take it out of the list. Result: true if
+//                     it was there.
+//   + count         - index or Object { index: 0, delta: 1 }; add to
+//                     one of an array of 8-byte counters in the format
+//                     `increment()` uses. Result: the new count.
+//   + merge         - Object; set its fields in a record that's a
+//                     packed list of alternating fields and values,
+//                     deleting the fields that are null. The record
+//                     is removed once it has no fields. Result: the
+//                     record, or undefined if it was removed.
+//   + mergeJSON     - Object; apply it as a JSON merge patch (RFC
+//                     7386) to a record that holds JSON text. Nested
+//                     objects are merged and null deletes a member.
+//                     The record is removed once it's `{}`. Result:
+//                     the record's JSON text, or undefined if it was
+//                     removed. A patch that isn't an Object, or that
+//                     nests more than 64 deep, throws.
+//
+// A missing record starts out empty (or as `arg`, for max and min).
+// A record in the wrong format fails with `INVALID`.
+//
+// + key  - String|Buffer key
+// + op   - String operation
+// + arg  - argument for `op` (optional for pop)
+// + next - Function(Error, result, String key) callback
+//
+// Returns self.
+KyotoDB.prototype.update = function(key, op, arg, next) {
+  var self = this,
+      code = UPDATE_OPS[op];
+
+  if (typeof arg == 'function') {
+    next = arg;
+    arg = null;
+  }
+
+  next = this._durable(next || noop, key.length);
+
+  if (this.db === null)
+    next.call(this, new Error('update: database is closed.'));
+  else if (code === undefined)
+    next.call(this, new Error('update: unknown operation `' + op + '`.'));
+  else
+    this.db.update(key, code, updateArg(op, arg), function(err, result) {
+      next.call(self, err, result, key);
+    });
+
+  return this;
+};
+
+// Run several updates in one request.
+//
+// Each update is atomic by itself; see `update()`. The callback gets
+// an array with an error or null for each update, and an array of
+// their results.
+//
+// + updates - Array of [key, op, arg] updates
+// + next    - Function(Error, Array errors, Array results)
+//
+// Returns self.
+KyotoDB.prototype.updateBulk = function(updates, next) {
+  var self = this,
+      ops = [],
+      bytes = 0;
+
+  next = next || noop;
+  for (var i = 0; i < updates.length; i++) {
+    var item = updates[i],
+        code = UPDATE_OPS[item[1]];
+
+    if (code === undefined) {
+      next.call(this, new Error('updateBulk: unknown operation `' + item[1] + '`.'));
+      return this;
+    }
+
+    ops.push(code, item[0], updateArg(item[1], item[2]));
+    bytes += item[0].length;
+  }
+
+  next = this._durable(next, bytes);
+
+  if (this.db === null)
+    next.call(this, new Error('updateBulk: database is closed.'));
+  else
+    this.db.updateBulk(ops, function(err, errors, results) {
+      next.call(self, err, errors, results);
+    });
+
+  return this;
+};
+
 // Set multiple items at once the database.
 //
 // Set all key/value pairs in the `items` object; call `next` with the
-// number of items written.
+// number of items written. The items may also be a packed list of
+// alternating keys and values (see pack()), which is read in a worker
+// thread.
 //
-// + items  - Object of key/value items
+// + items  - Object|Buffer of key/value items
 // + atomic - Boolean perform atomic operation (optional, default: false)
 // + next   - Function(Error, Integer written, Object items)
 //
@@ -410,6 +858,10 @@ KyotoDB.prototype.removeBulk = function(keys, atomic, next) {
 // with the underlying device. Otherwise, logically synchronize with
 // the file system.
 //
+// Concurrent calls share physical syncs: a call waits for the next
+// sync to start after it, which serves every call made before it
+// started. See `syncStats()`.
+//
 // + hard - Boolean physical sync (optional, default: false)
 // + next - Function(Error) callback
 //
@@ -465,6 +917,117 @@ KyotoDB.prototype.loadSnapshot = function(path, next) {
   return this._snap('loadSnapshot', path, next);
 };
 
+// Load records whose keys are already sorted into an ordered
+// database, much faster than setBulk(). The source is a packed list
+// of alternating keys and values (see pack()): a Buffer, the path of a
+// file, or a readable stream of record-aligned Buffers (pipe a byte
+// stream through a PackedDecoder first).
+//
+// Records are written one by one in key order with no transaction,
+// and the database is synchronized once at the end. Every key is
+// checked against the one before it, across chunks; loading stops
+// with an `INVALID` error at the first key out of order, leaving the
+// records before it. For a nightly rebuild, open a fresh `.kct` with
+// a large `pageCache` and load it in one call.
+//
+// + source  - Buffer|String|Stream packed records
+// + options - Object load options (optional):
+//   + sync  - Boolean hard-synchronize at the end (default: true)
+// + next    - Function(Error, Object stats) callback; the stats are
+//             `records`, `bytes`, `elapsed` (ms) and `recordsPerSec`
+//
+// Returns self
+KyotoDB.prototype.loadSorted = function(source, options, next) {
+  var self = this,
+      db = this.db,
+      start = Date.now(),
+      stats = { records: 0, bytes: 0, elapsed: 0, recordsPerSec: 0 },
+      last = null,
+      queue = [],
+      busy = false,
+      ended = false,
+      stopped = false;
+
+  if (typeof options == 'function') {
+    next = options;
+    options = undefined;
+  }
+  options = options || {};
+
+  if (db === null) {
+    next.call(this, new Error('loadSorted: database is closed.'));
+    return this;
+  }
+
+  if (typeof source == 'string' || Buffer.isBuffer(source))
+    load(source, finish);
+  else {
+    // Chunks are loaded one at a time, in order. Streams that can't
+    // be paused queue up behind the one being loaded.
+    source.on('data', function(chunk) {
+      queue.push(chunk);
+      if (source.pause) source.pause();
+      drain();
+    });
+    source.on('end', function() {
+      ended = true;
+      drain();
+    });
+    source.on('error', fail);
+  }
+
+  function drain() {
+    if (busy || stopped)
+      return;
+    else if (queue.length) {
+      busy = true;
+      load(queue.shift(), function(err) {
+        busy = false;
+        if (err)
+          return fail(err);
+        if (source.resume && !queue.length && !ended) source.resume();
+        drain();
+      });
+    }
+    else if (ended) {
+      stopped = true;
+      finish(null);
+    }
+  }
+
+  function load(chunk, done) {
+    db.loadSorted(chunk, last, function(err, records, key, bytes) {
+      stats.records += records || 0;
+      stats.bytes += bytes || 0;
+      if (key) last = key;
+      done(err);
+    });
+  }
+
+  function fail(err) {
+    if (stopped) return;
+    stopped = true;
+    if (source.destroy) source.destroy();
+    finish(err);
+  }
+
+  function finish(err) {
+    if (err)
+      return report(err);
+    if (options.sync === false)
+      return report(null);
+    db.synchronize(true, report);
+  }
+
+  function report(err) {
+    stats.elapsed = Date.now() - start;
+    stats.recordsPerSec = stats.elapsed ? Math.round(stats.records / stats.elapsed * 1000) : stats.records;
+    next.call(self, err, stats);
+  }
+
+  return this;
+};
+
 // Find the number of records currently stored.
 //
 // + next - Function(Error, Integer) callback
@@ -483,6 +1046,16 @@ KyotoDB.prototype.size = function(next) {
   return this._stat('size', next);
 };
 
+// Start a batch of mutations to commit together; see Batch.
+//
+// + options - Object batch options (optional):
+//   + transaction - Boolean commit in a transaction (default: true)
+//
+// Returns Batch instance.
+KyotoDB.prototype.batch = function(options) {
+  return new Batch(this, options);
+};
+
 // Retrieve status information about the current database.
 //
 // + next - Function(Error, Object info) callback
@@ -492,79 +1065,452 @@ KyotoDB.prototype.status = function(next) {
   return this._stat('status', next);
 };
 
-// TODO: merge, scan_parallel
-
-// KyotoDB.prototype.merge = function(others, next) {
-//   var self = this;
-
-//   next = next || noop;
-//   for (var i = 0, l = others.length; i < l; i++) {
-//     if (!(others instanceof KyotoDB)) {
-//       next.call(this, new Error('merge: requires array of KyotoDB instances.'));
-//       return this;
-//     }
-//   }
-
-//   if (this.db === null)
-//     next.call(this, new Error('merge: database is closed.'));
-//   else
-//     this.db.merge(others, function(err) {
-//       next.call(self, err);
-//     });
+// Turn write coalescing on or off.
+//
+// When coalescing is on, `set()`, `add()`, `replace()`, `append()`,
+// and `remove()` calls made in the same tick are buffered and sent
+// to the database as one job. Each call still gets its own callback
+// and its own error. A batch is sent early once it reaches `maxOps`
+// operations or `maxBytes` bytes of keys and values.
+//
+// Writes in one batch are applied in the order they were made. As
+// with separate calls, there's no ordering between a batch and other
+// requests such as `get()`.
+//
+// + options - Object { maxOps: 1000, maxBytes: 1MB }, true, or false
+//
+// Returns self.
+KyotoDB.prototype.setCoalescing = function(options) {
+  if (this.coalescer)
+    this.coalescer.flush();
 
-//   return this;
-// };
+  if (!options)
+    this.coalescer = null;
+  else
+    this.coalescer = new Coalescer(this, (options === true) ? {} : options);
 
-// A low-level helper method. See add() or set().
-KyotoDB.prototype._modify = function(method, key, val, next) {
-  var self = this;
+  return this;
+};
 
-  if (!next)
-    next = noop;
+// Acknowledge writes only once they're synchronized.
+//
+// With a durability policy, the callbacks of successful writes
+// (`set()`, `remove()`, `setBulk()`, batches and the like) are held
+// until a sync made after the write has finished, and get its error
+// if it fails. Writes held at the same time share one sync, so this
+// is much cheaper than `OAUTOSYNC`. The policy says when to sync:
+//
+//   + write    - as soon as a write is held; writes made while a
+//                sync runs wait for the next one
+//   + interval - every `interval` milliseconds
+//   + bytes    - once `bytes` bytes of keys and values are held, or
+//                `interval` milliseconds after the first of them was
+//                held, whichever comes first
+//
+// + options - Object { policy: 'write', interval: 10, bytes: 1MB,
+//             hard: true }, a policy name, or false to turn it off
+//
+// Returns self.
+KyotoDB.prototype.setDurability = function(options) {
+  if (this.durability)
+    this.durability.stop();
 
-  if (this.db === null)
-    next.call(this, new Error(method + ': database is closed.'));
+  if (!options)
+    this.durability = null;
   else
-    this.db[method](key, val, function(err) {
-      next.call(self, err, val, key);
-    });
+    this.durability = new Durability(this, (typeof options == 'string') ? { policy: options } : options);
 
   return this;
 };
 
-// A low-level helper method. See increment().
-KyotoDB.prototype._inc = function(method, key, num, orig, next) {
-  var self = this;
-
-  if (typeof orig != 'number') {
-    next = orig;
-    orig = 0;
-  }
+// Keep recently read values in memory.
+//
+// With the read cache on, `get()` answers from an LRU cache of
+// recently read values when it can, without going to the thread
+// pool. Every write through this handle (including bulk writes,
+// batches, cursor writes, and the Toji extensions) drops the keys it
+// changes, so the cache never returns a value older than a write
+// that has called back. Writes made by other processes aren't seen.
+//
+// Hits call back on the next tick, like every other request, unless
+// `sync` is set; then they call back before `get()` returns.
+//
+// + options - Number bytes, Object { bytes: 64MB, sync: false }, or
+//             false to turn the cache off
+//
+// Returns self.
+KyotoDB.prototype.setCache = function(options) {
+  if (this.db)
+    this._startCache(this.db, options);
+  return this;
+};
 
-  if (!next)
-    next = noop;
+// Report how well the read cache is doing.
+//
+//   + hits, misses  - Integer lookups made by `get()`
+//   + hitRate       - Number fraction of lookups that hit
+//   + inserts       - Integer values added
+//   + evictions     - Integer values dropped to make room
+//   + invalidations - Integer writes that dropped values
+//   + entries       - Integer values held now
+//   + bytes         - Integer bytes held now, of `capacity`
+//
+// Returns Object or null if the cache is off.
+KyotoDB.prototype.cacheStats = function() {
+  return this.db && this.db.cacheStats();
+};
 
-  if (this.db === null)
-    next.call(this, new Error(method + ': database is closed.'));
+// Write a `back` tier's dirty records to the file.
+//
+// + next - Function(Error) callback
+//
+// Returns self.
+KyotoDB.prototype.flushTier = function(next) {
+  var self = this;
+  next = next || noop;
+  if (!this.db)
+    next.call(this, new Error('flushTier: database is closed.'));
   else
-    this.db[method](key, num, orig, function(err, value, key) {
-      next.call(self, err, value, key);
+    this.db.flushTier(function(err) {
+      next.call(self, (err && err.code == K.PolyDB.NOIMPL) ? null : err);
     });
-
   return this;
 };
 
-// See getBulk(), setBulk(), &c
-KyotoDB.prototype._bulk = function(method, what, atomic, next) {
-  var self = this;
+// Report how well the Bloom filter is doing.
+//
+// The `bloom` option to `open()` keeps a Bloom filter of the keys in
+// the database. `get()` and `getBulk()` (with an Array of keys) skip
+// keys the filter says are missing, answering without a trip to the
+// thread pool. Every write through this handle adds its keys; removed
+// keys stay in the filter, even through `clear()`, so it fills up
+// over time. It's only emptied when it's rebuilt as the database
+// opens. A file database's filter is saved in `<path>.bloom` when
+// it's closed, and rebuilt with a scan when it's opened if the file
+// is missing or out of date: it records the database file's inode,
+// size, modification time and record count, and is only loaded if
+// they all still match. Nothing is kept in the database itself.
+// Writes made by other programs while it's open aren't seen.
+//
+// The option is true or an Object { bits: 8388608, hashes: 7 }. For a
+// false positive rate of about 1%, give the filter 10 bits per key
+// and 7 hashes.
+//
+//   + bits, hashes   - Integer size of the filter
+//   + keys           - Integer keys added
+//   + fill           - Number fraction of bits set
+//   + fpRate         - Number false positive rate estimated from `fill`
+//   + checks         - Integer keys checked
+//   + negatives      - Integer keys answered without a lookup
+//   + falsePositives - Integer lookups that found nothing anyway
+//   + observedFpRate - Number fraction of missing keys that were
+//                      looked up
+//
+// Returns Object or null if there's no filter.
+KyotoDB.prototype.bloomStats = function() {
+  return this.db && this.db.bloomStats();
+};
+
+// Report how well the hot tier is doing.
+//
+//   + writeBack    - Boolean true in `back` mode
+//   + hits, misses - Integer reads made through the tier
+//   + hitRate      - Number fraction of reads that hit
+//   + promotions   - Integer records copied up from the file
+//   + demotions    - Integer records dropped to make room
+//   + flushes      - Integer times dirty records were written
+//   + count, bytes - Integer records and bytes held now
+//   + dirty        - Integer records not yet in the file
+//
+// Returns Object or null if there's no tier.
+KyotoDB.prototype.tierStats = function() {
+  return this.db && this.db.tierStats();
+};
+
+KyotoDB.prototype._startTier = function(db, options) {
+  var self = this,
+      back = options.mode == 'back';
+
+  if (options.mode && !back && options.mode != 'through')
+    return new Error('Unknown tier mode: `' + options.mode + '`.');
+
+  try {
+    db.openTier(back, options.count || 0,
+                (options.bytes === undefined) ? 67108864 : options.bytes);
+  } catch (err) {
+    return err;
+  }
+
+  if (back && options.flushInterval !== 0)
+    this.tierTimer = setInterval(function() {
+      if (self.db) self.db.flushTier(noop);
+    }, options.flushInterval || 1000);
+
+  return null;
+};
+
+KyotoDB.prototype._stopTier = function() {
+  if (this.tierTimer) {
+    clearInterval(this.tierTimer);
+    this.tierTimer = null;
+  }
+};
+
+KyotoDB.prototype._startCache = function(db, options) {
+  if (typeof options == 'number')
+    options = { bytes: options };
+
+  if (!options) {
+    this.cache = null;
+    db.setCache(0);
+  }
+  else {
+    this.cache = { sync: !!options.sync };
+    db.setCache(options.bytes || 67108864);
+  }
+};
+
+// Report how synchronize requests have been grouped.
+//
+//   + requests - Integer synchronize requests made
+//   + syncs    - Integer physical syncs that served them
+//   + held     - Integer writes acknowledged after a sync, if there's
+//                a durability policy
+//
+// Returns Object or null if the database is closed.
+KyotoDB.prototype.syncStats = function() {
+  if (!this.db)
+    return null;
+
+  var stats = this.db.syncStats();
+  if (this.durability)
+    stats.held = this.durability.held;
+  return stats;
+};
+
+// Report on the dedicated thread pool.
+//
+// Each priority class has these numbers:
+//
+//   + threads  - Integer threads serving the class
+//   + depth    - Integer jobs waiting now
+//   + maxDepth - Integer most jobs ever waiting
+//   + jobs     - Integer jobs started
+//   + waitMean - Number average microseconds spent waiting
+//   + waitMax  - Number longest wait in microseconds
+//
+// Returns Object { high, normal, low } or null if the database uses
+// the shared pool.
+KyotoDB.prototype.workerStats = function() {
+  return this.db && this.db.workerStats();
+};
+
+// Get the timings of requests made so far, by method.
+//
+// Methods are named like their native bindings (`get`, `setBulk`,
+// `cursor.get`, ...). Each one has the number of requests in flight
+// and four histograms, in microseconds:
+//
+//   + queue    - waiting for a worker thread
+//   + exec     - running in Kyoto
+//   + deliver  - waiting for the main thread afterward
+//   + callback - running the JavaScript callback
+//
+// Each histogram has `count`, `mean`, `min`, `max`, `p50`, `p90`,
+// `p99` and `p999`. Requests answered inline aren't timed.
+//
+// + reset - Boolean start the histograms over (optional)
+//
+// Returns Object of methods or null if the database is closed.
+KyotoDB.prototype.metrics = function(reset) {
+  return this.db && this.db.metrics(!!reset);
+};
+
+// Make requests with a different priority.
+//
+// Every request has a priority class:
+//
+//   + `PHIGH`   - point reads and writes like `get()` and `set()`
+//   + `PNORMAL` - bulk operations, matches, counts, and cursors
+//   + `PLOW`    - `copy()`, snapshots, `synchronize()`, `clear()`
+//
+// Higher priority requests are run first. In a dedicated pool (see
+// the `workers` option of `open()`), low priority requests run on
+// separate background threads and normal requests that have waited
+// too long are run ahead of high ones, so nothing starves. The shared
+// pool ages by count instead: after a long run of high requests, the
+// ones already waiting are served first, in order.
+//
+// This returns a view of the database whose methods make requests
+// with the given priority. Cursors and iterations started through the
+// view keep it. For example:
+//
+//     db.priority(Kyoto.PLOW).matchRegex(/^log:/, done);
+//
+// + priority - Integer priority class
+//
+// Returns Object view.
+KyotoDB.prototype.priority = function(priority) {
+  var view = {};
+
+  for (var name in KyotoDB.prototype) {
+    if (name.charAt(0) != '_' && name != 'priority')
+      view[name] = prioritize(this, KyotoDB.prototype[name], priority);
+  }
+
+  return view;
+};
+
+// Report how well writes are being coalesced.
+//
+// The `sizes` histogram maps a power of two to the number of batches
+// with at most that many (and more than half as many) operations.
+//
+// Returns Object { batches, ops, sizes } or null if coalescing is off.
+KyotoDB.prototype.coalesceStats = function() {
+  if (!this.coalescer)
+    return null;
+
+  var stats = this.coalescer.stats;
+  return {
+    batches: stats.batches,
+    ops: stats.ops,
+    sizes: copy(stats.sizes)
+  };
+};
+
+// TODO: merge
+
+// KyotoDB.prototype.merge = function(others, next) {
+//   var self = this;
+
+//   next = next || noop;
+//   for (var i = 0, l = others.length; i < l; i++) {
+//     if (!(others instanceof KyotoDB)) {
+//       next.call(this, new Error('merge: requires array of KyotoDB instances.'));
+//       return this;
+//     }
+//   }
+
+//   if (this.db === null)
+//     next.call(this, new Error('merge: database is closed.'));
+//   else
+//     this.db.merge(others, function(err) {
+//       next.call(self, err);
+//     });
+
+//   return this;
+// };
+
+// A low-level helper method. See add() or set().
+KyotoDB.prototype._modify = function(method, key, val, next) {
+  var self = this;
+
+  next = this._durable(next || noop, key.length + val.length);
+
+  if (this.db === null)
+    next.call(this, new Error(method + ': database is closed.'));
+  else if (this.inline && method == 'set')
+    this._inline(next, 'setSync', key, val, function() {
+      return [null, val, key];
+    });
+  else if (this.coalescer)
+    this.coalescer.push(BATCH_OPS[method], key, val, function(err) {
+      next.call(self, err, val, key);
+    });
+  else
+    this.db[method](key, val, function(err) {
+      next.call(self, err, val, key);
+    });
+
+  return this;
+};
+
+// A low-level helper method. See increment().
+KyotoDB.prototype._inc = function(method, key, num, orig, next) {
+  var self = this;
+
+  if (typeof orig != 'number') {
+    next = orig;
+    orig = 0;
+  }
+
+  next = this._durable(next || noop, key.length + 8);
+
+  if (this.db === null)
+    next.call(this, new Error(method + ': database is closed.'));
+  else
+    this.db[method](key, num, orig, function(err, value, key) {
+      next.call(self, err, value, key);
+    });
+
+  return this;
+};
+
+// Wrap the callback of a write of about `bytes` bytes so it's held
+// until the write is synchronized. See setDurability().
+KyotoDB.prototype._durable = function(next, bytes) {
+  var durability = this.durability;
+
+  if (!durability)
+    return next;
+
+  return function(err) {
+    var self = this,
+        args = Array.prototype.slice.call(arguments);
+
+    if (err)
+      return next.apply(self, args);
+
+    durability.hold(bytes, function(err) {
+      if (err) args[0] = err;
+      next.apply(self, args);
+    });
+  };
+};
+
+// Run a synchronous native `method` with some arguments. Its result
+// is passed to `done`, which returns the arguments for `next`. The
+// callback is called on the next tick to keep the API asynchronous.
+//
+// _inline(next, method, arg1, ..., done)
+KyotoDB.prototype._inline = function(next, method) {
+  var self = this,
+      args = Array.prototype.slice.call(arguments, 2),
+      done = args.pop(),
+      result;
+
+  try {
+    result = done(this.db[method].apply(this.db, args));
+  } catch (err) {
+    result = [err];
+  }
+
+  process.nextTick(function() {
+    next.apply(self, result);
+  });
+
+  return this;
+};
+
+// See getBulk(), setBulk(), &c
+KyotoDB.prototype._bulk = function(method, what, atomic, next) {
+  var self = this;
 
   if (typeof atomic == 'function') {
     next = atomic;
     atomic = undefined;
   }
 
+  if (method != 'getBulk')
+    next = this._durable(next, bulkSize(what));
+
   if (this.db === null)
     next.call(this, new Error(method + ': database is closed.'));
+  else if (this.inline && method == 'getBulk' && !Buffer.isBuffer(what))
+    this._inline(next, 'getBulkSync', what, !!atomic, function(result) {
+      return [null, result, what];
+    });
   else
     this.db[method](what, !!atomic, function(err, result) {
       if (err)
@@ -576,6 +1522,23 @@ KyotoDB.prototype._bulk = function(method, what, atomic, next) {
   return this;
 };
 
+// See getColumns() &c
+KyotoDB.prototype._columns = function(method, args, next) {
+  var self = this;
+
+  if (method == 'setColumns')
+    next = this._durable(next, bulkSize(args[1]));
+
+  if (this.db === null)
+    next.call(this, new Error(method + ': database is closed.'));
+  else
+    this.db[method].apply(this.db, args.concat([function(err, result) {
+      next.call(self, err, result);
+    }]));
+
+  return this;
+};
+
 // See matchPrefix() &c
 KyotoDB.prototype._match = function(method, pattern, max, next) {
   var self = this;
@@ -630,6 +1593,29 @@ KyotoDB.prototype.cursor = function() {
   return new Cursor(this);
 };
 
+// Create an iterator that reads items ahead of time.
+//
+// See Iterator.
+//
+// + options - Object iterator options (optional)
+//
+// Returns Iterator instance.
+KyotoDB.prototype.iterator = function(options) {
+  return new Iterator(this, options);
+};
+
+// Create a readable stream of `{ key: ..., value: ... }` items.
+//
+// See Iterator for the options; `highWaterMark` also sets the
+// stream's own buffer size.
+//
+// + options - Object stream options (optional)
+//
+// Returns ReadStream instance.
+KyotoDB.prototype.createReadStream = function(options) {
+  return new ReadStream(this, options);
+};
+
 // Iterate over all items in the database in an async-each style.
 //
 // The `fn` iterator is called with each item in the database in the
@@ -639,6 +1625,9 @@ KyotoDB.prototype.cursor = function() {
 // When an error is encountered or all items have been visited,
 // `done` is called.
 //
+// Records are read ahead by an Iterator, so the database is read
+// while `fn` is busy with earlier records.
+//
 // + done - Function(Error) finished callback
 // + fn   - Function(String value, String key, Function next) iterator
 //
@@ -647,7 +1636,11 @@ KyotoDB.prototype.each = function(done, fn) {
   var self = this,
       wantsNext = false,
       finished = false,
-      cursor = this.cursor();
+      iterator = this.iterator(),
+      cursor = iterator.cursor,
+      keys = [],
+      values = [],
+      index = 0;
 
   if (!fn) {
     fn = done;
@@ -655,229 +1648,2031 @@ KyotoDB.prototype.each = function(done, fn) {
   }
 
   wantsNext = fn.length > 2;
-  cursor.jump(function(err) {
-    if (err && err.code === NOREC)
-      finish();
-    else if (err)
-      finish(err);
-    else
-      step();
-  });
+  fetch();
+
+  function fetch() {
+    iterator.nextBlock(function(err, k, v) {
+      if (err)
+        finish(err);
+      else if (!k)
+        finish();
+      else {
+        keys = k;
+        values = v;
+        index = 0;
+        step();
+      }
+    });
+  }
 
   function step(err) {
-    err ? finish(err) : cursor.get(true, dispatch);
+    if (err)
+      return finish(err);
+
+    try {
+      while (index < keys.length) {
+        var i = index++;
+        if (wantsNext)
+          return fn.call(cursor, values[i], keys[i], step);
+        fn.call(cursor, values[i], keys[i], noop);
+      }
+    } catch (x) {
+      return finish(x);
+    }
+
+    fetch();
+  }
+
+  function finish(err) {
+    if (!finished) {
+      finished = true;
+      iterator.end();
+      process.nextTick(function() { done.call(self, err); });
+    }
+  }
+
+  return this;
+};
+
+// Read the items between two keys of an ordered database.
+//
+// The bounds are compared with the database's own comparator, and
+// the whole walk runs in the worker threads, a chunk at a time. If
+// `onChunk` is given, it's called with each chunk of keys and values;
+// it may take a third `next` argument to pause the walk. Otherwise
+// all items are collected and passed to `done`.
+//
+// Unordered (hash) databases can't do this; `done` gets a `NOIMPL`
+// error.
+//
+// + options - Object range options:
+//   + gte, gt  - String lower bound, inclusive or exclusive (optional)
+//   + lte, lt  - String upper bound, inclusive or exclusive (optional)
+//   + limit    - Integer maximum number of items (optional)
+//   + reverse  - Boolean walk from the upper bound down (optional)
+//   + keysOnly - Boolean don't read values (optional)
+//   + chunk    - Integer items per chunk (optional)
+// + onChunk - Function(Array keys, Array values, Function next) chunk handler (optional)
+// + done    - Function(Error, Array keys, Array values) finished callback
+//
+// Returns self.
+KyotoDB.prototype.range = function(options, onChunk, done) {
+  var self = this,
+      C = K.Cursor,
+      limit = options.limit || 0,
+      chunk = options.chunk || BLOCK_RECORDS,
+      lower = ('gte' in options) ? options.gte : options.gt,
+      upper = ('lte' in options) ? options.lte : options.lt,
+      lowerFlags = 0,
+      upperFlags = 0,
+      flags = C.RJUMP,
+      start = '',
+      end = '',
+      seen = 0,
+      wantsNext,
+      allKeys,
+      allValues,
+      cursor;
+
+  if (!done) {
+    done = onChunk;
+    onChunk = null;
+  }
+
+  if (this.db === null) {
+    done.call(this, new Error('range: database is closed.'));
+    return this;
+  }
+
+  if (lower !== undefined)
+    lowerFlags = ('gte' in options) ? 1 : 2;
+  if (upper !== undefined)
+    upperFlags = ('lte' in options) ? 1 : 2;
+
+  if (options.reverse) {
+    flags |= C.RBACK;
+    setBounds(upper, upperFlags, lower, lowerFlags);
+  }
+  else
+    setBounds(lower, lowerFlags, upper, upperFlags);
+
+  if (options.keysOnly)
+    flags |= C.RKEYS;
+
+  if (onChunk)
+    wantsNext = onChunk.length > 2;
+  else {
+    allKeys = [];
+    allValues = options.keysOnly ? null : [];
+  }
+
+  cursor = new K.Cursor(this.db);
+  fetch();
+
+  function setBounds(first, firstFlags, last, lastFlags) {
+    if (firstFlags) {
+      start = first;
+      flags |= (firstFlags == 1) ? C.RSTART : (C.RSTART | C.RSTARTX);
+    }
+    if (lastFlags) {
+      end = last;
+      flags |= (lastFlags == 1) ? C.REND : (C.REND | C.RENDX);
+    }
+  }
+
+  function fetch() {
+    var max = limit ? Math.min(chunk, limit - seen) : chunk;
+    cursor.getRange(start, end, flags, max, BLOCK_BYTES, received);
+    flags &= ~C.RJUMP;
+  }
+
+  function received(err, keys, values, ended) {
+    if (err)
+      return done.call(self, err);
+
+    seen += keys.length;
+    ended = ended || (limit && seen >= limit);
+
+    if (!onChunk) {
+      allKeys.push.apply(allKeys, keys);
+      if (allValues) allValues.push.apply(allValues, values);
+      return ended ? done.call(self, null, allKeys, allValues) : fetch();
+    }
+
+    if (ended && keys.length == 0)
+      return done.call(self, null);
+
+    try {
+      if (wantsNext)
+        onChunk.call(self, keys, values, function(err) {
+          if (err || ended)
+            done.call(self, err || null);
+          else
+            fetch();
+        });
+      else {
+        onChunk.call(self, keys, values);
+        ended ? done.call(self, null) : fetch();
+      }
+    } catch (x) {
+      done.call(self, x);
+    }
+  }
+
+  return this;
+};
+
+// Compare two keys in the database's order: with its comparator if
+// it's ordered, or byte by byte if it isn't.
+//
+// + a - String or Buffer key
+// + b - String or Buffer key
+//
+// Returns Integer, negative if `a` comes first, 0 if the keys are the
+// same, positive if `b` comes first.
+KyotoDB.prototype.compare = function(a, b) {
+  if (this.db === null)
+    throw new Error('compare: database is closed.');
+  return this.db.compare(a, b);
+};
+
+
+// ## ShardedKyotoDB ##
+
+// A ShardedKyotoDB spreads its keys over several databases by hash,
+// so writers aren't serialized on one database's locks and each file
+// stays small enough to copy or rebuild. It has the same API as a
+// KyotoDB for everything keyed:
+//
+//   + point operations go to the key's shard
+//   + bulk operations are split by shard and run on all shards at
+//     once; their results are merged. An atomic bulk operation must
+//     keep to one shard; one that spans shards gets an error
+//   + `matchPrefix()`, `matchRegex()`, `range()` and `scanParallel()`
+//     run on every shard and merge the results in the shards' key
+//     order (see `compare()`)
+//   + `each()` visits the shards one after another
+//   + `count()` and `size()` are totals; `status()`, `metrics()` and
+//     `workerStats()` give an Array with an entry per shard
+//
+// Cursors, iterators and batches belong to one database, so a
+// ShardedKyotoDB has none; use `shard(key)` to get the KyotoDB that
+// holds a key.
+//
+//     Kyoto.openSharded('data/users.kch', 'a+', { shards: 8 }, function(err) {
+//       this.set('alice', '1', ...);
+//     });
+function ShardedKyotoDB() {
+  this.shards = [];
+}
+
+// Create a new ShardedKyotoDB instance and open it.
+function openSharded(path, mode, options, next) {
+  return (new ShardedKyotoDB()).open(path, mode, options, next);
+}
+
+// Open the shards. Shard `i` of `users.kch` is `users.i.kch`; memory
+// databases just open `shards` of the same kind. Every shard gets its
+// own worker pool (one foreground and one background thread unless
+// `workers` says otherwise) so each shard runs on its own threads.
+//
+// The options are those of `KyotoDB.prototype.open()`, and:
+//
+//   + shards - Integer number of shards (default: 4)
+//
+// The number of shards decides where every key lives; a database
+// must always be opened with the same number.
+//
+// Returns self.
+ShardedKyotoDB.prototype.open = function(path, mode, options, next) {
+  var self = this,
+      opened = [],
+      count;
+
+  if (typeof mode == 'function') {
+    next = mode;
+    mode = options = undefined;
   }
+  else if (typeof options == 'function') {
+    next = options;
+    options = undefined;
+  }
+
+  if (mode !== null && typeof mode == 'object') {
+    options = mode;
+    mode = undefined;
+  }
+
+  options = copy(options || {});
+  next = next || noop;
+  count = options.shards || 4;
+  if (!options.workers)
+    options.workers = { foreground: 1, background: 1 };
+
+  for (var i = 0; i < count; i++)
+    opened.push(new KyotoDB());
+
+  fanOut(opened, function(db, i, done) {
+    db.open(shardPath(path, i), mode, options, done);
+  }, function(err) {
+    if (err)
+      closeAll(opened, function() { next.call(self, err); });
+    else {
+      self.shards = opened;
+      next.call(self, null);
+    }
+  });
+
+  return this;
+};
+
+// Close every shard.
+ShardedKyotoDB.prototype.close = function(next) {
+  var self = this,
+      shards = this.shards;
+
+  next = next || noop;
+  this.shards = [];
+  closeAll(shards, function(err) {
+    next.call(self, err);
+  });
+  return this;
+};
+
+// Compare two keys the way the shards order them. See
+// `KyotoDB.prototype.compare()`.
+ShardedKyotoDB.prototype.compare = function(a, b) {
+  return this.shards[0].compare(a, b);
+};
+
+// The KyotoDB that holds `key`, or null if the shards aren't open.
+ShardedKyotoDB.prototype.shard = function(key) {
+  if (this.shards.length === 0)
+    return null;
+  return this.shards[K.shardOf(key, this.shards.length)];
+};
+
+// Point operations go to the key's shard.
+['get', 'getBuffer', 'set', 'add', 'replace', 'append', 'increment',
+ 'incrementDouble', 'cas', 'remove', 'update'].forEach(function(method) {
+  ShardedKyotoDB.prototype[method] = function(key) {
+    var db = this.shard(key);
+    if (db)
+      db[method].apply(db, arguments);
+    else
+      this._closed(method, arguments[arguments.length - 1]);
+    return this;
+  };
+});
+
+// Bulk operations are split by shard. Shards with nothing to do are
+// skipped.
+ShardedKyotoDB.prototype.getBulk = function(keys, atomic, next) {
+  if (typeof atomic == 'function') {
+    next = atomic;
+    atomic = false;
+  }
+
+  return this._bulk('getBulk', keys, atomic, {}, function(result, items) {
+    for (var key in items)
+      result[key] = items[key];
+    return result;
+  }, next);
+};
+
+ShardedKyotoDB.prototype.setBulk = function(items, atomic, next) {
+  if (typeof atomic == 'function') {
+    next = atomic;
+    atomic = false;
+  }
+
+  return this._bulk('setBulk', items, atomic, 0, sum, next);
+};
+
+ShardedKyotoDB.prototype.removeBulk = function(keys, atomic, next) {
+  if (typeof atomic == 'function') {
+    next = atomic;
+    atomic = false;
+  }
+
+  return this._bulk('removeBulk', keys, atomic, 0, sum, next);
+};
+
+// Each shard runs its own updates in one request; the errors and
+// results come back in the order of `updates`.
+ShardedKyotoDB.prototype.updateBulk = function(updates, next) {
+  var self = this,
+      parts = [],
+      places = [];
+
+  next = next || noop;
+  if (this._closed('updateBulk', next))
+    return this;
+
+  for (var i = 0; i < this.shards.length; i++) {
+    parts.push([]);
+    places.push([]);
+  }
+
+  updates.forEach(function(update, i) {
+    var index = K.shardOf(update[0], parts.length);
+    parts[index].push(update);
+    places[index].push(i);
+  });
+
+  this._all(function(db, i, done) {
+    if (parts[i].length === 0)
+      return done(null, null);
+    db.updateBulk(parts[i], function(err, errors, results) {
+      done(err, { errors: errors, results: results });
+    });
+  }, function(err, outcomes) {
+    if (err) return next.call(self, err);
+
+    var errors = [],
+        results = [];
+
+    outcomes.forEach(function(outcome, i) {
+      if (!outcome) return;
+      places[i].forEach(function(place, j) {
+        errors[place] = outcome.errors[j];
+        results[place] = outcome.results[j];
+      });
+    });
+
+    next.call(self, null, errors, results);
+  });
+
+  return this;
+};
+
+ShardedKyotoDB.prototype.matchPrefix = function(prefix, max, next) {
+  return this._match('matchPrefix', prefix, max, next);
+};
+
+ShardedKyotoDB.prototype.matchRegex = function(pattern, max, next) {
+  return this._match('matchRegex', pattern, max, next);
+};
+
+// Read a range from every shard and merge it in key order, a chunk
+// at a time. Each shard's walk is paused until the chunk it last read
+// has been merged, so at most a chunk per shard is held. `onChunk`
+// and `done` are as for `KyotoDB.prototype.range()`.
+ShardedKyotoDB.prototype.range = function(options, onChunk, done) {
+  var self = this,
+      limit = options.limit || 0,
+      reverse = !!options.reverse,
+      stop = new Error('range: stopped.'),
+      shards = [],
+      running = this.shards.length,
+      seen = 0,
+      failed = null,
+      stopping = false,
+      paused = false,
+      finished = false,
+      wantsNext,
+      allKeys,
+      allValues;
+
+  if (!done) {
+    done = onChunk;
+    onChunk = null;
+  }
+
+  if (this._closed('range', done))
+    return this;
+
+  if (onChunk)
+    wantsNext = onChunk.length > 2;
+  else {
+    allKeys = [];
+    allValues = options.keysOnly ? null : [];
+  }
+
+  this.shards.forEach(function(db) {
+    var shard = { keys: [], values: null, pos: 0, next: null, ended: false };
+    shards.push(shard);
+
+    db.range(options, function(keys, values, next) {
+      if (stopping)
+        return next(stop);
+      shard.keys = keys;
+      shard.values = values;
+      shard.pos = 0;
+      shard.next = next;
+      merge();
+    }, function(err) {
+      shard.ended = true;
+      shard.next = null;
+      running--;
+      if (err && err !== stop) fail(err);
+      merge();
+    });
+  });
+
+  merge();
+
+  // Merge whatever can be merged: the smallest buffered key is only
+  // known while every shard that hasn't ended has items buffered.
+  function merge() {
+    var keys = [],
+        values = options.keysOnly ? null : [],
+        resume = [],
+        i;
+
+    if (finished || paused)
+      return;
+
+    while (!stopping && !(limit && seen >= limit)) {
+      var best = -1,
+          waiting = false;
+
+      for (i = 0; i < shards.length; i++) {
+        var shard = shards[i];
+        if (shard.pos >= shard.keys.length)
+          waiting = waiting || !shard.ended;
+        else if (best < 0)
+          best = i;
+        else {
+          var order = self.compare(shard.keys[shard.pos], shards[best].keys[shards[best].pos]);
+          if (reverse ? (order > 0) : (order < 0))
+            best = i;
+        }
+      }
+
+      if (waiting || best < 0)
+        break;
+
+      shard = shards[best];
+      keys.push(shard.keys[shard.pos]);
+      if (values) values.push(shard.values[shard.pos]);
+      shard.pos++;
+      seen++;
+    }
+
+    if (limit && seen >= limit && !stopping)
+      fail(null);
+
+    // Wake the shards whose chunks are used up, or stop them all.
+    for (i = 0; i < shards.length; i++) {
+      if (shards[i].next && (stopping || shards[i].pos >= shards[i].keys.length)) {
+        resume.push(shards[i].next);
+        shards[i].next = null;
+      }
+    }
+
+    if (keys.length)
+      deliver(keys, values);
+
+    resume.forEach(function(next) { next(stopping ? stop : null); });
+
+    if (running === 0 && !paused && !finished) {
+      finished = true;
+      if (failed || onChunk)
+        done.call(self, failed);
+      else
+        done.call(self, null, allKeys, allValues);
+    }
+  }
+
+  function deliver(keys, values) {
+    if (!onChunk) {
+      allKeys.push.apply(allKeys, keys);
+      if (allValues) allValues.push.apply(allValues, values);
+      return;
+    }
+
+    try {
+      if (wantsNext) {
+        paused = true;
+        onChunk.call(self, keys, values, function(err) {
+          paused = false;
+          if (err) fail(err);
+          merge();
+        });
+      }
+      else
+        onChunk.call(self, keys, values);
+    } catch (x) {
+      paused = false;
+      fail(x);
+    }
+  }
+
+  // Stop every shard's walk; `err` is passed to `done`.
+  function fail(err) {
+    stopping = true;
+    if (err && !failed) failed = err;
+  }
+
+  return this;
+};
+
+// Scan every shard at once with `threads` spread over the shards.
+// The stats are totals, with `elapsed` the longest shard.
+ShardedKyotoDB.prototype.scanParallel = function(options, onBatch, done) {
+  var self = this,
+      each = copy(options || {});
+
+  if (!done) {
+    done = onBatch;
+    onBatch = null;
+  }
+
+  if (this._closed('scanParallel', done))
+    return this;
+
+  each.threads = Math.max(1, Math.ceil((each.threads || 4) / this.shards.length));
+
+  this._all(function(db, i, next) {
+    var args = [each, function(err, stats, keys, values) {
+      next(err, { stats: stats, keys: keys || [], values: values || [] });
+    }];
+    if (onBatch)
+      args.splice(1, 0, function(keys, values) { onBatch.call(self, keys, values); });
+    db.scanParallel.apply(db, args);
+  }, function(err, parts) {
+    if (err) return done.call(self, err);
+
+    var stats = { threads: 0, scanned: 0, bytes: 0, matched: 0, elapsed: 0 },
+        keys = [],
+        values = [];
+
+    parts.forEach(function(part) {
+      for (var name in stats) {
+        if (name == 'elapsed')
+          stats.elapsed = Math.max(stats.elapsed, part.stats.elapsed);
+        else
+          stats[name] += part.stats[name];
+      }
+      keys.push.apply(keys, part.keys);
+      values.push.apply(values, part.values);
+    });
+
+    stats.recordsPerSec = stats.elapsed ? Math.round(stats.scanned / stats.elapsed * 1000) : 0;
+    stats.bytesPerSec = stats.elapsed ? Math.round(stats.bytes / stats.elapsed * 1000) : 0;
+
+    if (options.limit && keys.length > options.limit) {
+      keys.length = options.limit;
+      values.length = options.limit;
+    }
+
+    done.call(self, null, stats, keys, values);
+  });
+
+  return this;
+};
+
+// Visit each shard in turn. See `KyotoDB.prototype.each()`.
+ShardedKyotoDB.prototype.each = function(done, fn) {
+  var self = this,
+      shards = this.shards,
+      index = 0;
+
+  if (this._closed('each', done))
+    return this;
+
+  (function loop(err) {
+    if (err || index >= shards.length)
+      return done.call(self, err || null);
+    shards[index++].each(loop, fn);
+  })();
+
+  return this;
+};
+
+ShardedKyotoDB.prototype.count = function(next) {
+  return this._stat('count', sum, next);
+};
+
+ShardedKyotoDB.prototype.size = function(next) {
+  return this._stat('size', sum, next);
+};
+
+ShardedKyotoDB.prototype.status = function(next) {
+  return this._stat('status', null, next);
+};
+
+ShardedKyotoDB.prototype.clear = function(next) {
+  return this._stat('clear', null, next);
+};
+
+ShardedKyotoDB.prototype.synchronize = function(hard, next) {
+  if (typeof hard == 'function') {
+    next = hard;
+    hard = false;
+  }
+
+  if (this._closed('synchronize', next))
+    return this;
+
+  return this._each(function(db, i, done) {
+    db.synchronize(hard, done);
+  }, next);
+};
+
+// Copy each shard to the shard paths of `path`.
+['copy', 'dumpSnapshot', 'loadSnapshot'].forEach(function(method) {
+  ShardedKyotoDB.prototype[method] = function(path, next) {
+    if (this._closed(method, next))
+      return this;
+
+    return this._each(function(db, i, done) {
+      db[method](shardPath(path, i), done);
+    }, next);
+  };
+});
+
+['setBinary', 'setCoalescing', 'setDurability'].forEach(function(method) {
+  ShardedKyotoDB.prototype[method] = function(arg) {
+    this.shards.forEach(function(db) { db[method](arg); });
+    return this;
+  };
+});
+
+['metrics', 'workerStats', 'syncStats', 'coalesceStats'].forEach(function(method) {
+  ShardedKyotoDB.prototype[method] = function(arg) {
+    return this.shards.map(function(db) { return db[method](arg); });
+  };
+});
+
+// Run `method` on each shard with its part of `what`, then fold the
+// results into `initial` with `merge`. Shards can't share a
+// transaction, so an atomic call may only touch one.
+ShardedKyotoDB.prototype._bulk = function(method, what, atomic, initial, merge, next) {
+  var self = this,
+      parts;
+
+  next = next || noop;
+
+  if (this._closed(method, next))
+    return this;
+  else if (Buffer.isBuffer(what)) {
+    next.call(this, new Error(method + ': packed lists can\'t be sharded.'));
+    return this;
+  }
+
+  parts = K.partition(what, this.shards.length);
+
+  if (atomic && parts.filter(function(part) { return !isEmpty(part); }).length > 1) {
+    next.call(this, new Error(method + ': an atomic call can\'t span shards.'));
+    return this;
+  }
+
+  this._all(function(db, i, done) {
+    if (isEmpty(parts[i]))
+      return done(null, null);
+    db[method](parts[i], atomic, done);
+  }, function(err, results) {
+    if (err) return next.call(self, err);
+
+    var result = initial;
+    for (var i = 0; i < results.length; i++) {
+      if (results[i] !== null)
+        result = merge(result, results[i]);
+    }
+    next.call(self, null, result, what);
+  });
+
+  return this;
+};
+
+ShardedKyotoDB.prototype._match = function(method, pattern, max, next) {
+  var self = this;
+
+  if (typeof max == 'function') {
+    next = max;
+    max = -1;
+  }
+
+  if (this._closed(method, next))
+    return this;
+
+  return this._all(function(db, i, done) {
+    db[method](pattern, max, done);
+  }, function(err, lists) {
+    if (err) return next.call(self, err);
+
+    var keys = [].concat.apply([], lists).sort(function(a, b) {
+      return self.compare(a, b);
+    });
+    if (max >= 0 && keys.length > max)
+      keys.length = max;
+    next.call(self, null, keys);
+  });
+};
+
+ShardedKyotoDB.prototype._stat = function(method, merge, next) {
+  var self = this;
+
+  if (this._closed(method, next))
+    return this;
+
+  return this._all(function(db, i, done) {
+    db[method](done);
+  }, function(err, results) {
+    if (err)
+      next.call(self, err);
+    else
+      next.call(self, null, merge ? results.reduce(merge, 0) : results);
+  });
+};
+
+// If the shards aren't open, pass `method`'s "database is closed"
+// error to `next`, if it's a function, and return true.
+ShardedKyotoDB.prototype._closed = function(method, next) {
+  if (this.shards.length > 0)
+    return false;
+  if (typeof next == 'function')
+    next.call(this, new Error(method + ': database is closed.'));
+  return true;
+};
+
+// Run `fn(db, i, done)` on every shard at once; call `next` with the
+// first error, if any.
+ShardedKyotoDB.prototype._each = function(fn, next) {
+  var self = this;
+  next = next || noop;
+  fanOut(this.shards, fn, function(err) {
+    next.call(self, err);
+  });
+  return this;
+};
+
+// Like `_each()`, but collect each shard's result in order.
+ShardedKyotoDB.prototype._all = function(fn, next) {
+  var results = [];
+  fanOut(this.shards, function(db, i, done) {
+    fn(db, i, function(err, result) {
+      results[i] = result;
+      done(err);
+    });
+  }, function(err) {
+    next(err, results);
+  });
+  return this;
+};
+
+// Insert the shard number before the extension and any tuning
+// parameters: `users.kch#bnum=1000000` becomes `users.3.kch#bnum=...`.
+// Memory paths are left alone.
+function shardPath(path, index) {
+  var params = path.indexOf('#'),
+      base = (params < 0) ? path : path.slice(0, params),
+      rest = (params < 0) ? '' : path.slice(params),
+      dot = base.lastIndexOf('.');
+
+  if (isMemory(path))
+    return path;
+  else if (dot <= base.lastIndexOf('/'))
+    return base + '.' + index + rest;
+  else
+    return base.slice(0, dot) + '.' + index + base.slice(dot) + rest;
+}
+
+// Call `fn(item, i, done)` for every item at once, then `next` with
+// the first error.
+function fanOut(items, fn, next) {
+  var pending = items.length,
+      first = null;
+
+  if (pending === 0)
+    return next(null);
+
+  items.forEach(function(item, i) {
+    fn(item, i, function(err) {
+      if (err && !first) first = err;
+      if (--pending === 0) next(first);
+    });
+  });
+}
+
+function closeAll(dbs, next) {
+  fanOut(dbs, function(db, i, done) { db.close(done); }, next);
+}
+
+function sum(a, b) {
+  return a + b;
+}
+
+function isEmpty(what) {
+  if (Array.isArray(what))
+    return what.length === 0;
+  for (var key in what)
+    return false;
+  return true;
+}
+
+
+// ## Cursor ##
+
+// Construct a Cursor over a KyotoDB
+//
+// + db - KyotoDB instance
+//
+// Return self
+function Cursor(db) {
+  this.db = db;
+  this.cursor = new K.Cursor(db.db);
+}
+
+// Get the current item.
+//
+// If there is no current item, call `next` with a `null` value.
+//
+// + step - Boolean step to next record afterward (optional, default: false)
+// + next - Function(Error, String value, String key) callback
+//
+// Returns self
+Cursor.prototype.get = function(step, next) {
+  if (typeof step == 'function') {
+    next = step;
+    step = false;
+  }
+
+  this.cursor.get(step, function(err, val, key) {
+    if (err && err.code == NOREC)
+      next(null);
+    else if (err)
+      next(err);
+    else
+      next(null, val, key);
+  });
+
+  return this;
+};
+
+// Get a block of items, starting with the current one.
+//
+// Read at most `max` items, stopping early once `maxBytes` bytes of
+// keys and values have been read (`0` means no byte limit). The
+// cursor moves forward, or backward if `back` is true, and is left on
+// the item after the block. The `ended` argument of `next` tells
+// whether the scan reached the end of the database.
+//
+// + max      - Integer maximum number of items
+// + maxBytes - Integer approximate size limit (optional, default: 0)
+// + back     - Boolean read backward (optional, default: false)
+// + next     - Function(Error, Array keys, Array values, Boolean ended) callback
+//
+// Returns self
+Cursor.prototype.getBlock = function(max, maxBytes, back, next) {
+  if (typeof maxBytes == 'function') {
+    next = maxBytes;
+    maxBytes = 0;
+    back = false;
+  }
+  else if (typeof back == 'function') {
+    next = back;
+    back = false;
+  }
+
+  this.cursor.getBlock(max, maxBytes, !!back, function(err, keys, values, ended) {
+    if (err)
+      next(err);
+    else
+      next(null, keys, values, ended);
+  });
+
+  return this;
+};
+
+// Like getBlock(), but get the items as one packed list of
+// alternating keys and values (see pack()).
+//
+// + max      - Integer maximum number of items
+// + maxBytes - Integer approximate size limit (optional, default: 0)
+// + back     - Boolean read backward (optional, default: false)
+// + next     - Function(Error, Buffer items, Integer count, Boolean ended) callback
+//
+// Returns self
+Cursor.prototype.getPackedBlock = function(max, maxBytes, back, next) {
+  if (typeof maxBytes == 'function') {
+    next = maxBytes;
+    maxBytes = 0;
+    back = false;
+  }
+  else if (typeof back == 'function') {
+    next = back;
+    back = false;
+  }
+
+  this.cursor.getPackedBlock(max, maxBytes, !!back, function(err, items, count, ended) {
+    if (err)
+      next(err);
+    else
+      next(null, items, count, ended);
+  });
+
+  return this;
+};
+
+// Get the key of the current item.
+//
+// If there is no current item, call `next` with a `null` key.
+//
+// + step - Boolean step to next record afterward (optional, default: false)
+// + next - Function(Error, String key) callback
+//
+// Returns self
+Cursor.prototype.getKey = function(step, next) {
+  if (typeof step == 'function') {
+    next = step;
+    step = false;
+  }
+
+  this.cursor.getKey(step, function(err, key) {
+    if (err && err.code == NOREC)
+      next(null);
+    else if (err)
+      next(err);
+    else
+      next(null, key);
+  });
+
+  return this;
+};
+
+// Get the value of the current item.
+//
+// If there is no current item, call `next` with a `null` value.
+//
+// + step - Boolean step to next record afterward (optional, default: false)
+// + next - Function(Error, String value, String value) callback
+//
+// Returns self
+Cursor.prototype.getValue = function(step, next) {
+  if (typeof step == 'function') {
+    next = step;
+    step = undefined;
+  }
+
+  this.cursor.getValue(!!step, function(err, val) {
+    if (err && err.code == NOREC)
+      next(null);
+    else if (err)
+      next(err);
+    else
+      next(null, val);
+  });
+
+  return this;
+};
+
+// Override the priority of this cursor's requests. A cursor starts at
+// the priority of the view it was made through. See
+// `KyotoDB.prototype.priority()`.
+//
+// + priority - Integer priority class, or -1 for the default
+//
+// Returns self
+Cursor.prototype.setPriority = function(priority) {
+  this.cursor.setPriority(priority);
+  return this;
+};
+
+// Switch binary mode on or off for this cursor. A cursor starts in
+// the mode of its database. See `KyotoDB.prototype.setBinary()`.
+//
+// + flag - Boolean binary mode
+//
+// Returns self
+Cursor.prototype.setBinary = function(flag) {
+  this.cursor.setBinary(!!flag);
+  return this;
+};
+
+// Set the value of the current item.
+//
+// + step - Boolean step to next record afterward (optional, default: false)
+// + next - Function(Error) callback
+//
+// Returns self
+Cursor.prototype.setValue = function(value, step, next) {
+  if (typeof step == 'function') {
+    next = step;
+    step = undefined;
+  }
+
+  this.cursor.setValue(value, !!step, next);
+
+  return this;
+};
+
+// Remove the current item.
+//
+// If there is no current item, call `next` with a `null` value.
+//
+// + step - Boolean step to next record afterward (optional, default: false)
+// + next - Function(Error) callback
+//
+// Returns self
+Cursor.prototype.remove = function(next) {
+  this.cursor.remove(next);
+  return this;
+};
+
+// Scan forward to a particular key (or prefix).
+//
+// If `to` is not given, move to the first record.
+//
+// + to   - String jump to this key (optional)
+// + next - Function(Error) callback
+//
+// Returns self
+Cursor.prototype.jump = function(to, next) {
+  if (typeof to == 'function') {
+    next = to;
+    to = undefined;
+  }
+
+  to ? this.cursor.jumpTo(to, next) : this.cursor.jump(next);
+
+  return this;
+};
+
+// Scan backward to a particular key (or prefix).
+//
+// If `to` is not given, move to the last record.
+//
+// + to   - String jump to this key (optional)
+// + next - Function(Error) callback
+//
+// Returns self
+Cursor.prototype.jumpBack = function(to, next) {
+  if (typeof to == 'function') {
+    next = to;
+    to = undefined;
+  }
+
+  to ? this.cursor.jumpBackTo(to, next) : this.cursor.jumpBack(next);
+
+  return this;
+};
+
+// Move forward to the next record.
+//
+// + next - Function(Error) callback
+//
+// Returns self
+Cursor.prototype.step = function(next) {
+  this.cursor.step(next);
+  return this;
+};
+
+// Move backward to the previous record.
+//
+// + next - Function(Error) callback
+//
+// Returns self
+Cursor.prototype.stepBack = function(next) {
+  this.cursor.stepBack(next);
+  return this;
+};
+
+
+// ## Iterator ##
+
+// An Iterator reads items in order with a cursor, keeping a buffer of
+// items read ahead. While there's room for more than `highWaterMark`
+// items in the buffer, one block fetch is kept in flight, so the
+// worker threads read the next block while JavaScript is busy with
+// the previous one.
+//
+// + db      - KyotoDB database to read
+// + options - Object iterator options (optional):
+//   + start         - String key to start from (optional)
+//   + reverse       - Boolean read backward (optional)
+//   + highWaterMark - Integer items to read ahead (optional, default: 1024)
+function Iterator(db, options) {
+  options = options || {};
+
+  this.cursor = new Cursor(db);
+  this.start = options.start;
+  this.reverse = !!options.reverse;
+  this.highWaterMark = options.highWaterMark || BLOCK_RECORDS;
+  this.blockSize = Math.ceil(this.highWaterMark / 2);
+  this.blocks = [];
+  this.offset = 0;
+  this.buffered = 0;
+  this.started = false;
+  this.fetching = false;
+  this.ended = false;
+  this.error = null;
+  this.waiting = [];
+}
+
+// Get the next item.
+//
+// When there are no more items, `next` is called without a key.
+//
+// + next - Function(Error, String value, String key) callback
+//
+// Returns self.
+Iterator.prototype.next = function(next) {
+  this.waiting.push({ fn: next, block: false });
+  this._drain();
+  this._fill();
+  return this;
+};
+
+// Get all items that have been read ahead, waiting for at least one.
+//
+// When there are no more items, `next` is called without keys.
+//
+// + next - Function(Error, Array keys, Array values) callback
+//
+// Returns self.
+Iterator.prototype.nextBlock = function(next) {
+  this.waiting.push({ fn: next, block: true });
+  this._drain();
+  this._fill();
+  return this;
+};
+
+// Stop reading ahead and drop buffered items. Later calls to `next`
+// see the end of the items.
+//
+// Returns self.
+Iterator.prototype.end = function() {
+  this.ended = true;
+  this.blocks = [];
+  this.offset = 0;
+  this.buffered = 0;
+  return this;
+};
+
+// Start another block fetch unless one is in flight or the buffer is
+// full.
+Iterator.prototype._fill = function() {
+  var self = this;
+
+  if (this.fetching || this.ended || this.error || this.buffered >= this.highWaterMark)
+    return;
+
+  this.fetching = true;
+  if (this.started)
+    fetch();
+  else {
+    this.started = true;
+    this.cursor[this.reverse ? 'jumpBack' : 'jump'](this.start, function(err) {
+      if (err && err.code == NOREC)
+        self._received(null, [], [], true);
+      else if (err)
+        self._received(err);
+      else
+        fetch();
+    });
+  }
+
+  function fetch() {
+    self.cursor.getBlock(self.blockSize, BLOCK_BYTES, self.reverse, function(err, keys, values, ended) {
+      self._received(err, keys, values, ended);
+    });
+  }
+};
+
+Iterator.prototype._received = function(err, keys, values, ended) {
+  this.fetching = false;
+
+  if (err)
+    this.error = err;
+  else if (!this.ended) {
+    if (keys.length) {
+      this.blocks.push([keys, values]);
+      this.buffered += keys.length;
+    }
+    this.ended = ended;
+  }
+
+  // Start the next fetch before handing items to JavaScript.
+  this._fill();
+  this._drain();
+  this._fill();
+};
+
+// Hand buffered items to waiting callbacks.
+Iterator.prototype._drain = function() {
+  var wait, block, keys, values, index;
+
+  while (this.waiting.length) {
+    if (this.buffered > 0) {
+      wait = this.waiting.shift();
+      block = this.blocks[0];
+
+      if (wait.block) {
+        keys = this.offset ? block[0].slice(this.offset) : block[0];
+        values = this.offset ? block[1].slice(this.offset) : block[1];
+        this.blocks.shift();
+        this.offset = 0;
+        this.buffered -= keys.length;
+        wait.fn.call(this, null, keys, values);
+      }
+      else {
+        index = this.offset++;
+        if (this.offset >= block[0].length) {
+          this.blocks.shift();
+          this.offset = 0;
+        }
+        this.buffered--;
+        wait.fn.call(this, null, block[1][index], block[0][index]);
+      }
+    }
+    else if (this.error)
+      this.waiting.shift().fn.call(this, this.error);
+    else if (this.ended)
+      this.waiting.shift().fn.call(this, null);
+    else
+      break;
+  }
+};
+
+// Iterators work with `for await` where the runtime supports it.
+if (typeof Symbol == 'function' && Symbol.asyncIterator) {
+  Iterator.prototype[Symbol.asyncIterator] = function() {
+    var self = this;
+
+    return {
+      next: function() {
+        return new Promise(function(resolve, reject) {
+          self.next(function(err, value, key) {
+            if (err)
+              reject(err);
+            else if (key === undefined)
+              resolve({ value: undefined, done: true });
+            else
+              resolve({ value: { key: key, value: value }, done: false });
+          });
+        });
+      },
+
+      return: function() {
+        self.end();
+        return Promise.resolve({ value: undefined, done: true });
+      }
+    };
+  };
+}
+
+
+// ## ReadStream ##
+
+// A ReadStream emits `{ key: ..., value: ... }` items read by an
+// Iterator. It's a `stream.Readable` in object mode where there is
+// one; otherwise it's a classic readable stream with `pause()` and
+// `resume()`. Either way, reading stops while the consumer is behind.
+//
+// + db      - KyotoDB database to read
+// + options - Object Iterator options (optional)
+function ReadStream(db, options) {
+  options = options || {};
+  this.iterator = new Iterator(db, options);
+
+  if (Stream.Readable)
+    Stream.Readable.call(this, {
+      objectMode: true,
+      highWaterMark: this.iterator.highWaterMark
+    });
+  else {
+    var self = this;
+    Stream.call(this);
+    this.readable = true;
+    this.paused = false;
+    this.keys = [];
+    this.values = [];
+    this.index = 0;
+    process.nextTick(function() { self._flow(); });
+  }
+}
+
+Util.inherits(ReadStream, Stream.Readable || Stream);
+
+if (Stream.Readable) {
+  ReadStream.prototype._read = function() {
+    var self = this;
+
+    this.iterator.nextBlock(function(err, keys, values) {
+      if (err)
+        self.emit('error', err);
+      else if (!keys)
+        self.push(null);
+      else
+        for (var i = 0, l = keys.length; i < l; i++)
+          self.push({ key: keys[i], value: values[i] });
+    });
+  };
+}
+else {
+  ReadStream.prototype.pause = function() {
+    this.paused = true;
+  };
+
+  ReadStream.prototype.resume = function() {
+    this.paused = false;
+    this._flow();
+  };
+
+  ReadStream.prototype.destroy = function() {
+    this.readable = false;
+    this.iterator.end();
+  };
+
+  ReadStream.prototype._flow = function() {
+    var self = this;
+
+    while (this.readable && !this.paused && this.index < this.keys.length) {
+      this.emit('data', { key: this.keys[this.index], value: this.values[this.index] });
+      this.index++;
+    }
+
+    if (!this.readable || this.paused || this.reading)
+      return;
+
+    this.reading = true;
+    this.iterator.nextBlock(function(err, keys, values) {
+      self.reading = false;
+      if (!self.readable)
+        return;
+      else if (err) {
+        self.readable = false;
+        self.emit('error', err);
+      }
+      else if (!keys) {
+        self.readable = false;
+        self.emit('end');
+      }
+      else {
+        self.keys = keys;
+        self.values = values;
+        self.index = 0;
+        self._flow();
+      }
+    });
+  };
+}
+
+
+// ## Batch ##
+
+// A Batch collects mutations in JavaScript and commits them all with
+// one native `writeBatch()` job: one round trip for a whole
+// read-modify-write update.
+//
+// By default the batch is committed in a transaction. Then it's all
+// or nothing: the first mutation that fails (including a `cas()`
+// whose comparison fails) rolls back the ones before it, and the
+// rest aren't tried. Without a transaction, every mutation is tried
+// and each succeeds or fails on its own.
+//
+//     db.batch()
+//       .cas('balance:a', '10', '5')
+//       .increment('balance:b', 5)
+//       .set('log:17', 'a->b 5')
+//       .commit(function(err, results) { ... });
+function Batch(db, options) {
+  options = options || {};
+  this.db = db;
+  this.transaction = (options.transaction !== false);
+  this.ops = [];
+  this.length = 0;
+  this.bytes = 0;
+}
+
+// Set a value.
+Batch.prototype.set = function(key, val) {
+  return this._push(BATCH_OPS.set, key, val);
+};
+
+// Add a value; fails with `DUPREC` if the key exists.
+Batch.prototype.add = function(key, val) {
+  return this._push(BATCH_OPS.add, key, val);
+};
+
+// Replace a value; fails with `NOREC` if the key doesn't exist.
+Batch.prototype.replace = function(key, val) {
+  return this._push(BATCH_OPS.replace, key, val);
+};
+
+// Append to a value.
+Batch.prototype.append = function(key, suffix) {
+  return this._push(BATCH_OPS.append, key, suffix);
+};
+
+// Remove a value; fails with `NOREC` if the key doesn't exist.
+Batch.prototype.remove = function(key) {
+  return this._push(BATCH_OPS.remove, key, null);
+};
+
+// Increment an integer value; its result is the new value.
+//
+// + key  - String key
+// + num  - Integer number to increment by
+// + orig - Integer base number if not already set (optional, default: 0)
+Batch.prototype.increment = function(key, num, orig) {
+  return this._push(BATCH_OPS.increment, key, [num, orig || 0]);
+};
+
+// Compare and swap; its result is whether the swap happened. See
+// `KyotoDB.prototype.cas()`.
+Batch.prototype.cas = function(key, ovalue, nvalue) {
+  return this._push(BATCH_OPS.cas, key, [ovalue, nvalue]);
+};
+
+// Apply the mutations. The batch is emptied and can be used again.
+//
+// The `results` and `errors` arrays have an entry for each mutation
+// that was tried. A result is the new value for `increment()`,
+// whether the swap happened for `cas()`, and whether the mutation
+// succeeded for the others; an error is an Error or `null`. In a
+// transaction, `err` is the error that rolled it back.
+//
+// + next - Function(Error, Array results, Array errors) callback
+//
+// Returns self.
+Batch.prototype.commit = function(next) {
+  var self = this,
+      db = this.db,
+      ops = this.ops;
+
+  next = db._durable(next || noop, this.bytes);
+  this.ops = [];
+  this.length = 0;
+  this.bytes = 0;
+
+  if (db.db === null)
+    next.call(db, new Error('batch: database is closed.'));
+  else if (ops.length === 0)
+    next.call(db, null, [], []);
+  else
+    db.db.writeBatch(ops, this.transaction, function(err, errors, results) {
+      next.call(db, err, results, errors);
+    });
+
+  return this;
+};
+
+Batch.prototype._push = function(op, key, arg) {
+  this.ops.push(op, key, arg);
+  this.length++;
+  this.bytes += key.length + ((arg && arg.length) || 0);
+  return this;
+};
+
+
+// ## Durability ##
+
+// Hold write callbacks until a sync covers their writes. See
+// `KyotoDB.prototype.setDurability()`. Only one sync is in flight at a
+// time; callbacks held while it runs go with the next one.
+function Durability(db, options) {
+  var self = this;
+
+  this.db = db;
+  this.policy = options.policy || 'write';
+  this.maxBytes = options.bytes || 1048576;
+  this.interval = options.interval || 10;
+  this.hard = (options.hard !== false);
+  this.waiting = [];
+  this.bytes = 0;
+  this.syncing = false;
+  this.again = false;
+  this.held = 0;
+  this.timer = null;
+  this.delay = null;
+
+  if (this.policy == 'interval') {
+    this.timer = setInterval(function() { self.sync(); }, this.interval);
+    if (this.timer.unref) this.timer.unref();
+  }
+  else if (this.policy != 'write' && this.policy != 'bytes')
+    throw new Error('Unknown durability policy: ' + this.policy);
+}
+
+Durability.prototype.hold = function(bytes, next) {
+  var self = this;
+
+  this.waiting.push(next);
+  this.bytes += bytes || 0;
+
+  if (this.policy == 'write' || (this.policy == 'bytes' && this.bytes >= this.maxBytes))
+    this.sync();
+  else if (this.policy == 'bytes' && !this.delay) {
+    // Don't hold a trickle of small writes forever.
+    this.delay = setTimeout(function() {
+      self.delay = null;
+      self.sync();
+    }, this.interval);
+  }
+};
+
+Durability.prototype.sync = function() {
+  var self = this,
+      waiting = this.waiting,
+      db = this.db.db;
+
+  if (this.syncing) {
+    this.again = true;
+    return;
+  }
+  else if (waiting.length === 0)
+    return;
+
+  this.waiting = [];
+  this.bytes = 0;
+  this.clearDelay();
+
+  if (db === null)
+    return this.fail(waiting, new Error('synchronize: database is closed.'));
+
+  this.syncing = true;
+  db.synchronize(this.hard, function(err) {
+    self.syncing = false;
+    self.held += waiting.length;
+    for (var i = 0, l = waiting.length; i < l; i++)
+      waiting[i](err);
+    if (self.again) {
+      self.again = false;
+      self.sync();
+    }
+  });
+};
 
-  function dispatch(err, val, key) {
-    if (err)
-      finish(err);
-    else if (val === undefined)
-      finish(err);
-    else
-      try {
-        fn.call(cursor, val, key, step);
-        wantsNext || step();
-      } catch (x) {
-        finish(x);
-      }
+// Stop syncing on a timer. Held callbacks get one last sync; `next`
+// is called after it.
+Durability.prototype.stop = function(next) {
+  if (this.timer) {
+    clearInterval(this.timer);
+    this.timer = null;
   }
 
-  function finish(err) {
-    if (!finished) {
-      finished = true;
-      process.nextTick(function() { done.call(self, err); });
-    }
+  this.clearDelay();
+  this.policy = 'write';
+  this.hold(0, next || function() {});
+};
+
+Durability.prototype.abort = function(err) {
+  var waiting = this.waiting;
+  if (this.timer) clearInterval(this.timer);
+  this.clearDelay();
+  this.waiting = [];
+  this.fail(waiting, err);
+};
+
+Durability.prototype.clearDelay = function() {
+  if (this.delay) {
+    clearTimeout(this.delay);
+    this.delay = null;
   }
+};
 
-  return this;
+Durability.prototype.fail = function(waiting, err) {
+  for (var i = 0, l = waiting.length; i < l; i++)
+    waiting[i](err);
 };
 
 
-// ## Cursor ##
+// ## Coalescer ##
 
-// Construct a Cursor over a KyotoDB
-//
-// + db - KyotoDB instance
-//
-// Return self
-function Cursor(db) {
+// Buffer writes made in the same tick and send them with one native
+// `writeBatch()` call. See `KyotoDB.prototype.setCoalescing()`.
+function Coalescer(db, options) {
   this.db = db;
-  this.cursor = new K.Cursor(db.db);
+  this.maxOps = options.maxOps || 1000;
+  this.maxBytes = options.maxBytes || 1048576;
+  this.stats = { batches: 0, ops: 0, sizes: {} };
+  this.pending = 0;
+  this.waiting = [];
+  this.reset();
 }
 
-// Get the current item.
-//
-// If there is no current item, call `next` with a `null` value.
-//
-// + step - Boolean step to next record afterward (optional, default: false)
-// + next - Function(Error, String value, String key) callback
-//
-// Returns self
-Cursor.prototype.get = function(step, next) {
-  if (typeof step == 'function') {
-    next = step;
-    step = false;
-  }
+Coalescer.prototype.reset = function() {
+  this.ops = [];
+  this.callbacks = [];
+  this.bytes = 0;
+  this.scheduled = false;
+};
 
-  this.cursor.get(step, function(err, val, key) {
-    if (err && err.code == NOREC)
-      next(null);
-    else if (err)
-      next(err);
-    else
-      next(null, val, key);
-  });
+Coalescer.prototype.push = function(op, key, val, next) {
+  var self = this;
 
-  return this;
+  this.ops.push(op, key, val);
+  this.callbacks.push(next);
+  this.bytes += key.length + (val ? val.length : 0);
+
+  if (this.callbacks.length >= this.maxOps || this.bytes >= this.maxBytes)
+    this.flush();
+  else if (!this.scheduled) {
+    this.scheduled = true;
+    process.nextTick(function() { self.flush(); });
+  }
 };
 
-// Get the key of the current item.
-//
-// If there is no current item, call `next` with a `null` key.
-//
-// + step - Boolean step to next record afterward (optional, default: false)
-// + next - Function(Error, String key) callback
-//
-// Returns self
-Cursor.prototype.getKey = function(step, next) {
-  if (typeof step == 'function') {
-    next = step;
-    step = false;
+Coalescer.prototype.flush = function() {
+  var self = this,
+      ops = this.ops,
+      callbacks = this.callbacks,
+      db = this.db.db;
+
+  if (callbacks.length === 0) {
+    this.scheduled = false;
+    return;
   }
 
-  this.cursor.getKey(step, function(err, key) {
-    if (err && err.code == NOREC)
-      next(null);
-    else if (err)
-      next(err);
-    else
-      next(null, key);
+  this.reset();
+  this.record(callbacks.length);
+
+  if (db === null) {
+    this.fail(callbacks, new Error('write: database is closed.'));
+    return;
+  }
+
+  this.pending++;
+  db.writeBatch(ops, false, function(err, errors) {
+    for (var i = 0, l = callbacks.length; i < l; i++)
+      callbacks[i](err || errors[i]);
+
+    if (--self.pending === 0) {
+      var waiting = self.waiting;
+      self.waiting = [];
+      for (i = 0; i < waiting.length; i++)
+        waiting[i]();
+    }
   });
+};
 
-  return this;
+// Flush, then call `done` once every batch sent so far has finished.
+Coalescer.prototype.drain = function(done) {
+  this.flush();
+  if (this.pending === 0)
+    done();
+  else
+    this.waiting.push(done);
 };
 
-// Get the value of the current item.
-//
-// If there is no current item, call `next` with a `null` value.
+Coalescer.prototype.abort = function(err) {
+  var callbacks = this.callbacks;
+  this.reset();
+  this.fail(callbacks, err);
+};
+
+Coalescer.prototype.fail = function(callbacks, err) {
+  for (var i = 0, l = callbacks.length; i < l; i++)
+    callbacks[i](err);
+};
+
+Coalescer.prototype.record = function(size) {
+  var stats = this.stats,
+      bucket = 1;
+
+  while (bucket < size)
+    bucket *= 2;
+
+  stats.batches++;
+  stats.ops += size;
+  stats.sizes[bucket] = (stats.sizes[bucket] || 0) + 1;
+};
+
+
+// ## Packed Lists ##
+
+// A packed list is a Buffer of items, each a 32-bit big-endian length
+// followed by the item's bytes. A length of 0xFFFFFFFF stands for a
+// missing item and has no bytes.
+var PACKED_MISSING = 0xFFFFFFFF;
+
+// Pack an Array of Strings or Buffers. `null` and `undefined` items
+// are packed as missing.
 //
-// + step - Boolean step to next record afterward (optional, default: false)
-// + next - Function(Error, String value, String value) callback
+// + items - Array of items
 //
-// Returns self
-Cursor.prototype.getValue = function(step, next) {
-  if (typeof step == 'function') {
-    next = step;
-    step = undefined;
+// Returns Buffer.
+function pack(items) {
+  var sizes = [], total = 0, buf, pos = 0, item, size;
+
+  for (var i = 0, l = items.length; i < l; i++) {
+    item = items[i];
+    size = (item == null) ? 0 : Buffer.isBuffer(item) ? item.length : Buffer.byteLength(item);
+    sizes.push(size);
+    total += 4 + size;
   }
 
-  this.cursor.getValue(!!step, function(err, val) {
-    if (err && err.code == NOREC)
-      next(null);
-    else if (err)
-      next(err);
+  buf = new Buffer(total);
+  for (i = 0; i < l; i++) {
+    item = items[i];
+    pos = packLength(buf, pos, (item == null) ? PACKED_MISSING : sizes[i]);
+    if (item == null)
+      continue;
+    else if (Buffer.isBuffer(item))
+      item.copy(buf, pos, 0);
     else
-      next(null, val);
-  });
+      buf.write(item, pos, 'utf8');
+    pos += sizes[i];
+  }
 
-  return this;
-};
+  return buf;
+}
 
-// Set the value of the current item.
+// Unpack a Buffer into an Array of Strings (or of Buffers if `binary`
+// is true). Missing items are left as holes.
 //
-// + step - Boolean step to next record afterward (optional, default: false)
-// + next - Function(Error) callback
+// + buf    - Buffer packed list
+// + binary - Boolean make Buffers (optional, default: false)
 //
-// Returns self
-Cursor.prototype.setValue = function(value, step, next) {
-  if (typeof step == 'function') {
-    next = step;
-    step = undefined;
+// Returns Array.
+function unpack(buf, binary) {
+  var items = [], pos = 0, index = 0, len;
+
+  while (pos < buf.length) {
+    if (buf.length - pos < 4)
+      throw new Error('unpack: truncated list.');
+
+    len = unpackLength(buf, pos);
+    pos += 4;
+
+    if (len !== PACKED_MISSING) {
+      if (buf.length - pos < len)
+        throw new Error('unpack: truncated list.');
+      items[index] = binary ? buf.slice(pos, pos + len) : buf.toString('utf8', pos, pos + len);
+      pos += len;
+    }
+
+    items.length = ++index;
   }
 
-  this.cursor.setValue(value, !!step, next);
+  return items;
+}
 
-  return this;
+function packLength(buf, pos, len) {
+  buf[pos] = (len >>> 24) & 0xff;
+  buf[pos + 1] = (len >>> 16) & 0xff;
+  buf[pos + 2] = (len >>> 8) & 0xff;
+  buf[pos + 3] = len & 0xff;
+  return pos + 4;
+}
+
+function unpackLength(buf, pos) {
+  return ((buf[pos] << 24) >>> 0) + (buf[pos + 1] << 16) + (buf[pos + 2] << 8) + buf[pos + 3];
+}
+
+// A PackedEncoder is a stream that takes items (`{ key: ..., value:
+// ... }` objects or `[key, value]` Arrays) and writes packed lists of
+// alternating keys and values, about `maxBytes` at a time. Its output
+// can go straight to setBulk() on the other end of a pipe.
+//
+// + options - Object encoder options (optional):
+//   + maxBytes - Integer bytes per packed list (optional, default: 1MB)
+function PackedEncoder(options) {
+  options = options || {};
+  this.maxBytes = options.maxBytes || BLOCK_BYTES;
+  this.pending = [];
+  this.pendingBytes = 0;
+  initTransform(this, { writableObjectMode: true });
+}
+
+transformStream(PackedEncoder);
+
+PackedEncoder.prototype._transform = function(item, encoding, next) {
+  var key = Array.isArray(item) ? item[0] : item.key,
+      value = Array.isArray(item) ? item[1] : item.value;
+
+  this.pending.push(key, value);
+  this.pendingBytes += 8 + key.length + value.length;
+  if (this.pendingBytes >= this.maxBytes)
+    this._emitPending();
+  next();
 };
 
-// Remove the current item.
-//
-// If there is no current item, call `next` with a `null` value.
-//
-// + step - Boolean step to next record afterward (optional, default: false)
-// + next - Function(Error) callback
-//
-// Returns self
-Cursor.prototype.remove = function(next) {
-  this.cursor.remove(next);
-  return this;
+PackedEncoder.prototype._flush = function(next) {
+  this._emitPending();
+  next();
 };
 
-// Scan forward to a particular key (or prefix).
-//
-// If `to` is not given, move to the first record.
-//
-// + to   - String jump to this key (optional)
-// + next - Function(Error) callback
-//
-// Returns self
-Cursor.prototype.jump = function(to, next) {
-  if (typeof to == 'function') {
-    next = to;
-    to = undefined;
+PackedEncoder.prototype._emitPending = function() {
+  if (this.pending.length) {
+    this.push(pack(this.pending));
+    this.pending = [];
+    this.pendingBytes = 0;
   }
+};
 
-  to ? this.cursor.jumpTo(to, next) : this.cursor.jump(next);
+// A PackedDecoder is a stream that takes packed lists of alternating
+// keys and values split at any byte, as they come from a socket or
+// pipe, and writes Buffers that each hold whole items. The items
+// aren't unpacked; each Buffer can go straight to setBulk(), or to
+// unpack() to get the items themselves.
+function PackedDecoder() {
+  this.rest = null;
+  initTransform(this, {});
+}
 
-  return this;
+transformStream(PackedDecoder);
+
+PackedDecoder.prototype._transform = function(chunk, encoding, next) {
+  var buf = this.rest ? concat(this.rest, chunk) : chunk,
+      pos = 0,
+      end = 0,
+      len;
+
+  // Find the end of the last whole pair.
+  while (true) {
+    pos = skipItem(buf, end);
+    if (pos < 0) break;
+    pos = skipItem(buf, pos);
+    if (pos < 0) break;
+    end = pos;
+  }
+
+  if (end > 0)
+    this.push(buf.slice(0, end));
+  this.rest = (end < buf.length) ? buf.slice(end) : null;
+  next();
 };
 
-// Scan backward to a particular key (or prefix).
-//
-// If `to` is not given, move to the last record.
-//
-// + to   - String jump to this key (optional)
-// + next - Function(Error) callback
-//
-// Returns self
-Cursor.prototype.jumpBack = function(to, next) {
-  if (typeof to == 'function') {
-    next = to;
-    to = undefined;
+PackedDecoder.prototype._flush = function(next) {
+  next(this.rest ? new Error('PackedDecoder: truncated list.') : null);
+};
+
+// The position after the item at `pos`, or -1 if it's incomplete.
+function skipItem(buf, pos) {
+  if (buf.length - pos < 4)
+    return -1;
+
+  var len = unpackLength(buf, pos);
+  if (len === PACKED_MISSING)
+    return pos + 4;
+
+  return (buf.length - pos - 4 < len) ? -1 : pos + 4 + len;
+}
+
+function concat(a, b) {
+  var buf = new Buffer(a.length + b.length);
+  a.copy(buf, 0, 0);
+  b.copy(buf, a.length, 0);
+  return buf;
+}
+
+// Packed streams are `stream.Transform`s where there are any.
+// Otherwise they're classic streams with the same `_transform()` and
+// `_flush()` hooks.
+function initTransform(stream, options) {
+  if (Stream.Transform)
+    Stream.Transform.call(stream, options);
+  else {
+    Stream.call(stream);
+    stream.readable = stream.writable = true;
   }
+}
 
-  to ? this.cursor.jumpBackTo(to, next) : this.cursor.jumpBack(next);
+function transformStream(ctor) {
+  Util.inherits(ctor, Stream.Transform || Stream);
 
-  return this;
-};
+  if (Stream.Transform)
+    return;
 
-// Move forward to the next record.
-//
-// + next - Function(Error) callback
-//
-// Returns self
-Cursor.prototype.step = function(next) {
-  this.cursor.step(next);
-  return this;
-};
+  ctor.prototype.push = function(chunk) {
+    if (chunk !== null)
+      this.emit('data', chunk);
+  };
 
-// Move backward to the previous record.
-//
-// + next - Function(Error) callback
-//
-// Returns self
-Cursor.prototype.stepBack = function(next) {
-  this.cursor.stepBack(next);
-  return this;
-};
+  ctor.prototype.write = function(chunk) {
+    var self = this;
+    this._transform(chunk, null, function(err) {
+      if (err) self.emit('error', err);
+    });
+    return true;
+  };
+
+  ctor.prototype.end = function(chunk) {
+    var self = this;
+    if (chunk)
+      this.write(chunk);
+    this._flush(function(err) {
+      self.readable = self.writable = false;
+      err ? self.emit('error', err) : self.emit('end');
+    });
+  };
+}
 
 
 // ## Helpers ##
 
+// The native argument for an `update()` operation.
+function updateArg(op, arg) {
+  switch (op) {
+  case 'max':
+  case 'min':
+    return String(arg);
+  case 'push':
+    if (arg !== null && typeof arg == 'object' && !Buffer.isBuffer(arg))
+      return [arg.value, arg.limit || 0];
+    return [arg, 0];
+  case 'count':
+    if (typeof arg == 'number')
+      return [arg, 1];
+    return [arg.index || 0, (arg.delta === undefined) ? 1 : arg.delta];
+  case 'mergeJSON':
+    return JSON.stringify(arg) || '';
+  default:
+    return arg;
+  }
+}
+
 function noop(err) {
   if (err) throw err;
 }
 
+// Wrap a KyotoDB method so the requests it makes have `priority`.
+function prioritize(db, method, priority) {
+  return function() {
+    var native = db.db;
+
+    if (native === null)
+      return method.apply(db, arguments);
+
+    native.setPriority(priority);
+    try {
+      return method.apply(db, arguments);
+    } finally {
+      native.setPriority(-1);
+    }
+  };
+}
+
+// The approximate size in bytes of the items or keys of a bulk write.
+function bulkSize(what) {
+  var size = 0;
+
+  if (Buffer.isBuffer(what))
+    return what.length;
+  else if (Array.isArray(what)) {
+    for (var i = 0, l = what.length; i < l; i++)
+      size += what[i] ? what[i].length : 0;
+  }
+  else {
+    for (var key in what)
+      size += key.length + what[key].length;
+  }
+
+  return size;
+}
+
+function copy(obj) {
+  var result = {};
+  for (var key in obj)
+    result[key] = obj[key];
+  return result;
+}
+
+function isMemory(path) {
+  return /^[-+:*%](#|$)/.test(path);
+}
+
+function noRecord(method) {
+  var err = new Error(method + ': no record');
+  err.code = NOREC;
+  return err;
+}
+
 function parseMode(mode) {
 
   if (typeof mode == 'number')
@@ -986,9 +3781,7 @@ Cursor.prototype.getKeyBlock = function(size, next) {
 // ## Generator ##
 
 function Generator(db, jumpTo, done) {
-  this.cursor = new K.Cursor(db.db);
-  this.started = false;
-  this.jumpTo = jumpTo;
+  this.iterator = new Iterator(db, { start: jumpTo });
   this.done = done;
 }
 
@@ -998,44 +3791,16 @@ Generator.prototype.then = function(callback) {
 };
 
 Generator.prototype.next = function(fn) {
-  var self = this,
-      cursor = this.cursor;
-
-  if (this.started)
-    step();
-  else {
-    this.started = true;
-    jump();
-  }
-
-  function jump() {
-    if (self.jumpTo)
-      cursor.jumpTo(self.jumpTo, jumped);
-    else
-      cursor.jump(jumped);
-  }
+  var self = this;
 
-  function jumped(err) {
-    if (err && err.code == NOREC)
-      self.done();
-    else if (err)
+  this.iterator.next(function(err, val, key) {
+    if (err)
       self.done(err);
-    else
-      step();
-  }
-
-  function step() {
-    cursor.get(true, emit);
-  }
-
-  function emit(err, val, key) {
-    if (!key || (err && err.code == NOREC))
+    else if (key === undefined)
       self.done();
-    else if (err)
-      self.done(err);
     else
       fn.call(self, val, key);
-  }
+  });
 
   return this;
 };
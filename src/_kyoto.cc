@@ -4,14 +4,36 @@
 // contents for this file:
 //
 // + Macros     - utilities, DEFINE_* methods for libeio
-// + Maps/Lists - convert between stdlib and V8
+// + Bytes      - String or Buffer keys and values (convert.h)
+// + Maps/Lists - convert between stdlib and V8 (convert.h)
+// + Errors     - V8 errors for Kyoto error codes
+// + Metrics    - per-method latency histograms
+// + Workers    - pooled jobs and per-database thread pools
+// + SyncGroup  - group commit for synchronize()
+// + ReadCache  - hot values kept on the main thread
+// + Tier       - in-memory CacheDB in front of a file database
+// + Bloom      - filter of keys for answering misses early
 // + PolyDB     - ObjectWrap around a PolyDB
 // + Cursor     - ObjectWrap around a Cursor
+// + Sharding   - hash keys over the shards of a ShardedKyotoDB
 // + Init       - module initialization
 
 #include <v8.h>
 #include <node.h>
+#include <node_buffer.h>
 #include <kcpolydb.h>
+#include "convert.h"
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <math.h>
+#include <deque>
+#include <list>
+#include <set>
+#include <sstream>
+#include <algorithm>
 
 using namespace std;
 using namespace node;
@@ -51,8 +73,11 @@ using namespace kyotocabinet;
 #define EQ_STRING_BUF(str, buf, bsiz)                                   \
   (str.length() == bsiz && str.compare(0, bsiz, vbuf, bsiz) == 0)       \
 
-#define EQ_UTF8_BUF(utf, buf, bsiz)                                     \
-  ((size_t)utf.length() == bsiz && strncmp(*utf, buf, bsiz) == 0)       \
+#define EQ_BYTES_BUF(bytes, buf, bsiz)                                  \
+  (bytes.length() == bsiz && memcmp(*bytes, buf, bsiz) == 0)            \
+
+#define IS_BYTES(obj)                                                   \
+  (obj->IsString() || Buffer::HasInstance(obj))                         \
 
 #define DEFINE_FUNC(Name, Request)					\
   static Handle<Value> Name(const Arguments& args) {			\
@@ -62,805 +87,4301 @@ using namespace kyotocabinet;
       return THROW_BAD_ARGS;						\
     }									\
 									\
+    static int op = Metrics::Register(Request::scope(), #Name);	\
     Request* req = new Request(args);					\
+    WorkerPool* pool = req->pool();					\
+									\
+    req->dispatch(op);							\
 									\
-    eio_custom(EIO_Exec##Name, EIO_PRI_DEFAULT, EIO_After##Name, req);	\
+    if (pool) {								\
+      pool->submit(req, req->priority());				\
+    }									\
+    else {								\
+      eio_custom(EIO_Exec##Name, EioPriority::Queue(req->priority()),	\
+		 NULL, req);						\
+    }									\
     ev_ref(EV_DEFAULT_UC);						\
 									\
     return args.This();							\
   }									\
 
+// Finished requests go back to the main thread through Completions,
+// not libeio's own callback, so they're delivered in batches.
 #define DEFINE_EXEC(Name, Request)					\
   static int EIO_Exec##Name(eio_req *ereq) {				\
     Request* req = static_cast<Request *>(ereq->data);			\
-    return req->exec();							\
-  }									\
-
-#define DEFINE_AFTER(Name, Request)					\
-  static int EIO_After##Name(eio_req *ereq) {				\
-    HandleScope scope;							\
-    Request* req = static_cast<Request *>(ereq->data);			\
-    ev_unref(EV_DEFAULT_UC);						\
-    int result = req->after();						\
-    delete req;								\
-    return result;							\
+    EioPriority::Start(req->priority(), ereq->pri);			\
+    req->run();								\
+    Completions::Push(req);						\
+    return 0;								\
   }									\
 
 #define DEFINE_METHOD(Name, Request)					\
   DEFINE_FUNC(Name, Request)						\
-  DEFINE_EXEC(Name, Request)						\
-  DEFINE_AFTER(Name, Request)
+  DEFINE_EXEC(Name, Request)
 
 
-// ## Maps and Lists ##
+// ## Errors ##
 
-typedef std::vector<std::string> StringList;
-typedef StringList::const_iterator StringIterator;
-typedef std::map<std::string, std::string> StringMap;
-typedef pair<std::string, std::string> MapItem;
-typedef StringMap::const_iterator MapIterator;
+// Symbols are made once for the module, not once per request.
+static Persistent<String> code_symbol;
+static Persistent<String> invalid_symbol;
 
-void ObjToMap(const Local<Value> value, StringMap &result) {
+// Make an Error for a Kyoto error code. The message is the code's name
+// and the code itself is stored as `err.code`.
+Local<Value> KyotoError(PolyDB::Error::Code code) {
   HandleScope scope;
 
-  Local<Object> obj = Local<Object>::Cast(value);
-  Local<Array> names = obj->GetPropertyNames();
-  int names_len = names->Length();
+  if (code == PolyDB::Error::SUCCESS)
+    return scope.Close(LNULL);
 
-  for (int i = 0; i < names_len; i++) {
-    Local<Value> name = names->Get(Integer::New(i));
-    String::Utf8Value key(name);
-    String::Utf8Value val(obj->Get(name)->ToString());
-    std::string std_key = std::string(*key, key.length());
-    std::string std_val = std::string(*val, val.length());
-    result.insert(MapItem(std_key, std_val));
+  const char* name = PolyDB::Error::codename(code);
+  Local<Value> err = Exception::Error(String::NewSymbol(name));
+
+  if (code_symbol.IsEmpty()) {
+    code_symbol = NODE_PSYMBOL("code");
   }
+
+  Local<Object> obj = err->ToObject();
+  obj->Set(code_symbol, Integer::New(code));
+
+  return scope.Close(err);
 }
 
-Local<Object> MapToObj(StringMap &map) {
-  HandleScope scope;
+
+// ## Metrics ##
 
-  MapIterator item = map.begin();
-  MapIterator end = map.end();
+// A Histogram counts microsecond values in log-linear buckets, like
+// an HDR histogram: each power of two is split into 8 sub-buckets, so
+// a percentile is within 1/8 of the true value. Recording is a few
+// shifts and increments.
+class Histogram {
+public:
+  static const int SUB_BITS = 3;
+  static const int SUB_COUNT = 1 << SUB_BITS;
+  static const int BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT;
 
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
 
-  Local<Object> result = Object::New();
-  while (item != end) {
-    Local<String> key = String::New(item->first.c_str(), item->first.length());
-    Local<String> val = String::New(item->second.c_str(), item->second.length());
-    result->Set(key, val);
-    ++item;
+private:
+  uint64_t counts[BUCKETS];
+
+public:
+  Histogram() {
+    reset();
   }
 
-  return scope.Close(result);
-}
+  void reset() {
+    memset(counts, 0, sizeof(counts));
+    count = sum = max = 0;
+    min = ~(uint64_t)0;
+  }
 
-void MapKeys(const StringMap &map, StringList &keys) {
-  keys.reserve(map.size());
-  MapIterator item = map.begin();
-  MapIterator end = map.end();
-  while(item != end) {
-    keys.push_back(item->first);
-    ++item;
+  inline void record(uint64_t value) {
+    counts[Bucket(value)]++;
+    count++;
+    sum += value;
+    if (value < min) min = value;
+    if (value > max) max = value;
   }
-}
 
-void ArrayToList(const Local<Value> obj, StringList &result) {
-  HandleScope scope;
+  // The smallest value that `percent` of the values are at or below,
+  // rounded up to the top of its bucket.
+  uint64_t percentile(double percent) const {
+    if (count == 0) return 0;
 
-  Local<Array> array = Local<Array>::Cast(obj);
-  int alen = array->Length();
-  for (int i = 0; i < alen; i++) {
-    String::Utf8Value val(array->Get(Integer::New(i))->ToString());
-    result.push_back(std::string(*val, val.length()));
-  }
-}
+    uint64_t rank = (uint64_t)(percent / 100.0 * count + 0.5);
+    if (rank < 1) rank = 1;
 
-Local<Object> ListToArray(StringList &list) {
-  HandleScope scope;
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+      seen += counts[i];
+      if (seen >= rank) return std::min(Highest(i), max);
+    }
+
+    return max;
+  }
 
-  StringIterator item = list.begin();
-  StringIterator end = list.end();
+  static inline int Bucket(uint64_t value) {
+    if (value < SUB_COUNT) return (int)value;
+    int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+    return (shift + 1) * SUB_COUNT + (int)((value >> shift) - SUB_COUNT);
+  }
 
-  Local<Array> result = Array::New(list.size());
-  uint32_t index = 0;
-  while(item != end) {
-    Local<String> val = String::New(item->c_str(), item->length());
-    result->Set(index++, val);
-    ++item;
+  static inline uint64_t Highest(int bucket) {
+    if (bucket < SUB_COUNT) return bucket;
+    int shift = bucket / SUB_COUNT - 1;
+    uint64_t sub = bucket % SUB_COUNT + SUB_COUNT;
+    return ((sub + 1) << shift) - 1;
   }
+};
 
-  return scope.Close(result);
+Local<Object> HistogramToObj(const Histogram& hist) {
+  HandleScope scope;
+  Local<Object> obj = Object::New();
+
+  obj->Set(String::NewSymbol("count"), Number::New(hist.count));
+  obj->Set(String::NewSymbol("mean"),
+	   Number::New(hist.count ? (double)hist.sum / hist.count : 0));
+  obj->Set(String::NewSymbol("min"), Number::New(hist.count ? hist.min : 0));
+  obj->Set(String::NewSymbol("max"), Number::New(hist.max));
+  obj->Set(String::NewSymbol("p50"), Number::New(hist.percentile(50)));
+  obj->Set(String::NewSymbol("p90"), Number::New(hist.percentile(90)));
+  obj->Set(String::NewSymbol("p99"), Number::New(hist.percentile(99)));
+  obj->Set(String::NewSymbol("p999"), Number::New(hist.percentile(99.9)));
+
+  return scope.Close(obj);
 }
 
-
-// ## PolyDB ##
+// Metrics keeps the timings of a database's requests by method. Each
+// request is split into the time it waited in a queue, the time
+// Kyoto spent on it, the time it waited for the main thread after
+// that, and the time its callback took. Methods are numbered once,
+// when they're first called; their timings are allocated when a
+// database first uses them. Everything but `Register()` runs on the
+// main thread, so there's no locking.
+class Metrics {
+public:
+  struct Op {
+    uint64_t inflight;
+    Histogram queue;
+    Histogram exec;
+    Histogram deliver;
+    Histogram callback;
+  };
 
-class PolyDBWrap: ObjectWrap {
 private:
-  PolyDB* db;
+  std::vector<Op*> ops;
+
+  static std::vector<std::string>& Names() {
+    static std::vector<std::string> names;
+    return names;
+  }
 
 public:
+  ~Metrics() {
+    for (size_t i = 0; i < ops.size(); i++) delete ops[i];
+  }
 
-  
-  // ### Initialization ###
+  // Number a method: "Get" in the "cursor." scope is "cursor.get".
+  static int Register(const char* scope, const char* name) {
+    std::string full(scope);
+    full.push_back(tolower(name[0]));
+    full.append(name + 1);
 
-  static Persistent<FunctionTemplate> ctor;
+    Names().push_back(full);
+    return Names().size() - 1;
+  }
 
-  static void Init(Handle<Object> target) {
-    HandleScope scope;
+  Op* op(int index) {
+    if ((size_t)index >= ops.size()) ops.resize(index + 1, NULL);
+    if (!ops[index]) {
+      ops[index] = new Op();
+      ops[index]->inflight = 0;
+    }
+    return ops[index];
+  }
 
-    Local<FunctionTemplate> tmpl = FunctionTemplate::New(New);
+  inline void begin(int index) {
+    op(index)->inflight++;
+  }
 
-    ctor = Persistent<FunctionTemplate>::New(tmpl);
-    ctor->InstanceTemplate()->SetInternalFieldCount(1);
-    ctor->SetClassName(String::NewSymbol("PolyDB"));
+  inline void finish(int index, uint64_t queue, uint64_t exec,
+		     uint64_t deliver, uint64_t callback) {
+    Op* o = op(index);
+    o->inflight--;
+    o->queue.record(queue);
+    o->exec.record(exec);
+    o->deliver.record(deliver);
+    o->callback.record(callback);
+  }
 
-    SET_CLASS_CONSTANT(ctor, PolyDB, OREADER);
-    SET_CLASS_CONSTANT(ctor, PolyDB, OWRITER);
-    SET_CLASS_CONSTANT(ctor, PolyDB, OCREATE);
-    SET_CLASS_CONSTANT(ctor, PolyDB, OTRUNCATE);
-    SET_CLASS_CONSTANT(ctor, PolyDB, OAUTOTRAN);
-    SET_CLASS_CONSTANT(ctor, PolyDB, OAUTOSYNC);
-    SET_CLASS_CONSTANT(ctor, PolyDB, ONOLOCK);
-    SET_CLASS_CONSTANT(ctor, PolyDB, OTRYLOCK);
-    SET_CLASS_CONSTANT(ctor, PolyDB, ONOREPAIR);
+  // Clear the histograms; requests in flight are still counted.
+  void reset() {
+    for (size_t i = 0; i < ops.size(); i++) {
+      if (!ops[i]) continue;
+      ops[i]->queue.reset();
+      ops[i]->exec.reset();
+      ops[i]->deliver.reset();
+      ops[i]->callback.reset();
+    }
+  }
 
-    SET_CLASS_CONSTANT(ctor, PolyDB, MSET);
-    SET_CLASS_CONSTANT(ctor, PolyDB, MADD);
-    SET_CLASS_CONSTANT(ctor, PolyDB, MREPLACE);
-    SET_CLASS_CONSTANT(ctor, PolyDB, MAPPEND);
+  Local<Object> ToObj() {
+    HandleScope scope;
+    Local<Object> obj = Object::New();
+
+    for (size_t i = 0; i < ops.size(); i++) {
+      if (!ops[i]) continue;
+
+      Local<Object> item = Object::New();
+      item->Set(String::NewSymbol("inflight"), Number::New(ops[i]->inflight));
+      item->Set(String::NewSymbol("queue"), HistogramToObj(ops[i]->queue));
+      item->Set(String::NewSymbol("exec"), HistogramToObj(ops[i]->exec));
+      item->Set(String::NewSymbol("deliver"), HistogramToObj(ops[i]->deliver));
+      item->Set(String::NewSymbol("callback"), HistogramToObj(ops[i]->callback));
+      obj->Set(String::New(Names()[i].c_str()), item);
+    }
 
-    SET_CLASS_CONSTANT(ctor, PolyDB::Error, SUCCESS);
-    SET_CLASS_CONSTANT(ctor, PolyDB::Error, NOIMPL);
-    SET_CLASS_CONSTANT(ctor, PolyDB::Error, INVALID);
-    SET_CLASS_CONSTANT(ctor, PolyDB::Error, NOREPOS);
-    SET_CLASS_CONSTANT(ctor, PolyDB::Error, NOPERM);
-    SET_CLASS_CONSTANT(ctor, PolyDB::Error, BROKEN);
-    SET_CLASS_CONSTANT(ctor, PolyDB::Error, DUPREC);
-    SET_CLASS_CONSTANT(ctor, PolyDB::Error, NOREC);
-    SET_CLASS_CONSTANT(ctor, PolyDB::Error, LOGIC);
-    SET_CLASS_CONSTANT(ctor, PolyDB::Error, SYSTEM);
-    SET_CLASS_CONSTANT(ctor, PolyDB::Error, MISC);
+    return scope.Close(obj);
+  }
+};
 
-    SET_CONSTANT(ctor, INT64MIN);
-    SET_CONSTANT(ctor, INT64MAX);
+
+// ## Workers ##
+
+// Microseconds on a monotonic clock, so intervals never go negative
+// when the wall clock is set.
+static inline uint64_t NowMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    NODE_SET_PROTOTYPE_METHOD(ctor, "open", Open);
-    NODE_SET_PROTOTYPE_METHOD(ctor, "close", Close);
-    NODE_SET_PROTOTYPE_METHOD(ctor, "closeSync", CloseSync);
-    NODE_SET_PROTOTYPE_METHOD(ctor, "clear", Clear);
-    NODE_SET_PROTOTYPE_METHOD(ctor, "set", Set);
-    NODE_SET_PROTOTYPE_METHOD(ctor, "add", Add);
-    NODE_SET_PROTOTYPE_METHOD(ctor, "replace", Replace);
-    NODE_SET_PROTOTYPE_METHOD(ctor, "append", Append);
-    NODE_SET_PROTOTYPE_METHOD(ctor, "increment", Increment);
-    NODE_SET_PROTOTYPE_METHOD(ctor, "incrementDouble", IncrementDouble);
-    NODE_SET_PROTOTYPE_METHOD(ctor, "cas", CAS);
-    NODE_SET_PROTOTYPE_METHOD(ctor, "remove", Remove);
-    NODE_SET_PROTOTYPE_METHOD(ctor, "get", Get);
-    NODE_SET_PROTOTYPE_METHOD(ctor, "getBulk", GetBulk);
-    NODE_SET_PROTOTYPE_METHOD(ctor, "setBulk", SetBulk);
-    NODE_SET_PROTOTYPE_METHOD(ctor, "removeBulk", RemoveBulk);
-    NODE_SET_PROTOTYPE_METHOD(ctor, "matchPrefix", MatchPrefix);
-    NODE_SET_PROTOTYPE_METHOD(ctor, "matchRegex", MatchRegex);
-    NODE_SET_PROTOTYPE_METHOD(ctor, "synchronize", Synchronize);
-    NODE_SET_PROTOTYPE_METHOD(ctor, "copy", Copy);
-    NODE_SET_PROTOTYPE_METHOD(ctor, "dumpSnapshot", DumpSnapshot);
-    NODE_SET_PROTOTYPE_METHOD(ctor, "loadSnapshot", LoadSnapshot);
-    NODE_SET_PROTOTYPE_METHOD(ctor, "count", Count);
-    NODE_SET_PROTOTYPE_METHOD(ctor, "size", Size);
-    NODE_SET_PROTOTYPE_METHOD(ctor, "status", Status);
-    // NODE_SET_PROTOTYPE_METHOD(ctor, "merge", Merge);
+// Requests are made and freed many thousands of times a second,
+// always on the main thread, so their memory goes back to free lists
+// by size instead of to the allocator. Each list keeps a bounded
+// number of blocks.
+class JobPool {
+public:
+  struct Stats {
+    uint64_t requests;
+    uint64_t allocated;
+    uint64_t reused;
+    uint64_t pooled;
+  };
 
-    // Here are some non-standard methods for Toji.
-    NODE_SET_PROTOTYPE_METHOD(ctor, "addIndexed", AddIndexed);
-    NODE_SET_PROTOTYPE_METHOD(ctor, "replaceIndexed", ReplaceIndexed);
-    NODE_SET_PROTOTYPE_METHOD(ctor, "removeIndexed", RemoveIndexed);
+  static const size_t GRAIN = 64;
+  static const size_t CLASSES = 32;
+  static const size_t LIMIT = 256;
+
+  static void* Allocate(size_t size) {
+    Stats& stats = Counters();
+    size_t index = (size + GRAIN - 1) / GRAIN;
+    stats.requests++;
+
+    if (index < CLASSES && !Lists()[index].empty()) {
+      void* block = Lists()[index].back();
+      Lists()[index].pop_back();
+      stats.reused++;
+      stats.pooled--;
+      return block;
+    }
 
-    target->Set(String::NewSymbol("PolyDB"), ctor->GetFunction());
+    stats.allocated++;
+    return ::operator new((index < CLASSES) ? index * GRAIN : size);
   }
 
-  
-  // ### Construction ###
+  static void Free(void* block, size_t size) {
+    size_t index = (size + GRAIN - 1) / GRAIN;
 
-  PolyDBWrap()  {
-    db = new PolyDB();
+    if (index < CLASSES && Lists()[index].size() < LIMIT) {
+      Lists()[index].push_back(block);
+      Counters().pooled++;
+      return;
+    }
+
+    ::operator delete(block);
   }
 
-  ~PolyDBWrap() {
-    delete db;
+  static Stats& Counters() {
+    static Stats stats = { 0, 0, 0, 0 };
+    return stats;
   }
 
-  static Handle<Value> New(const Arguments& args) {
-    HandleScope scope;
-    PolyDBWrap* wrap = new PolyDBWrap();
-    wrap->Wrap(args.This());
-    return args.This();
+private:
+  static std::vector<void*>* Lists() {
+    static std::vector<void*> lists[CLASSES];
+    return lists;
   }
+};
 
-  
-  // ### Helpers ###
+// allocStats() returns counters for request objects and for the keys
+// and values copied from their arguments (see Bytes). Without the
+// pool, every request would be an allocation; without inline
+// buffers, every String would be one and every Buffer a persistent
+// handle.
+static Handle<Value> AllocStats(const Arguments& args) {
+  HandleScope scope;
 
-  DB::Cursor* cursor() {
-    return db->cursor();
-  }
+  JobPool::Stats& jobs = JobPool::Counters();
+  BytesStats& bytes = BytesCounters();
 
-  class Request {
-  private:
-    Persistent<String> code_symbol;
+  Local<Object> requests = Object::New();
+  requests->Set(String::NewSymbol("made"), Number::New(jobs.requests));
+  requests->Set(String::NewSymbol("allocated"), Number::New(jobs.allocated));
+  requests->Set(String::NewSymbol("reused"), Number::New(jobs.reused));
+  requests->Set(String::NewSymbol("pooled"), Number::New(jobs.pooled));
 
-  protected:
-    PolyDBWrap* wrap;
-    Persistent<Function> next;
-    PolyDB::Error::Code result;
+  Local<Object> values = Object::New();
+  values->Set(String::NewSymbol("made"), Number::New(bytes.made));
+  values->Set(String::NewSymbol("inline"), Number::New(bytes.inlined));
+  values->Set(String::NewSymbol("heap"), Number::New(bytes.heap));
+  values->Set(String::NewSymbol("held"), Number::New(bytes.held));
 
-  public:
-    Request(const Arguments& args, int nextIndex):
-      result(PolyDB::Error::SUCCESS) {
-      HandleScope scope;
+  Local<Object> result = Object::New();
+  result->Set(String::NewSymbol("requests"), requests);
+  result->Set(String::NewSymbol("bytes"), values);
+  return scope.Close(result);
+}
 
-      wrap = ObjectWrap::Unwrap<PolyDBWrap>(args.This());
-      next = Persistent<Function>::New(Handle<Function>::Cast(args[nextIndex]));
+// A Job runs `exec()` on a worker thread, then `after()` on the main
+// thread. Every request is a Job. Both are called through `run()` and
+// `complete()`, which time them for the job's Metrics.
+class Job {
+private:
+  int op;
+  uint64_t dispatched;
+  uint64_t started;
+  uint64_t executed;
 
-      wrap->Ref();
-    }
+public:
+  Job(): op(-1), dispatched(0), started(0), executed(0) {}
+  virtual ~Job() {}
 
-    ~Request() {
-      wrap->Unref();
-      next.Dispose();
-    }
+  static void* operator new(size_t size) {
+    return JobPool::Allocate(size);
+  }
 
-    virtual inline int exec() = 0;
+  static void operator delete(void* block, size_t size) {
+    JobPool::Free(block, size);
+  }
+  virtual int exec() = 0;
+  virtual int after() = 0;
 
-    virtual inline int after() = 0;
+  virtual Metrics* metrics() {
+    return NULL;
+  }
 
-    inline void callback(int argc, Handle<Value> argv[]) {
-      TryCatch try_catch;
-      next->Call(Context::GetCurrent()->Global(), argc, argv);
-      if (try_catch.HasCaught()) {
-	FatalException(try_catch);
-      }
+  void dispatch(int index) {
+    Metrics* m = metrics();
+    if (m) {
+      op = index;
+      dispatched = NowMicros();
+      m->begin(op);
     }
+  }
 
-    Local<Value> error() {
-      if (result == PolyDB::Error::SUCCESS)
-	return LNULL;
+  // Called on the worker thread just before and after `exec()`.
+  virtual void starting() {}
+  virtual void stopping() {}
 
-      const char* name = PolyDB::Error::codename(result);
-      Local<String> message = String::NewSymbol(name);
-      Local<Value> err = Exception::Error(message);
+  int run() {
+    if (op < 0) return execute();
+    started = NowMicros();
+    int result = execute();
+    executed = NowMicros();
+    return result;
+  }
 
-      if (code_symbol.IsEmpty()) {
-	code_symbol = NODE_PSYMBOL("code");
-      }
+  int execute() {
+    starting();
+    int result = exec();
+    stopping();
+    return result;
+  }
 
-      Local<Object> obj = err->ToObject();
-      obj->Set(code_symbol, Integer::New(result));
+  // Called on the main thread just before `after()`.
+  virtual void finishing() {}
 
-      return err;
-    }
-  };
+  // For a job that's answered by another job's `exec()`, such as a
+  // held synchronize request: take that job's timings.
+  void ran_with(const Job& other) {
+    started = other.started;
+    executed = other.executed;
+  }
 
-  
-  // ### Open ###
+  int complete() {
+    finishing();
+    if (op < 0) return after();
 
-  DEFINE_METHOD(Open, OpenRequest)
-  class OpenRequest: public Request {
-  private:
-    String::Utf8Value path;
-    uint32_t mode;
+    Metrics* m = metrics();
+    uint64_t delivered = NowMicros();
+    int result = after();
+    m->finish(op, started - dispatched, executed - started,
+	      delivered - executed, NowMicros() - delivered);
+    return result;
+  }
+};
 
-  public:
-    inline static bool validate(const Arguments& args) {
-      return (args.Length() >= 3
-	      && args[0]->IsString()
-	      && args[1]->IsUint32()
-	      && args[2]->IsFunction());
-    }
+// Completions hands jobs finished in the shared libeio pool back to
+// the main thread. A worker queues its job and wakes the loop; the
+// loop then delivers every job queued by that time in one pass, so a
+// burst of completions costs one wakeup. WorkerPools deliver their own
+// batches the same way. Each job still gets its own HandleScope and
+// its callback its own TryCatch (see `callback()`), so one that throws
+// doesn't affect the rest of its batch.
+class Completions {
+private:
+  pthread_mutex_t lock;
+  std::vector<Job*> finished;
+  ev_async notifier;
+  Histogram batches;
+
+  static Completions* Shared() {
+    static Completions* shared = NULL;
+    if (!shared) shared = new Completions();
+    return shared;
+  }
 
-    OpenRequest(const Arguments& args):
-      Request(args, 2),
-      path(args[0]->ToString()),
-      mode(args[1]->Uint32Value())
-    {}
+  Completions() {
+    pthread_mutex_init(&lock, NULL);
 
-    inline int exec() {
-      PolyDB* db = wrap->db;
-      if (!db->open(*path, mode)) result = db->error().code();
-      return 0;
-    }
+    // As with a WorkerPool, each job holds its own reference to the
+    // loop until it's delivered.
+    ev_async_init(&notifier, Drain);
+    ev_async_start(EV_DEFAULT_UC_ &notifier);
+    ev_unref(EV_DEFAULT_UC);
+  }
 
-    inline int after() {
-      Local<Value> argv[1] = { error() };
-      callback(1, argv);
-      return 0;
-    }
-  };
+  static void Drain(EV_P_ ev_async* watcher, int revents) {
+    Completions* self = Shared();
+    std::vector<Job*> jobs;
 
-  
-  // ### Close ###
+    pthread_mutex_lock(&self->lock);
+    jobs.swap(self->finished);
+    pthread_mutex_unlock(&self->lock);
 
-  DEFINE_METHOD(Close, CloseRequest)
-  class CloseRequest: public Request {
-  public:
+    Deliver(jobs);
+  }
 
-    inline static bool validate(const Arguments& args) {
-      return (args.Length() >= 1 && args[0]->IsFunction());
-    }
+public:
+  // Set up on the main thread, when the module is loaded.
+  static void Init() {
+    Shared();
+  }
 
-    CloseRequest(const Arguments& args):
-      Request(args, 0)
-    {}
+  // Called on a worker thread.
+  static void Push(Job* job) {
+    Completions* self = Shared();
 
-    inline int exec() {
-      PolyDB* db = wrap->db;
-      if (!db->close()) result = db->error().code();
-      return 0;
-    }
+    pthread_mutex_lock(&self->lock);
+    self->finished.push_back(job);
+    pthread_mutex_unlock(&self->lock);
 
-    inline int after() {
-      Local<Value> argv[1] = { error() };
-      callback(1, argv);
-      return 0;
+    ev_async_send(EV_DEFAULT_UC_ &self->notifier);
+  }
+
+  // Finish a batch of jobs on the main thread.
+  static void Deliver(std::vector<Job*>& jobs) {
+    if (jobs.empty()) return;
+    Shared()->batches.record(jobs.size());
+
+    for (size_t i = 0; i < jobs.size(); i++) {
+      HandleScope scope;
+      ev_unref(EV_DEFAULT_UC);
+      jobs[i]->complete();
+      delete jobs[i];
     }
-  };
+  }
 
-  static Handle<Value> CloseSync(const Arguments& args) {
-    HandleScope scope;
+  // The sizes of the batches delivered so far.
+  static Histogram& BatchSizes() {
+    return Shared()->batches;
+  }
+};
 
-    PolyDBWrap* wrap = ObjectWrap::Unwrap<PolyDBWrap>(args.This());
-    PolyDB* db = wrap->db;
+// completionStats() summarizes the number of requests delivered per
+// wakeup of the main thread. See Completions.
+static Handle<Value> CompletionStats(const Arguments& args) {
+  HandleScope scope;
 
-    return Boolean::New(db->close());
+  Local<Object> result = HistogramToObj(Completions::BatchSizes());
+  if (args.Length() >= 1 && V8_TO_BOOL(args[0])) {
+    Completions::BatchSizes().reset();
   }
 
+  return scope.Close(result);
+}
+
+// Requests fall into three priority classes. Point reads and writes
+// are high, bulk operations and scans are normal, and maintenance
+// (copy, snapshots, synchronize, clear) is low. A caller can override
+// the class of any request.
+enum Priority {
+  PLOW,
+  PNORMAL,
+  PHIGH,
+  PRIORITIES
+};
+
+// Priorities for the shared libeio pool. libeio always takes the
+// highest priority request first and has no aging of its own, so a
+// steady stream of high requests could starve the rest. Once
+// EIO_HIGH_BURST high requests in a row have been queued while normal
+// or low ones wait, every new request is queued at the lowest
+// priority, behind the waiting ones, and they're served in order
+// until nothing is left waiting.
+#define EIO_HIGH_BURST 64
+
+class EioPriority {
+private:
+  int waiting;
+  uint32_t burst;
+  bool aging;
+
+  EioPriority(): waiting(0), burst(0), aging(false) {}
+
+  static EioPriority* Shared() {
+    static EioPriority shared;
+    return &shared;
+  }
+
+public:
+  // Called on the main thread. Returns the libeio priority for a new
+  // request of class `priority`.
+  static int Queue(int priority) {
+    EioPriority* self = Shared();
+    int waiting = __sync_add_and_fetch(&self->waiting, 0);
+
+    if (waiting == 0) {
+      self->aging = false;
+      self->burst = 0;
+    }
+
+    if (!self->aging && priority == PHIGH && waiting > 0 &&
+	++self->burst > EIO_HIGH_BURST) {
+      self->aging = true;
+    }
+
+    if (self->aging) {
+      __sync_add_and_fetch(&self->waiting, 1);
+      return EIO_PRI_MIN;
+    }
+
+    switch (priority) {
+    case PHIGH:
+      return EIO_PRI_DEFAULT + 2;
+    case PLOW:
+      __sync_add_and_fetch(&self->waiting, 1);
+      return EIO_PRI_DEFAULT - 2;
+    default:
+      __sync_add_and_fetch(&self->waiting, 1);
+      return EIO_PRI_DEFAULT;
+    }
+  }
+
+  // Called on a worker thread as a request starts.
+  static void Start(int priority, int pri) {
+    if (priority != PHIGH || pri == EIO_PRI_MIN) {
+      __sync_sub_and_fetch(&Shared()->waiting, 1);
+    }
+  }
+};
+
+// By default, requests run in the libeio thread pool that's shared by
+// the whole process. A database can have its own WorkerPool instead
+// so that its requests don't compete with `fs` or other databases.
+//
+// A pool has a queue for each priority class. Foreground threads
+// serve high and normal jobs; background threads serve low jobs so
+// that long-running maintenance can't hold up anything else. High
+// jobs go first, but a normal job that has waited longer than `aging`
+// microseconds is taken ahead of them so it can't starve. Finished
+// jobs are handed back to the main thread through an `ev_async`
+// watcher.
+class WorkerPool {
+public:
+  struct QueueStats {
+    uint32_t threads;
+    uint64_t jobs;
+    uint64_t max_depth;
+    uint64_t total_wait;
+    uint64_t max_wait;
+  };
+
+private:
+  struct Entry {
+    Job* job;
+    uint64_t queued;
+  };
+
+  struct Worker {
+    WorkerPool* pool;
+    bool background;
+    pthread_t thread;
+  };
+
+  pthread_mutex_t lock;
+  pthread_cond_t foreground_ready;
+  pthread_cond_t background_ready;
+  std::deque<Entry> queues[PRIORITIES];
+  QueueStats stats[PRIORITIES];
+  uint64_t aging;
+  std::vector<Job*> finished;
+  std::vector<Worker*> workers;
+  ev_async notifier;
+  bool stopping;
+
+public:
+  WorkerPool(uint32_t foreground, uint32_t background, uint64_t aging):
+    aging(aging),
+    stopping(false)
+  {
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&foreground_ready, NULL);
+    pthread_cond_init(&background_ready, NULL);
+    memset(stats, 0, sizeof(stats));
+
+    // The watcher shouldn't keep the loop alive by itself; each job
+    // holds its own reference until it's finished.
+    ev_async_init(&notifier, Finish);
+    notifier.data = this;
+    ev_async_start(EV_DEFAULT_UC_ &notifier);
+    ev_unref(EV_DEFAULT_UC);
+
+    stats[PHIGH].threads = stats[PNORMAL].threads = foreground;
+    stats[PLOW].threads = background;
+    start(false, foreground);
+    start(true, background);
+  }
+
+  // Jobs keep their database alive, so the queues are empty by the
+  // time a pool is destroyed.
+  ~WorkerPool() {
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&foreground_ready);
+    pthread_cond_broadcast(&background_ready);
+    pthread_mutex_unlock(&lock);
+
+    for (size_t i = 0; i < workers.size(); i++) {
+      pthread_join(workers[i]->thread, NULL);
+      delete workers[i];
+    }
+
+    ev_ref(EV_DEFAULT_UC);
+    ev_async_stop(EV_DEFAULT_UC_ &notifier);
+
+    pthread_cond_destroy(&foreground_ready);
+    pthread_cond_destroy(&background_ready);
+    pthread_mutex_destroy(&lock);
+  }
+
+  void submit(Job* job, int priority) {
+    Entry entry = { job, NowMicros() };
+
+    pthread_mutex_lock(&lock);
+    queues[priority].push_back(entry);
+    if (queues[priority].size() > stats[priority].max_depth) {
+      stats[priority].max_depth = queues[priority].size();
+    }
+    pthread_cond_signal(priority == PLOW ? &background_ready : &foreground_ready);
+    pthread_mutex_unlock(&lock);
+  }
+
+  // Copy the counters for a priority class; `depth` is the length of
+  // its queue.
+  void status(int priority, QueueStats* result, size_t* depth) {
+    pthread_mutex_lock(&lock);
+    *result = stats[priority];
+    *depth = queues[priority].size();
+    pthread_mutex_unlock(&lock);
+  }
+
+private:
+  void start(bool background, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+      Worker* worker = new Worker();
+      worker->pool = this;
+      worker->background = background;
+      pthread_create(&worker->thread, NULL, Run, worker);
+      workers.push_back(worker);
+    }
+  }
+
+  static void* Run(void* data) {
+    Worker* worker = static_cast<Worker*>(data);
+    worker->pool->work(worker->background);
+    return NULL;
+  }
+
+  // Pick the queue a thread should take from next, or -1 if there's
+  // nothing for it. Called with the lock held.
+  int choose(bool background, uint64_t now) {
+    if (background) {
+      return queues[PLOW].empty() ? -1 : PLOW;
+    }
+
+    if (queues[PHIGH].empty()) {
+      return queues[PNORMAL].empty() ? -1 : PNORMAL;
+    }
+
+    if (!queues[PNORMAL].empty() && now - queues[PNORMAL].front().queued > aging) {
+      return PNORMAL;
+    }
+
+    return PHIGH;
+  }
+
+  void work(bool background) {
+    pthread_cond_t* ready = background ? &background_ready : &foreground_ready;
+    int priority;
+
+    pthread_mutex_lock(&lock);
+
+    while (true) {
+      uint64_t now = NowMicros();
+      while (!stopping && (priority = choose(background, now)) < 0) {
+	pthread_cond_wait(ready, &lock);
+	now = NowMicros();
+      }
+      if (stopping && (priority = choose(background, now)) < 0) break;
+
+      Entry entry = queues[priority].front();
+      queues[priority].pop_front();
+
+      uint64_t wait = now - entry.queued;
+      QueueStats& qs = stats[priority];
+      qs.jobs++;
+      qs.total_wait += wait;
+      if (wait > qs.max_wait) qs.max_wait = wait;
+
+      pthread_mutex_unlock(&lock);
+      entry.job->run();
+      pthread_mutex_lock(&lock);
+
+      finished.push_back(entry.job);
+      ev_async_send(EV_DEFAULT_UC_ &notifier);
+    }
+
+    pthread_mutex_unlock(&lock);
+  }
+
+  // Runs on the main thread. Several jobs may have finished since the
+  // last wakeup; handle them all.
+  static void Finish(EV_P_ ev_async* watcher, int revents) {
+    WorkerPool* pool = static_cast<WorkerPool*>(watcher->data);
+    std::vector<Job*> jobs;
+
+    pthread_mutex_lock(&pool->lock);
+    jobs.swap(pool->finished);
+    pthread_mutex_unlock(&pool->lock);
+
+    Completions::Deliver(jobs);
+  }
+};
+
+
+// ## SyncGroup ##
+
+// Synchronize requests for a database are collapsed into as few
+// physical syncs as possible. The group lives on the main thread, so
+// no worker ever waits in it. While a sync runs, new requests are held
+// here, since they may have written after it started. When it
+// finishes, the first held request runs one more sync on behalf of
+// all of them and answers the rest when it's done. The sync is hard if
+// any of them asked for a hard sync.
+class SyncGroup {
+private:
+  std::vector<Job*> held;
+  bool syncing;
+  bool hard;
+  uint64_t requests;
+  uint64_t syncs;
+
+public:
+  SyncGroup():
+    syncing(false),
+    hard(false),
+    requests(0),
+    syncs(0)
+  {}
+
+  // Returns true if `job` should run a sync now, or false if it's
+  // held for the next one.
+  bool join(Job* job, bool want_hard) {
+    requests++;
+
+    if (syncing) {
+      held.push_back(job);
+      if (want_hard) hard = true;
+      return false;
+    }
+
+    syncing = true;
+    syncs++;
+    return true;
+  }
+
+  // Called when a sync has finished. Moves the held jobs to `jobs`.
+  // If there are any, the first should run the next sync for all of
+  // them, hard if `*want_hard`.
+  void finished(std::vector<Job*>& jobs, bool* want_hard) {
+    jobs.clear();
+    jobs.swap(held);
+    *want_hard = hard;
+    hard = false;
+
+    syncing = !jobs.empty();
+    if (syncing) syncs++;
+  }
+
+  // The number of requests and of physical syncs so far.
+  void stats(uint64_t* requests, uint64_t* physical) {
+    *requests = this->requests;
+    *physical = syncs;
+  }
+};
+
+
+// ## ReadCache ##
+
+// An optional LRU cache of values, used only on the main thread. A
+// `get()` that hits it doesn't go to the thread pool at all. Entries
+// are charged their key and value sizes plus a fixed overhead
+// against `capacity` bytes.
+//
+// Every mutation drops the keys it changes when it's dispatched and
+// again just before its callback, so a read that ran between the two
+// can't leave a stale value behind. A read only fills the cache if
+// nothing was dropped since it was dispatched; the `epoch` counts
+// the drops.
+class ReadCache {
+public:
+  struct Stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t evictions;
+    uint64_t invalidations;
+  };
+
+private:
+  typedef std::pair<std::string, std::string> Entry;
+  typedef std::list<Entry> EntryList;
+  typedef std::map<std::string, EntryList::iterator> EntryIndex;
+
+  static const size_t OVERHEAD = 64;
+
+  EntryList entries;		// most recently used first
+  EntryIndex index;
+  size_t capacity;
+  size_t used;
+  uint64_t current;
+  Stats counts;
+
+public:
+  explicit ReadCache(size_t capacity):
+    capacity(capacity),
+    used(0),
+    current(0)
+  {
+    memset(&counts, 0, sizeof(counts));
+  }
+
+  uint64_t epoch() {
+    return current;
+  }
+
+  // Find a value, making it the most recently used.
+  const std::string* lookup(const char* kbuf, size_t ksiz) {
+    EntryIndex::iterator found = index.find(std::string(kbuf, ksiz));
+    if (found == index.end()) {
+      counts.misses++;
+      return NULL;
+    }
+
+    counts.hits++;
+    entries.splice(entries.begin(), entries, found->second);
+    return &found->second->second;
+  }
+
+  // Keep a value read by a request dispatched at `since`.
+  void insert(const char* kbuf, size_t ksiz, const char* vbuf, size_t vsiz, uint64_t since) {
+    size_t size = ksiz + vsiz + OVERHEAD;
+    if (since != current || size > capacity) return;
+
+    std::string key(kbuf, ksiz);
+    remove(key);
+
+    entries.push_front(Entry(key, std::string(vbuf, vsiz)));
+    index[key] = entries.begin();
+    used += size;
+    counts.inserts++;
+
+    while (used > capacity) {
+      counts.evictions++;
+      remove(entries.back().first);
+    }
+  }
+
+  void invalidate(const char* kbuf, size_t ksiz) {
+    current++;
+    counts.invalidations++;
+    remove(std::string(kbuf, ksiz));
+  }
+
+  void clear() {
+    current++;
+    counts.invalidations++;
+    entries.clear();
+    index.clear();
+    used = 0;
+  }
+
+  void status(Stats* stats, size_t* bytes, size_t* count, size_t* limit) {
+    *stats = counts;
+    *bytes = used;
+    *count = index.size();
+    *limit = capacity;
+  }
+
+private:
+  void remove(const std::string& key) {
+    EntryIndex::iterator found = index.find(key);
+    if (found == index.end()) return;
+
+    const Entry& entry = *found->second;
+    used -= entry.first.size() + entry.second.size() + OVERHEAD;
+    entries.erase(found->second);
+    index.erase(found);
+  }
+};
+
+
+// ## Tier ##
+
+// A database can have a hot tier: a bounded in-memory CacheDB in
+// front of its file. Point reads check the hot tier first and promote
+// what they find in the file; point writes go to the file and then
+// the hot tier (write-through), or only to the hot tier until they're
+// flushed (write-back). Both tiers are used in the same job, so a miss
+// costs one trip to the thread pool.
+//
+// In write-through mode Kyoto evicts from the hot tier by itself,
+// since the file has everything. In write-back mode the tier bounds
+// itself: when it's over its limits, the oldest records are demoted,
+// and the dirty ones among them are written to the file first. Dirty
+// keys are always in the hot tier, so a miss can safely read the file.
+//
+// Promotion is skipped if anything was written since the read
+// started (`epoch`), so a read that races a write can't promote a
+// stale value.
+class Tier {
+public:
+  enum Write {
+    WSET,
+    WADD,
+    WREPLACE,
+    WAPPEND
+  };
+
+  struct Stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t promotions;
+    uint64_t demotions;
+    uint64_t flushes;
+  };
+
+private:
+  PolyDB hot;
+  bool write_back;
+  int64_t max_count;
+  int64_t max_bytes;
+  pthread_mutex_t lock;
+  uint64_t epoch;
+  std::set<std::string> dirty;
+  Stats counts;
+
+public:
+  Tier(bool write_back, int64_t max_count, int64_t max_bytes):
+    write_back(write_back),
+    max_count(max_count),
+    max_bytes(max_bytes),
+    epoch(0)
+  {
+    pthread_mutex_init(&lock, NULL);
+    memset(&counts, 0, sizeof(counts));
+  }
+
+  ~Tier() {
+    hot.close();
+    pthread_mutex_destroy(&lock);
+  }
+
+  bool is_write_back() {
+    return write_back;
+  }
+
+  PolyDB::Error::Code open() {
+    std::ostringstream path;
+    path << "*";
+    if (!write_back) {
+      if (max_count > 0) path << "#capcnt=" << max_count;
+      if (max_bytes > 0) path << "#capsiz=" << max_bytes;
+    }
+
+    if (!hot.open(path.str(), PolyDB::OWRITER | PolyDB::OCREATE))
+      return hot.error().code();
+    return PolyDB::Error::SUCCESS;
+  }
+
+  // Flush, then close the hot tier.
+  PolyDB::Error::Code close(PolyDB* cold) {
+    PolyDB::Error::Code code = flush(cold);
+    hot.close();
+    return code;
+  }
+
+  // Like `PolyDB::get()`; the caller owns `*vbuf`.
+  PolyDB::Error::Code get(PolyDB* cold, const char* kbuf, size_t ksiz,
+			  char** vbuf, size_t* vsiz) {
+    *vbuf = hot.get(kbuf, ksiz, vsiz);
+
+    pthread_mutex_lock(&lock);
+    uint64_t since = epoch;
+    if (*vbuf) counts.hits++; else counts.misses++;
+    pthread_mutex_unlock(&lock);
+
+    if (*vbuf) return PolyDB::Error::SUCCESS;
+
+    *vbuf = cold->get(kbuf, ksiz, vsiz);
+    if (!*vbuf) return cold->error().code();
+
+    pthread_mutex_lock(&lock);
+    if (since == epoch) {
+      hot.set(kbuf, ksiz, *vbuf, *vsiz);
+      counts.promotions++;
+      // The read itself succeeded; a record that can't be demoted
+      // stays dirty, for the next write or flush to report.
+      if (write_back) make_room(cold);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return PolyDB::Error::SUCCESS;
+  }
+
+  PolyDB::Error::Code write(PolyDB* cold, Write op, const char* kbuf, size_t ksiz,
+			    const char* vbuf, size_t vsiz) {
+    PolyDB::Error::Code code = PolyDB::Error::SUCCESS;
+
+    if (!write_back) {
+      if (!apply(cold, op, kbuf, ksiz, vbuf, vsiz))
+	return cold->error().code();
+
+      // Only a plain set knows the new value; the others drop the
+      // old one so the next read promotes it again.
+      pthread_mutex_lock(&lock);
+      epoch++;
+      if (op == WSET)
+	hot.set(kbuf, ksiz, vbuf, vsiz);
+      else
+	hot.remove(kbuf, ksiz);
+      pthread_mutex_unlock(&lock);
+      return code;
+    }
+
+    pthread_mutex_lock(&lock);
+    epoch++;
+    if (op != WSET) promote(cold, kbuf, ksiz);
+
+    if (apply(&hot, op, kbuf, ksiz, vbuf, vsiz)) {
+      dirty.insert(std::string(kbuf, ksiz));
+      code = make_room(cold);
+    }
+    else {
+      code = hot.error().code();
+    }
+    pthread_mutex_unlock(&lock);
+
+    return code;
+  }
+
+  // The lock is held until the record is gone from the file, so a
+  // `get()` that read it there before can't promote it afterward.
+  PolyDB::Error::Code remove(PolyDB* cold, const char* kbuf, size_t ksiz) {
+    PolyDB::Error::Code code = PolyDB::Error::SUCCESS;
+
+    pthread_mutex_lock(&lock);
+    hot.remove(kbuf, ksiz);
+    bool was_dirty = dirty.erase(std::string(kbuf, ksiz)) > 0;
+    if (!cold->remove(kbuf, ksiz)) code = cold->error().code();
+    epoch++;
+    pthread_mutex_unlock(&lock);
+
+    if (code == PolyDB::Error::NOREC && was_dirty)
+      return PolyDB::Error::SUCCESS;
+    return code;
+  }
+
+  // Drop a key changed in the file by some other request.
+  void invalidate(const char* kbuf, size_t ksiz) {
+    pthread_mutex_lock(&lock);
+    epoch++;
+    hot.remove(kbuf, ksiz);
+    pthread_mutex_unlock(&lock);
+  }
+
+  void invalidate_all(PolyDB* cold) {
+    pthread_mutex_lock(&lock);
+    epoch++;
+    if (flush_locked(cold) == PolyDB::Error::SUCCESS)
+      hot.clear();
+    else
+      drop_clean();
+    pthread_mutex_unlock(&lock);
+  }
+
+  // Write every dirty record to the file.
+  PolyDB::Error::Code flush(PolyDB* cold) {
+    pthread_mutex_lock(&lock);
+    PolyDB::Error::Code code = flush_locked(cold);
+    pthread_mutex_unlock(&lock);
+    return code;
+  }
+
+  void status(Stats* stats, int64_t* count, int64_t* bytes, size_t* dirty_count) {
+    pthread_mutex_lock(&lock);
+    *stats = counts;
+    *dirty_count = dirty.size();
+    pthread_mutex_unlock(&lock);
+    *count = hot.count();
+    *bytes = hot.size();
+  }
+
+private:
+  static bool apply(PolyDB* db, Write op, const char* kbuf, size_t ksiz,
+		    const char* vbuf, size_t vsiz) {
+    switch (op) {
+    case WADD:
+      return db->add(kbuf, ksiz, vbuf, vsiz);
+    case WREPLACE:
+      return db->replace(kbuf, ksiz, vbuf, vsiz);
+    case WAPPEND:
+      return db->append(kbuf, ksiz, vbuf, vsiz);
+    default:
+      return db->set(kbuf, ksiz, vbuf, vsiz);
+    }
+  }
+
+  // Copy a record from the file so a write-back add, replace or
+  // append sees it.
+  void promote(PolyDB* cold, const char* kbuf, size_t ksiz) {
+    size_t vsiz;
+    char* vbuf = hot.get(kbuf, ksiz, &vsiz);
+    if (vbuf) {
+      delete[] vbuf;
+      return;
+    }
+
+    vbuf = cold->get(kbuf, ksiz, &vsiz);
+    if (vbuf) {
+      hot.set(kbuf, ksiz, vbuf, vsiz);
+      counts.promotions++;
+      delete[] vbuf;
+    }
+  }
+
+  // A record that can't be written stays dirty, so the next flush
+  // tries it again.
+  PolyDB::Error::Code flush_locked(PolyDB* cold) {
+    PolyDB::Error::Code code = PolyDB::Error::SUCCESS;
+    if (dirty.empty()) return code;
+
+    std::set<std::string>::iterator key = dirty.begin();
+    while (key != dirty.end()) {
+      size_t vsiz;
+      char* vbuf = hot.get(key->data(), key->size(), &vsiz);
+      bool written = !vbuf || cold->set(key->data(), key->size(), vbuf, vsiz);
+      if (vbuf) delete[] vbuf;
+
+      if (written) {
+	dirty.erase(key++);
+      }
+      else {
+	code = cold->error().code();
+	++key;
+      }
+    }
+
+    counts.flushes++;
+    return code;
+  }
+
+  // Drop every record but the dirty ones, which couldn't be flushed.
+  void drop_clean() {
+    DB::Cursor* cursor = hot.cursor();
+    cursor->jump();
+
+    std::string key;
+    while (cursor->get_key(&key, false)) {
+      if (dirty.count(key) > 0) {
+	if (!cursor->step()) break;
+      }
+      else if (!cursor->remove()) {
+	break;
+      }
+    }
+
+    delete cursor;
+  }
+
+  bool over(double fraction) {
+    return ((max_count > 0 && hot.count() > max_count * fraction)
+	    || (max_bytes > 0 && hot.size() > max_bytes * fraction));
+  }
+
+  // Demote the oldest records until the tier is comfortably under its
+  // limits. A CacheDB's cursor visits each of its slots from least
+  // to most recently used, so this is roughly LRU order. A dirty
+  // record is only demoted once it's in the file; if it can't be
+  // written, demotion stops there and the error is returned.
+  PolyDB::Error::Code make_room(PolyDB* cold) {
+    PolyDB::Error::Code code = PolyDB::Error::SUCCESS;
+    if (!over(1.0)) return code;
+
+    DB::Cursor* cursor = hot.cursor();
+    cursor->jump();
+
+    std::string key, value;
+    while (over(0.9) && cursor->get(&key, &value, false)) {
+      if (dirty.count(key) > 0) {
+	if (!cold->set(key, value)) {
+	  code = cold->error().code();
+	  break;
+	}
+	dirty.erase(key);
+      }
+      counts.demotions++;
+      if (!cursor->remove()) break;
+    }
+
+    delete cursor;
+    return code;
+  }
+};
+
+
+// ## Bloom ##
+
+// A database can keep a Bloom filter of its keys, so a `get()` for a
+// key it has never stored can be answered on the main thread without
+// a trip to the thread pool or the file. Every request that can
+// create records adds their keys; removals can't take keys out, so
+// the filter only ever errs toward "maybe". Worker threads add keys
+// with atomic ORs while the main thread checks them. For the same
+// reason, the bits are only cleared when the database is opened,
+// before any request can add keys; `clear()` and `loadSnapshot()`
+// leave them set.
+//
+// A file database's filter is saved to `<path>.bloom` after it closes
+// and loaded when it opens again. The file records the database's
+// inode, size and modification time as the close left them, and its
+// record count; these are checked against the database as it was
+// before opening it. So a file is only loaded for the database it was
+// saved with, and only if nothing has written to it since. Otherwise
+// the filter is rebuilt with a parallel scan. The database itself
+// holds nothing of the filter's.
+class Bloom: public DB::Visitor {
+public:
+  struct Stats {
+    uint64_t checks;
+    uint64_t negatives;
+    uint64_t false_positives;
+  };
+
+private:
+  static const uint64_t MAGIC = 0x334d4f4f4c42594bULL; // "KYBLOOM3"
+
+  uint64_t nbits;
+  uint32_t nhashes;
+  uint64_t* words;
+  AtomicInt64 added;
+  std::string file;
+  std::string path;
+  Stats counts;
+
+public:
+  Bloom(uint64_t bits, uint32_t hashes):
+    nbits((bits + 63) / 64 * 64),
+    nhashes(hashes ? hashes : 1),
+    added(0)
+  {
+    words = new uint64_t[nbits / 64];
+    memset(&counts, 0, sizeof(counts));
+    clear();
+  }
+
+  ~Bloom() {
+    delete[] words;
+  }
+
+  void add(const char* kbuf, size_t ksiz) {
+    uint64_t h1 = hashmurmur(kbuf, ksiz), h2 = hashfnv(kbuf, ksiz) | 1;
+    for (uint32_t i = 0; i < nhashes; i++) {
+      uint64_t bit = (h1 + i * h2) % nbits;
+      __sync_fetch_and_or(&words[bit / 64], (uint64_t)1 << (bit % 64));
+    }
+    added.add(1);
+  }
+
+  // False means the key is definitely not in the database. Only
+  // called on the main thread.
+  bool check(const char* kbuf, size_t ksiz) {
+    uint64_t h1 = hashmurmur(kbuf, ksiz), h2 = hashfnv(kbuf, ksiz) | 1;
+    counts.checks++;
+    for (uint32_t i = 0; i < nhashes; i++) {
+      uint64_t bit = (h1 + i * h2) % nbits;
+      if (!(words[bit / 64] & ((uint64_t)1 << (bit % 64)))) {
+	counts.negatives++;
+	return false;
+      }
+    }
+    return true;
+  }
+
+  // A key that passed `check()` wasn't there after all.
+  void false_positive() {
+    counts.false_positives++;
+  }
+
+  void clear() {
+    memset(words, 0, nbits / 8);
+    added.set(0);
+  }
+
+  // What a saved filter is checked against: a file's inode, size and
+  // modification time. False if it can't be read.
+  static bool Stamp(const std::string& file, uint64_t stamp[3]) {
+    struct stat st;
+    if (file.empty() || ::stat(file.c_str(), &st) != 0) return false;
+    stamp[0] = st.st_ino;
+    stamp[1] = st.st_size;
+    stamp[2] = st.st_mtime;
+    return true;
+  }
+
+  // Fill the filter for a database that was just opened. `db_file`
+  // is the database's path, or empty if it isn't saved; `stamp` is
+  // what `Stamp()` said about it before it was opened, or NULL.
+  void open(PolyDB* db, const std::string& db_file, const uint64_t* stamp, bool truncated) {
+    file = db_file;
+    path = file.empty() ? file : file + ".bloom";
+
+    if (truncated || db->count() == 0) {
+      clear();
+      if (!path.empty()) ::unlink(path.c_str());
+    }
+    else if (!stamp || !load(stamp, db->count())) {
+      rebuild(db);
+    }
+  }
+
+  // Fill the filter from the database with a parallel scan. This
+  // clears it first, so it's only for `open()`, before any request
+  // can add keys.
+  void rebuild(PolyDB* db) {
+    clear();
+    db->scan_parallel(this, 4);
+  }
+
+  // Add every key in the database. Other requests may be adding keys
+  // meanwhile, so the live bits are never cleared: the keys go into a
+  // separate filter, which is then ORed in.
+  void merge(PolyDB* db) {
+    Bloom fresh(nbits, nhashes);
+    db->scan_parallel(&fresh, 4);
+
+    for (uint64_t i = 0; i < nbits / 64; i++) {
+      if (fresh.words[i]) __sync_fetch_and_or(&words[i], fresh.words[i]);
+    }
+    added.add(fresh.added.get());
+  }
+
+  // Save the filter for a database that was just closed with `count`
+  // records. It has to be closed first, so the stamp is the one the
+  // next `open()` will see.
+  bool save(int64_t count) {
+    if (path.empty()) return true;
+
+    uint64_t header[8] = {
+      MAGIC, nbits, nhashes, (uint64_t)count, (uint64_t)added.get()
+    };
+    if (!Stamp(file, header + 5)) {
+      ::unlink(path.c_str());
+      return false;
+    }
+
+    FILE* out = fopen(path.c_str(), "wb");
+    if (!out) return false;
+
+    bool ok = (fwrite(header, sizeof(header), 1, out) == 1
+	       && fwrite(words, nbits / 8, 1, out) == 1);
+    ok = (fclose(out) == 0) && ok;
+    if (!ok) ::unlink(path.c_str());
+    return ok;
+  }
+
+  void status(Stats* stats, uint64_t* bits, uint32_t* hashes, int64_t* keys, uint64_t* set) {
+    *stats = counts;
+    *bits = nbits;
+    *hashes = nhashes;
+    *keys = added.get();
+
+    *set = 0;
+    for (uint64_t i = 0; i < nbits / 64; i++) {
+      *set += __builtin_popcountll(words[i]);
+    }
+  }
+
+private:
+  const char* visit_full(const char* kbuf, size_t ksiz,
+			 const char* vbuf, size_t vsiz, size_t* sp) {
+    add(kbuf, ksiz);
+    return NOP;
+  }
+
+  bool load(const uint64_t* stamp, int64_t count) {
+    FILE* in = fopen(path.c_str(), "rb");
+    if (!in) return false;
+
+    uint64_t header[8];
+    bool ok = (fread(header, sizeof(header), 1, in) == 1
+	       && header[0] == MAGIC && header[1] == nbits
+	       && header[2] == nhashes && header[3] == (uint64_t)count
+	       && memcmp(header + 5, stamp, 3 * sizeof(*stamp)) == 0
+	       && fread(words, nbits / 8, 1, in) == 1);
+    fclose(in);
+    ::unlink(path.c_str());
+
+    if (ok) added.set(header[4]);
+    return ok;
+  }
+};
+
+
+// ## PolyDB ##
+
+class PolyDBWrap: ObjectWrap {
+private:
+  PolyDB* db;
+  bool binary;
+  WorkerPool* workers;
+  int priority_override;
+  Metrics op_metrics;
+  SyncGroup sync_group;
+  ReadCache* cache;
+  Tier* tier;
+  Bloom* bloom;
+  Comparator* order;
+
+public:
+
+  
+  // ### Initialization ###
+
+  static Persistent<FunctionTemplate> ctor;
+
+  // Operations understood by `writeBatch()`.
+  enum BatchOp {
+    BSET,
+    BADD,
+    BREPLACE,
+    BAPPEND,
+    BREMOVE,
+    BINCREMENT,
+    BCAS
+  };
+
+  // Operations understood by `update()`.
+  enum UpdateOp {
+    UMAX,
+    UMIN,
+    UPUSH,
+    UPOP,
+    USETADD,
+    USETREMOVE,
+    UCOUNT,
+    UMERGE,
+    UMERGEJSON
+  };
+
+  static void Init(Handle<Object> target) {
+    HandleScope scope;
+
+    Local<FunctionTemplate> tmpl = FunctionTemplate::New(New);
+
+    ctor = Persistent<FunctionTemplate>::New(tmpl);
+    ctor->InstanceTemplate()->SetInternalFieldCount(1);
+    ctor->SetClassName(String::NewSymbol("PolyDB"));
+
+    SET_CLASS_CONSTANT(ctor, PolyDB, OREADER);
+    SET_CLASS_CONSTANT(ctor, PolyDB, OWRITER);
+    SET_CLASS_CONSTANT(ctor, PolyDB, OCREATE);
+    SET_CLASS_CONSTANT(ctor, PolyDB, OTRUNCATE);
+    SET_CLASS_CONSTANT(ctor, PolyDB, OAUTOTRAN);
+    SET_CLASS_CONSTANT(ctor, PolyDB, OAUTOSYNC);
+    SET_CLASS_CONSTANT(ctor, PolyDB, ONOLOCK);
+    SET_CLASS_CONSTANT(ctor, PolyDB, OTRYLOCK);
+    SET_CLASS_CONSTANT(ctor, PolyDB, ONOREPAIR);
+
+    SET_CLASS_CONSTANT(ctor, PolyDB, MSET);
+    SET_CLASS_CONSTANT(ctor, PolyDB, MADD);
+    SET_CLASS_CONSTANT(ctor, PolyDB, MREPLACE);
+    SET_CLASS_CONSTANT(ctor, PolyDB, MAPPEND);
+
+    SET_CLASS_CONSTANT(ctor, PolyDB::Error, SUCCESS);
+    SET_CLASS_CONSTANT(ctor, PolyDB::Error, NOIMPL);
+    SET_CLASS_CONSTANT(ctor, PolyDB::Error, INVALID);
+    SET_CLASS_CONSTANT(ctor, PolyDB::Error, NOREPOS);
+    SET_CLASS_CONSTANT(ctor, PolyDB::Error, NOPERM);
+    SET_CLASS_CONSTANT(ctor, PolyDB::Error, BROKEN);
+    SET_CLASS_CONSTANT(ctor, PolyDB::Error, DUPREC);
+    SET_CLASS_CONSTANT(ctor, PolyDB::Error, NOREC);
+    SET_CLASS_CONSTANT(ctor, PolyDB::Error, LOGIC);
+    SET_CLASS_CONSTANT(ctor, PolyDB::Error, SYSTEM);
+    SET_CLASS_CONSTANT(ctor, PolyDB::Error, MISC);
+
+    SET_CONSTANT(ctor, INT64MIN);
+    SET_CONSTANT(ctor, INT64MAX);
+
+    SET_CONSTANT(ctor, BSET);
+    SET_CONSTANT(ctor, BADD);
+    SET_CONSTANT(ctor, BREPLACE);
+    SET_CONSTANT(ctor, BAPPEND);
+    SET_CONSTANT(ctor, BREMOVE);
+    SET_CONSTANT(ctor, BINCREMENT);
+    SET_CONSTANT(ctor, BCAS);
+
+    SET_CONSTANT(ctor, UMAX);
+    SET_CONSTANT(ctor, UMIN);
+    SET_CONSTANT(ctor, UPUSH);
+    SET_CONSTANT(ctor, UPOP);
+    SET_CONSTANT(ctor, USETADD);
+    SET_CONSTANT(ctor, USETREMOVE);
+    SET_CONSTANT(ctor, UCOUNT);
+    SET_CONSTANT(ctor, UMERGE);
+    SET_CONSTANT(ctor, UMERGEJSON);
+
+    SET_CONSTANT(ctor, PHIGH);
+    SET_CONSTANT(ctor, PNORMAL);
+    SET_CONSTANT(ctor, PLOW);
+
+    NODE_SET_PROTOTYPE_METHOD(ctor, "open", Open);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "close", Close);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "closeSync", CloseSync);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "compare", Compare);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "clear", Clear);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "set", Set);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "add", Add);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "replace", Replace);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "append", Append);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "increment", Increment);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "incrementDouble", IncrementDouble);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "cas", CAS);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "remove", Remove);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "get", Get);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "getBulk", GetBulk);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "setBulk", SetBulk);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "removeBulk", RemoveBulk);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "writeBatch", WriteBatch);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "update", Update);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "updateBulk", UpdateBulk);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "matchPrefix", MatchPrefix);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "matchRegex", MatchRegex);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "synchronize", Synchronize);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "syncStats", SyncStats);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "copy", Copy);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "dumpSnapshot", DumpSnapshot);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "loadSnapshot", LoadSnapshot);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "loadSorted", LoadSorted);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "count", Count);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "size", Size);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "status", Status);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "setBinary", SetBinary);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "getSync", GetSync);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "setSync", SetSync);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "removeSync", RemoveSync);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "getBulkSync", GetBulkSync);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "setCache", SetCache);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "getCached", GetCached);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "cacheStats", CacheStats);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "openTier", OpenTier);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "setBloom", SetBloom);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "mayContain", MayContain);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "filterKeys", FilterKeys);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "bloomStats", BloomStats);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "flushTier", FlushTier);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "tierStats", TierStats);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "getColumns", GetColumns);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "setColumns", SetColumns);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "startWorkers", StartWorkers);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "workerStats", WorkerStats);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "setPriority", SetPriority);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "scanParallel", ScanParallel);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "metrics", GetMetrics);
+    // NODE_SET_PROTOTYPE_METHOD(ctor, "merge", Merge);
+
+    // Here are some non-standard methods for Toji.
+    NODE_SET_PROTOTYPE_METHOD(ctor, "addIndexed", AddIndexed);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "replaceIndexed", ReplaceIndexed);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "removeIndexed", RemoveIndexed);
+
+    target->Set(String::NewSymbol("PolyDB"), ctor->GetFunction());
+  }
+
+  
+  // ### Construction ###
+
+  PolyDBWrap():
+    binary(false),
+    workers(NULL),
+    priority_override(-1),
+    cache(NULL),
+    tier(NULL),
+    bloom(NULL),
+    order(NULL)
+  {
+    db = new PolyDB();
+  }
+
+  ~PolyDBWrap() {
+    if (workers) delete workers;
+    if (cache) delete cache;
+    if (tier) delete tier;
+    if (bloom) delete bloom;
+    delete db;
+  }
+
+  static Handle<Value> New(const Arguments& args) {
+    HandleScope scope;
+    PolyDBWrap* wrap = new PolyDBWrap();
+    wrap->Wrap(args.This());
+    return args.This();
+  }
+
+  
+  // ### Helpers ###
+
+  DB::Cursor* cursor() {
+    return db->cursor();
+  }
+
+  bool is_binary() {
+    return binary;
+  }
+
+  WorkerPool* pool() {
+    return workers;
+  }
+
+  Metrics* metrics() {
+    return &op_metrics;
+  }
+
+  ReadCache* read_cache() {
+    return cache;
+  }
+
+  Tier* hot_tier() {
+    return tier;
+  }
+
+  PolyDB* database() {
+    return db;
+  }
+
+  int current_priority() {
+    return priority_override;
+  }
+
+  // Cursors hold a reference to their database.
+  void retain() {
+    Ref();
+  }
+
+  void release() {
+    Unref();
+  }
+
+  // The comparator that orders records, or NULL if the database
+  // isn't ordered. Call this from a worker; it asks the database for
+  // its status.
+  Comparator* comparator() {
+    BasicDB* inner = db->reveal_inner_db();
+    if (!inner) return NULL;
+
+    std::map<std::string, std::string> status;
+    if (!inner->status(&status)) return NULL;
+
+    switch (atoi(status["type"].c_str())) {
+    case BasicDB::TYPEPTREE:
+      return LEXICALCOMP;
+    case BasicDB::TYPETREE:
+      return static_cast<TreeDB*>(inner)->rcomp();
+    case BasicDB::TYPEGRASS:
+      return static_cast<GrassDB*>(inner)->rcomp();
+    case BasicDB::TYPEFOREST:
+      return static_cast<ForestDB*>(inner)->rcomp();
+    default:
+      return NULL;
+    }
+  }
+
+  class Request: public Job {
+  protected:
+    PolyDBWrap* wrap;
+    Persistent<Function> next;
+    PolyDB::Error::Code result;
+    bool binary;
+    int priority_override;
+    std::string* touched;
+    bool touched_all;
+
+  public:
+    Request(const Arguments& args, int nextIndex):
+      result(PolyDB::Error::SUCCESS),
+      touched(NULL),
+      touched_all(false) {
+      HandleScope scope;
+
+      wrap = ObjectWrap::Unwrap<PolyDBWrap>(args.This());
+      next = Persistent<Function>::New(Handle<Function>::Cast(args[nextIndex]));
+      binary = wrap->binary;
+      priority_override = wrap->priority_override;
+
+      wrap->Ref();
+    }
+
+    ~Request() {
+      wrap->Unref();
+      next.Dispose();
+      if (touched) delete touched;
+    }
+
+    virtual inline int exec() = 0;
+
+    virtual inline int after() = 0;
+
+    WorkerPool* pool() {
+      return wrap->workers;
+    }
+
+    // A mutation calls `touches()` with the key it changes, or
+    // `touches_all()`, from its constructor. See ReadCache.
+    void touches(const char* kbuf, size_t ksiz) {
+      touched = new std::string(kbuf, ksiz);
+      if (wrap->cache) wrap->cache->invalidate(kbuf, ksiz);
+    }
+
+    void touches_all() {
+      touched_all = true;
+      if (wrap->cache) wrap->cache->clear();
+    }
+
+    // A request that may create records calls `adds()` with each of
+    // their keys, from its constructor or `exec()`. See Bloom.
+    void adds(const char* kbuf, size_t ksiz) {
+      if (wrap->bloom) wrap->bloom->add(kbuf, ksiz);
+    }
+
+    void adds(const std::string& key) {
+      adds(key.data(), key.size());
+    }
+
+    void finishing() {
+      if (!wrap->cache) return;
+      if (touched_all)
+	wrap->cache->clear();
+      else if (touched)
+	wrap->cache->invalidate(touched->data(), touched->size());
+    }
+
+    // Requests that use the hot tier themselves say so. For the
+    // others, a write-back tier is flushed first so they see every
+    // write, and whatever they change is dropped from it afterward.
+    // See Tier.
+    virtual bool tiered() {
+      return false;
+    }
+
+    void starting() {
+      if (wrap->tier && !tiered() && wrap->tier->is_write_back())
+	wrap->tier->flush(wrap->db);
+    }
+
+    void stopping() {
+      if (!wrap->tier || tiered()) return;
+      if (touched_all)
+	wrap->tier->invalidate_all(wrap->db);
+      else if (touched)
+	wrap->tier->invalidate(touched->data(), touched->size());
+    }
+
+    static const char* scope() {
+      return "";
+    }
+
+    Metrics* metrics() {
+      return &wrap->op_metrics;
+    }
+
+    // The priority class for this kind of request.
+    virtual int default_priority() {
+      return PNORMAL;
+    }
+
+    int priority() {
+      return (priority_override < 0) ? default_priority() : priority_override;
+    }
+
+    inline void callback(int argc, Handle<Value> argv[]) {
+      TryCatch try_catch;
+      next->Call(Context::GetCurrent()->Global(), argc, argv);
+      if (try_catch.HasCaught()) {
+	FatalException(try_catch);
+      }
+    }
+
+    Local<Value> error() {
+      return KyotoError(result);
+    }
+  };
+
+  
+  // ### Workers ###
+
+  // startWorkers(foreground, background, aging=20000) gives this
+  // database its own WorkerPool. It can only be done once. See
+  // WorkerPool for `aging`, which is in microseconds.
+  static Handle<Value> StartWorkers(const Arguments& args) {
+    HandleScope scope;
+
+    if (!(args.Length() >= 2 && args[0]->IsUint32() && args[1]->IsUint32()
+	  && args[0]->Uint32Value() > 0 && args[1]->Uint32Value() > 0
+	  && (args.Length() < 3 || args[2]->IsUint32()))) {
+      return THROW_BAD_ARGS;
+    }
+
+    PolyDBWrap* wrap = ObjectWrap::Unwrap<PolyDBWrap>(args.This());
+    if (wrap->workers) {
+      return ThrowException(Exception::Error(String::New("Workers already started")));
+    }
+
+    uint64_t aging = (args.Length() >= 3) ? args[2]->Uint32Value() : 20000;
+    wrap->workers = new WorkerPool(args[0]->Uint32Value(), args[1]->Uint32Value(), aging);
+    return args.This();
+  }
+
+  // workerStats() returns an object of plain numbers for each
+  // priority class, or `null` if this database uses the shared pool.
+  // Wait times are in microseconds.
+  static Handle<Value> WorkerStats(const Arguments& args) {
+    HandleScope scope;
+
+    PolyDBWrap* wrap = ObjectWrap::Unwrap<PolyDBWrap>(args.This());
+    if (!wrap->workers) {
+      return scope.Close(LNULL);
+    }
+
+    Local<Object> result = Object::New();
+    result->Set(String::NewSymbol("high"), QueueStatus(wrap->workers, PHIGH));
+    result->Set(String::NewSymbol("normal"), QueueStatus(wrap->workers, PNORMAL));
+    result->Set(String::NewSymbol("low"), QueueStatus(wrap->workers, PLOW));
+
+    return scope.Close(result);
+  }
+
+  static Local<Object> QueueStatus(WorkerPool* pool, int priority) {
+    HandleScope scope;
+
+    WorkerPool::QueueStats stats;
+    size_t depth;
+    pool->status(priority, &stats, &depth);
+
+    Local<Object> result = Object::New();
+    result->Set(String::NewSymbol("threads"), Integer::NewFromUnsigned(stats.threads));
+    result->Set(String::NewSymbol("depth"), Number::New(depth));
+    result->Set(String::NewSymbol("maxDepth"), Number::New(stats.max_depth));
+    result->Set(String::NewSymbol("jobs"), Number::New(stats.jobs));
+    result->Set(String::NewSymbol("waitMean"),
+		Number::New(stats.jobs ? (double)stats.total_wait / stats.jobs : 0));
+    result->Set(String::NewSymbol("waitMax"), Number::New(stats.max_wait));
+
+    return scope.Close(result);
+  }
+
+  
+  // ### Metrics ###
+
+  // metrics(reset=false) returns the timings of this database's
+  // requests by method, as plain numbers in microseconds. See
+  // Metrics. If `reset` is true, the histograms start over afterward.
+  static Handle<Value> GetMetrics(const Arguments& args) {
+    HandleScope scope;
+
+    PolyDBWrap* wrap = ObjectWrap::Unwrap<PolyDBWrap>(args.This());
+    Local<Object> result = wrap->op_metrics.ToObj();
+
+    if (args.Length() >= 1 && V8_TO_BOOL(args[0])) {
+      wrap->op_metrics.reset();
+    }
+
+    return scope.Close(result);
+  }
+
+  
+  // ### Priority ###
+
+  // setPriority(priority) overrides the priority class of requests
+  // made from now on; `-1` restores the defaults. Cursors made while
+  // it's set keep it.
+  static Handle<Value> SetPriority(const Arguments& args) {
+    HandleScope scope;
+
+    if (!(args.Length() >= 1 && args[0]->IsInt32()
+	  && args[0]->Int32Value() >= -1 && args[0]->Int32Value() < PRIORITIES)) {
+      return THROW_BAD_ARGS;
+    }
+
+    PolyDBWrap* wrap = ObjectWrap::Unwrap<PolyDBWrap>(args.This());
+    wrap->priority_override = args[0]->Int32Value();
+
+    return args.This();
+  }
+
+  
+  // ### Open ###
+
+  DEFINE_METHOD(Open, OpenRequest)
+  class OpenRequest: public Request {
+  private:
+    String::Utf8Value path;
+    uint32_t mode;
+
+  public:
+    inline static bool validate(const Arguments& args) {
+      return (args.Length() >= 3
+	      && args[0]->IsString()
+	      && args[1]->IsUint32()
+	      && args[2]->IsFunction());
+    }
+
+    OpenRequest(const Arguments& args):
+      Request(args, 2),
+      path(args[0]->ToString()),
+      mode(args[1]->Uint32Value())
+    {
+      touches_all();
+    }
+
+    inline int exec() {
+      PolyDB* db = wrap->db;
+      std::string file(*path, path.length());
+      file = file.substr(0, file.find('#'));
+      bool saved = wrap->bloom && (mode & PolyDB::OWRITER) && !IsMemoryPath(file);
+
+      // A saved filter is checked against the file as it was before
+      // opening it for writing touched it.
+      uint64_t stamp[3];
+      bool stamped = saved && Bloom::Stamp(file, stamp);
+
+      if (!db->open(*path, mode)) {
+	result = db->error().code();
+	return 0;
+      }
+
+      wrap->order = wrap->comparator();
+      if (wrap->bloom) {
+	wrap->bloom->open(db, saved ? file : std::string(), stamped ? stamp : NULL,
+			  mode & PolyDB::OTRUNCATE);
+      }
+      return 0;
+    }
+
+    // Memory databases have special paths; see `PolyDB::open()`.
+    static bool IsMemoryPath(const std::string& file) {
+      return file.size() == 1 && strchr("-+:*%", file[0]);
+    }
+
+    inline int after() {
+      Local<Value> argv[1] = { error() };
+      callback(1, argv);
+      return 0;
+    }
+  };
+
+  
+  // ### Close ###
+
+  DEFINE_METHOD(Close, CloseRequest)
+  class CloseRequest: public Request {
+  public:
+
+    inline static bool validate(const Arguments& args) {
+      return (args.Length() >= 1 && args[0]->IsFunction());
+    }
+
+    CloseRequest(const Arguments& args):
+      Request(args, 0)
+    {
+      touches_all();
+    }
+
+    inline int exec() {
+      PolyDB* db = wrap->db;
+      if (wrap->tier) result = wrap->tier->close(db);
+      int64_t count = db->count();
+      if (!db->close()) result = db->error().code();
+      else if (wrap->bloom) wrap->bloom->save(count);
+      return 0;
+    }
+
+    inline int after() {
+      Local<Value> argv[1] = { error() };
+      callback(1, argv);
+      return 0;
+    }
+  };
+
+  static Handle<Value> CloseSync(const Arguments& args) {
+    HandleScope scope;
+
+    PolyDBWrap* wrap = ObjectWrap::Unwrap<PolyDBWrap>(args.This());
+    PolyDB* db = wrap->db;
+
+    if (wrap->cache) wrap->cache->clear();
+    if (wrap->tier) wrap->tier->close(db);
+    int64_t count = db->count();
+    if (!db->close()) return False();
+    if (wrap->bloom) wrap->bloom->save(count);
+    return True();
+  }
+
+  
+  // ### Key Order ###
+
+  // compare(a, b) orders two keys the way the database does: with its
+  // comparator if it's ordered, or byte by byte if it isn't. Returns
+  // a negative number, zero, or a positive number.
+  static Handle<Value> Compare(const Arguments& args) {
+    HandleScope scope;
+
+    if (!(args.Length() >= 2 && IS_BYTES(args[0]) && IS_BYTES(args[1]))) {
+      return THROW_BAD_ARGS;
+    }
+
+    PolyDBWrap* wrap = ObjectWrap::Unwrap<PolyDBWrap>(args.This());
+    Comparator* comp = wrap->order ? wrap->order : LEXICALCOMP;
+    Bytes a(args[0]), b(args[1]);
+
+    return scope.Close(Integer::New(comp->compare(*a, a.length(), *b, b.length())));
+  }
+
+  
+  // ### Binary Mode ###
+
+  // In binary mode, values (and keys from matches, cursors) are
+  // returned as Buffers instead of Strings. Requests capture the mode
+  // when they're made.
+  static Handle<Value> SetBinary(const Arguments& args) {
+    HandleScope scope;
+
+    if (!(args.Length() >= 1 && args[0]->IsBoolean())) {
+      return THROW_BAD_ARGS;
+    }
+
+    PolyDBWrap* wrap = ObjectWrap::Unwrap<PolyDBWrap>(args.This());
+    wrap->binary = V8_TO_BOOL(args[0]);
+
+    return args.This();
+  }
+
+  
+  // ### Synchronous Access ###
+
+  // These run inline on the main thread instead of in the thread
+  // pool. They're meant for memory databases, where the round trip
+  // costs far more than the operation. Errors are thrown.
+
+  // getSync(key) returns the value or `undefined` if there isn't one.
+  static Handle<Value> GetSync(const Arguments& args) {
+    HandleScope scope;
+
+    if (!(args.Length() >= 1 && IS_BYTES(args[0]))) {
+      return THROW_BAD_ARGS;
+    }
+
+    PolyDBWrap* wrap = ObjectWrap::Unwrap<PolyDBWrap>(args.This());
+    PolyDB* db = wrap->db;
+    Bytes key(args[0]);
+
+    size_t vsiz;
+    char* vbuf = db->get(*key, key.length(), &vsiz);
+    if (!vbuf) {
+      PolyDB::Error::Code code = db->error().code();
+      if (code == PolyDB::Error::NOREC) return Undefined();
+      return ThrowException(KyotoError(code));
+    }
+
+    if (wrap->binary) {
+      return scope.Close(AdoptKyotoValue(vbuf, vsiz));
+    }
+
+    Local<String> result = String::New(vbuf, vsiz);
+    delete[] vbuf;
+    return scope.Close(result);
+  }
+
+  // setSync(key, value) returns `true`.
+  static Handle<Value> SetSync(const Arguments& args) {
+    HandleScope scope;
+
+    if (!(args.Length() >= 2 && IS_BYTES(args[0]) && IS_BYTES(args[1]))) {
+      return THROW_BAD_ARGS;
+    }
+
+    PolyDBWrap* wrap = ObjectWrap::Unwrap<PolyDBWrap>(args.This());
+    PolyDB* db = wrap->db;
+    Bytes key(args[0]);
+    Bytes value(args[1]);
+
+    if (wrap->cache) wrap->cache->invalidate(*key, key.length());
+    if (wrap->bloom) wrap->bloom->add(*key, key.length());
+    if (!db->set(*key, key.length(), *value, value.length())) {
+      return ThrowException(KyotoError(db->error().code()));
+    }
+
+    return True();
+  }
+
+  // removeSync(key) returns `false` if there was no record to remove.
+  static Handle<Value> RemoveSync(const Arguments& args) {
+    HandleScope scope;
+
+    if (!(args.Length() >= 1 && IS_BYTES(args[0]))) {
+      return THROW_BAD_ARGS;
+    }
+
+    PolyDBWrap* wrap = ObjectWrap::Unwrap<PolyDBWrap>(args.This());
+    PolyDB* db = wrap->db;
+    Bytes key(args[0]);
+
+    if (wrap->cache) wrap->cache->invalidate(*key, key.length());
+    if (!db->remove(*key, key.length())) {
+      PolyDB::Error::Code code = db->error().code();
+      if (code == PolyDB::Error::NOREC) return False();
+      return ThrowException(KyotoError(code));
+    }
+
+    return True();
+  }
+
+  // getBulkSync(keys, atomic) returns an object of the items found.
+  static Handle<Value> GetBulkSync(const Arguments& args) {
+    HandleScope scope;
+
+    if (!(args.Length() >= 2 && args[0]->IsArray() && args[1]->IsBoolean())) {
+      return THROW_BAD_ARGS;
+    }
+
+    PolyDBWrap* wrap = ObjectWrap::Unwrap<PolyDBWrap>(args.This());
+    PolyDB* db = wrap->db;
+
+    StringList keys;
+    StringMap items;
+    ArrayToList(args[0], keys);
+
+    if (db->get_bulk(keys, &items, V8_TO_BOOL(args[1])) == -1) {
+      return ThrowException(KyotoError(db->error().code()));
+    }
+
+    return scope.Close(MapToObj(items, wrap->binary));
+  }
+
+  
+  // ### Read Cache ###
+
+  // setCache(bytes) turns the read cache on with room for about
+  // `bytes` bytes, or off if `bytes` is 0. The cache starts empty.
+  static Handle<Value> SetCache(const Arguments& args) {
+    HandleScope scope;
+
+    if (!(args.Length() >= 1 && args[0]->IsNumber())) {
+      return THROW_BAD_ARGS;
+    }
+
+    PolyDBWrap* wrap = ObjectWrap::Unwrap<PolyDBWrap>(args.This());
+    int64_t bytes = args[0]->IntegerValue();
+
+    if (wrap->cache) delete wrap->cache;
+    wrap->cache = (bytes > 0) ? new ReadCache(bytes) : NULL;
+
+    return args.This();
+  }
+
+  // getCached(key) returns a value from the read cache, or `undefined`
+  // on a miss.
+  static Handle<Value> GetCached(const Arguments& args) {
+    HandleScope scope;
+
+    if (!(args.Length() >= 1 && IS_BYTES(args[0]))) {
+      return THROW_BAD_ARGS;
+    }
+
+    PolyDBWrap* wrap = ObjectWrap::Unwrap<PolyDBWrap>(args.This());
+    if (!wrap->cache) return Undefined();
+
+    Bytes key(args[0]);
+    const std::string* value = wrap->cache->lookup(*key, key.length());
+    if (!value) return Undefined();
+
+    return scope.Close(BytesToValue(value->data(), value->size(), wrap->binary));
+  }
+
+  // cacheStats() returns the read cache's counters, or null if it's
+  // off.
+  static Handle<Value> CacheStats(const Arguments& args) {
+    HandleScope scope;
+
+    PolyDBWrap* wrap = ObjectWrap::Unwrap<PolyDBWrap>(args.This());
+    if (!wrap->cache) {
+      return scope.Close(LNULL);
+    }
+
+    ReadCache::Stats stats;
+    size_t bytes, count, capacity;
+    wrap->cache->status(&stats, &bytes, &count, &capacity);
+
+    uint64_t lookups = stats.hits + stats.misses;
+    Local<Object> result = Object::New();
+    result->Set(String::NewSymbol("hits"), Number::New(stats.hits));
+    result->Set(String::NewSymbol("misses"), Number::New(stats.misses));
+    result->Set(String::NewSymbol("hitRate"),
+		Number::New(lookups ? (double)stats.hits / lookups : 0));
+    result->Set(String::NewSymbol("inserts"), Number::New(stats.inserts));
+    result->Set(String::NewSymbol("evictions"), Number::New(stats.evictions));
+    result->Set(String::NewSymbol("invalidations"), Number::New(stats.invalidations));
+    result->Set(String::NewSymbol("entries"), Number::New(count));
+    result->Set(String::NewSymbol("bytes"), Number::New(bytes));
+    result->Set(String::NewSymbol("capacity"), Number::New(capacity));
+    return scope.Close(result);
+  }
+
+  
+  // ### Bloom Filter ###
+
+  // setBloom(bits, hashes) keeps a Bloom filter of the database's
+  // keys. Call it before `open()`. See Bloom.
+  static Handle<Value> SetBloom(const Arguments& args) {
+    HandleScope scope;
+
+    if (!(args.Length() >= 2 && args[0]->IsNumber() && args[0]->IntegerValue() > 0
+	  && args[1]->IsUint32())) {
+      return THROW_BAD_ARGS;
+    }
+
+    PolyDBWrap* wrap = ObjectWrap::Unwrap<PolyDBWrap>(args.This());
+    if (wrap->bloom) delete wrap->bloom;
+    wrap->bloom = new Bloom(args[0]->IntegerValue(), args[1]->Uint32Value());
+
+    return args.This();
+  }
+
+  // mayContain(key) is false if the key is definitely not in the
+  // database. It's always true without a filter.
+  static Handle<Value> MayContain(const Arguments& args) {
+    HandleScope scope;
+
+    if (!(args.Length() >= 1 && IS_BYTES(args[0]))) {
+      return THROW_BAD_ARGS;
+    }
+
+    PolyDBWrap* wrap = ObjectWrap::Unwrap<PolyDBWrap>(args.This());
+    if (!wrap->bloom) {
+      return scope.Close(True());
+    }
+
+    Bytes key(args[0]);
+    return scope.Close(BOOL_TO_LOCAL_V8(wrap->bloom->check(*key, key.length())));
+  }
+
+  // filterKeys(keys) returns the keys that may be in the database.
+  static Handle<Value> FilterKeys(const Arguments& args) {
+    HandleScope scope;
+
+    if (!(args.Length() >= 1 && args[0]->IsArray())) {
+      return THROW_BAD_ARGS;
+    }
+
+    PolyDBWrap* wrap = ObjectWrap::Unwrap<PolyDBWrap>(args.This());
+    Local<Array> keys = Local<Array>::Cast(args[0]);
+    if (!wrap->bloom) {
+      return scope.Close(keys);
+    }
+
+    uint32_t len = keys->Length(), found = 0;
+    Local<Array> result = Array::New();
+    for (uint32_t i = 0; i < len; i++) {
+      Local<Value> item = keys->Get(i);
+      Bytes key(item);
+      if (wrap->bloom->check(*key, key.length())) result->Set(found++, item);
+    }
+
+    return scope.Close(result);
+  }
+
+  // bloomStats() returns the filter's size and counters, or null if
+  // there isn't one. The estimated false positive rate comes from how
+  // full the filter is; the observed one from lookups of missing keys.
+  static Handle<Value> BloomStats(const Arguments& args) {
+    HandleScope scope;
+
+    PolyDBWrap* wrap = ObjectWrap::Unwrap<PolyDBWrap>(args.This());
+    if (!wrap->bloom) {
+      return scope.Close(LNULL);
+    }
+
+    Bloom::Stats stats;
+    uint64_t bits, set;
+    uint32_t hashes;
+    int64_t keys;
+    wrap->bloom->status(&stats, &bits, &hashes, &keys, &set);
+
+    double fill = (double)set / bits;
+    uint64_t missing = stats.negatives + stats.false_positives;
+    Local<Object> result = Object::New();
+    result->Set(String::NewSymbol("bits"), Number::New(bits));
+    result->Set(String::NewSymbol("hashes"), Integer::New(hashes));
+    result->Set(String::NewSymbol("keys"), Number::New(keys));
+    result->Set(String::NewSymbol("fill"), Number::New(fill));
+    result->Set(String::NewSymbol("fpRate"), Number::New(pow(fill, hashes)));
+    result->Set(String::NewSymbol("checks"), Number::New(stats.checks));
+    result->Set(String::NewSymbol("negatives"), Number::New(stats.negatives));
+    result->Set(String::NewSymbol("falsePositives"), Number::New(stats.false_positives));
+    result->Set(String::NewSymbol("observedFpRate"),
+		Number::New(missing ? (double)stats.false_positives / missing : 0));
+    return scope.Close(result);
+  }
+
+  
+  // ### Hot Tier ###
+
+  // openTier(writeBack, maxCount, maxBytes) puts a hot tier in front
+  // of the database; a limit of 0 means none. Call it before any
+  // requests are made. See Tier.
+  static Handle<Value> OpenTier(const Arguments& args) {
+    HandleScope scope;
+
+    if (!(args.Length() >= 3 && args[0]->IsBoolean()
+	  && args[1]->IsNumber() && args[2]->IsNumber())) {
+      return THROW_BAD_ARGS;
+    }
+
+    PolyDBWrap* wrap = ObjectWrap::Unwrap<PolyDBWrap>(args.This());
+    if (wrap->tier) {
+      return ThrowException(Exception::Error(String::New("The hot tier is already open.")));
+    }
+
+    Tier* tier = new Tier(V8_TO_BOOL(args[0]), args[1]->IntegerValue(), args[2]->IntegerValue());
+    PolyDB::Error::Code code = tier->open();
+    if (code != PolyDB::Error::SUCCESS) {
+      delete tier;
+      return ThrowException(KyotoError(code));
+    }
+
+    wrap->tier = tier;
+    return args.This();
+  }
+
+  // tierStats() returns the hot tier's counters, or null if there
+  // isn't one.
+  static Handle<Value> TierStats(const Arguments& args) {
+    HandleScope scope;
+
+    PolyDBWrap* wrap = ObjectWrap::Unwrap<PolyDBWrap>(args.This());
+    if (!wrap->tier) {
+      return scope.Close(LNULL);
+    }
+
+    Tier::Stats stats;
+    int64_t count, bytes;
+    size_t dirty;
+    wrap->tier->status(&stats, &count, &bytes, &dirty);
+
+    uint64_t lookups = stats.hits + stats.misses;
+    Local<Object> result = Object::New();
+    result->Set(String::NewSymbol("writeBack"), BOOL_TO_LOCAL_V8(wrap->tier->is_write_back()));
+    result->Set(String::NewSymbol("hits"), Number::New(stats.hits));
+    result->Set(String::NewSymbol("misses"), Number::New(stats.misses));
+    result->Set(String::NewSymbol("hitRate"),
+		Number::New(lookups ? (double)stats.hits / lookups : 0));
+    result->Set(String::NewSymbol("promotions"), Number::New(stats.promotions));
+    result->Set(String::NewSymbol("demotions"), Number::New(stats.demotions));
+    result->Set(String::NewSymbol("flushes"), Number::New(stats.flushes));
+    result->Set(String::NewSymbol("count"), Number::New(count));
+    result->Set(String::NewSymbol("bytes"), Number::New(bytes));
+    result->Set(String::NewSymbol("dirty"), Number::New(dirty));
+    return scope.Close(result);
+  }
+
+  // flushTier(next) writes a write-back tier's dirty records to the
+  // file.
+
+  DEFINE_METHOD(FlushTier, FlushTierRequest)
+  class FlushTierRequest: public Request {
+  public:
+    inline static bool validate(const Arguments& args) {
+      return (args.Length() >= 1 && args[0]->IsFunction());
+    }
+
+    FlushTierRequest(const Arguments& args):
+      Request(args, 0)
+    {}
+
+    int default_priority() {
+      return PLOW;
+    }
+
+    // Flushes itself, rather than in `starting()`, to report errors.
+    bool tiered() {
+      return true;
+    }
+
+    inline int exec() {
+      result = wrap->tier ? wrap->tier->flush(wrap->db) : PolyDB::Error::NOIMPL;
+      return 0;
+    }
+
+    inline int after() {
+      Local<Value> argv[1] = { error() };
+      callback(1, argv);
+      return 0;
+    }
+  };
+
+  
+  // ### Clear ###
+
+  DEFINE_METHOD(Clear, ClearRequest)
+  class ClearRequest: public CloseRequest {
+  public:
+
+    // The Bloom filter keeps its bits: queued writes may still add
+    // keys to it, so clearing it here could lose theirs.
+    ClearRequest(const Arguments& args):
+      CloseRequest(args)
+    {}
+
+    int default_priority() {
+      return PLOW;
+    }
+
+    inline int exec() {
+      PolyDB* db = wrap->db;
+      if (!db->clear()) result = db->error().code();
+      return 0;
+    }
+  };
+
+  
+  // ### Set ###
+
+  DEFINE_METHOD(Set, SetRequest)
+  class SetRequest: public Request {
+  protected:
+    Bytes key;
+    Bytes value;
+
+  public:
+    inline static bool validate(const Arguments& args) {
+      return (args.Length() >= 3
+	      && IS_BYTES(args[0])
+	      && IS_BYTES(args[1])
+	      && args[2]->IsFunction());
+    }
+
+    SetRequest(const Arguments& args):
+      Request(args, 2),
+      key(args[0]),
+      value(args[1])
+    {
+      touches(*key, key.length());
+      adds(*key, key.length());
+    }
+
+    int default_priority() {
+      return PHIGH;
+    }
+
+    bool tiered() {
+      return true;
+    }
+
+    inline int exec() {
+      PolyDB* db = wrap->db;
+      if (tier_write(Tier::WSET)) return 0;
+      if (!db->set(*key, key.length(), *value, value.length())) {
+	result = db->error().code();
+      }
+      return 0;
+    }
+
+    // Write through the hot tier, if there is one.
+    inline bool tier_write(Tier::Write op) {
+      if (!wrap->tier) return false;
+      result = wrap->tier->write(wrap->db, op, *key, key.length(), *value, value.length());
+      return true;
+    }
+
+    inline int after() {
+      Local<Value> argv[1] = { error() };
+      callback(1, argv);
+      return 0;
+    }
+  };
+
+  
+  // ### Add ###
+
+  DEFINE_METHOD(Add, AddRequest)
+  class AddRequest: public SetRequest {
+  public:
+    AddRequest(const Arguments& args) :
+      SetRequest(args)
+    {}
+
+    inline int exec() {
+      PolyDB* db = wrap->db;
+      if (tier_write(Tier::WADD)) return 0;
+      if (!db->add(*key, key.length(), *value, value.length())) {
+	result = db->error().code();
+      }
+      return 0;
+    }
+  };
+
+  
+  // ### Replace ###
+
+  DEFINE_METHOD(Replace, ReplaceRequest)
+  class ReplaceRequest: public SetRequest {
+  public:
+    ReplaceRequest(const Arguments& args) :
+      SetRequest(args)
+    {}
+
+    inline int exec() {
+      PolyDB* db = wrap->db;
+      if (tier_write(Tier::WREPLACE)) return 0;
+      if (!db->replace(*key, key.length(), *value, value.length())) {
+	result = db->error().code();
+      }
+      return 0;
+    }
+  };
+
+  
+  // ### Append ###
+
+  DEFINE_METHOD(Append, AppendRequest)
+  class AppendRequest: public SetRequest {
+  public:
+    AppendRequest(const Arguments& args) :
+      SetRequest(args)
+    {}
+
+    inline int exec() {
+      PolyDB* db = wrap->db;
+      if (tier_write(Tier::WAPPEND)) return 0;
+      if (!db->append(*key, key.length(), *value, value.length())) {
+	result = db->error().code();
+      }
+      return 0;
+    }
+  };
+
+  
+  // ### Increment ###
+
+  DEFINE_METHOD(Increment, IncrementRequest)
+  class IncrementRequest: public Request {
+  protected:
+    Bytes key;
+    int64_t num;
+    int64_t orig;
+
+  public:
+    inline static bool validate(const Arguments& args) {
+      return (args.Length() >= 4
+	      && IS_BYTES(args[0])
+	      && args[1]->IsNumber()
+	      && args[2]->IsNumber()
+	      && args[3]->IsFunction());
+    }
+
+    IncrementRequest(const Arguments& args):
+      Request(args, 3),
+      key(args[0]),
+      num(args[1]->IntegerValue()),
+      orig(args[2]->IntegerValue())
+    {
+      touches(*key, key.length());
+      adds(*key, key.length());
+    }
+
+    int default_priority() {
+      return PHIGH;
+    }
+
+    inline int exec() {
+      PolyDB* db = wrap->db;
+
+      num = db->increment(*key, key.length(), num, orig);
+      if (num == INT64MIN) {
+	result = db->error().code();
+      }
+
+      return 0;
+    }
+
+    inline int after() {
+      int argc = 0;
+      Local<Value> argv[2];
+
+      argv[argc++] = error();
+      if (num != INT64MIN) {
+	argv[argc++] = Integer::New(num);
+      }
+
+      callback(argc, argv);
+      return 0;
+    }
+  };
+
+  
+  // ### IncrementDouble ###
+
+  DEFINE_METHOD(IncrementDouble, IncrementDoubleRequest)
+  class IncrementDoubleRequest: public Request {
+  protected:
+    Bytes key;
+    double num;
+    double orig;
+
+  public:
+    inline static bool validate(const Arguments& args) {
+      return (args.Length() >= 4
+	      && IS_BYTES(args[0])
+	      && args[1]->IsNumber()
+	      && args[2]->IsNumber()
+	      && args[3]->IsFunction());
+    }
+
+    IncrementDoubleRequest(const Arguments& args):
+      Request(args, 3),
+      key(args[0]),
+      num(args[1]->NumberValue()),
+      orig(args[2]->NumberValue())
+    {
+      touches(*key, key.length());
+      adds(*key, key.length());
+    }
+
+    int default_priority() {
+      return PHIGH;
+    }
+
+    inline int exec() {
+      PolyDB* db = wrap->db;
+
+      num = db->increment_double(*key, key.length(), num, orig);
+      if (std::isnan(num)) {
+	result = db->error().code();
+      }
+
+      return 0;
+    }
+
+    inline int after() {
+      int argc = 0;
+      Local<Value> argv[2];
+
+      argv[argc++] = error();
+      if (!std::isnan(num)) {
+	argv[argc++] = Number::New(num);
+      }
+
+      callback(argc, argv);
+      return 0;
+    }
+  };
+
+  
+  // ### CAS ###
+
+  DEFINE_METHOD(CAS, CASRequest)
+  class CASRequest: public Request {
+  protected:
+    Bytes key;
+    Bytes *ovalue;
+    Bytes *nvalue;
+    bool success;
+
+  public:
+    inline static bool validate(const Arguments& args) {
+      return (args.Length() >= 4
+	      && IS_BYTES(args[0])
+	      && (IS_BYTES(args[1]) || args[1]->IsNull())
+	      && (IS_BYTES(args[2]) || args[2]->IsNull())
+	      && args[3]->IsFunction());
+    }
+
+    CASRequest(const Arguments& args):
+      Request(args, 3),
+      key(args[0]),
+      ovalue(NULL),
+      nvalue(NULL)
+    {
+      touches(*key, key.length());
+
+      if (!args[1]->IsNull()) {
+	ovalue = new Bytes(args[1]);
+      }
+
+      if (!args[2]->IsNull()) {
+	nvalue = new Bytes(args[2]);
+	adds(*key, key.length());
+      }
+    }
+
+    int default_priority() {
+      return PHIGH;
+    }
+
+    ~CASRequest() {
+      if (ovalue) delete ovalue;
+      if (nvalue) delete nvalue;
+    }
+
+    inline int exec() {
+      PolyDB* db = wrap->db;
+
+      success = db->cas(*key, key.length(),
+			(ovalue == NULL ? NULL : **ovalue),
+			(ovalue == NULL ? 0 : ovalue->length()),
+			(nvalue == NULL ? NULL : **nvalue),
+			(nvalue == NULL ? 0 : nvalue->length()));
+
+      if (!success) {
+	result = db->error().code();
+      }
+
+      return 0;
+    }
+
+    inline int after() {
+      Local<Value> argv[2] = {
+	(result == PolyDB::Error::LOGIC) ? LNULL : error(),
+	BOOL_TO_LOCAL_V8(success)
+      };
+      callback(2, argv);
+      return 0;
+    }
+  };
+
+  
+  // ### Get ###
+
+  // A value read while the read cache is on is kept in it.
+
+  DEFINE_METHOD(Get, GetRequest)
+  class GetRequest: public Request {
+  protected:
+    Bytes key;
+    char *vbuf;
+    size_t vsiz;
+    uint64_t epoch;
+
+  public:
+    inline static bool validate(const Arguments& args) {
+      return (args.Length() >= 2
+	      && IS_BYTES(args[0])
+	      && args[1]->IsFunction());
+    }
+
+    GetRequest(const Arguments& args):
+      Request(args, 1),
+      key(args[0]),
+      vbuf(NULL),
+      epoch(wrap->cache ? wrap->cache->epoch() : 0)
+    {}
+
+    int default_priority() {
+      return PHIGH;
+    }
+
+    ~GetRequest() {
+      if (vbuf) delete[] vbuf;
+    }
+
+    bool tiered() {
+      return true;
+    }
+
+    inline int exec() {
+      PolyDB* db = wrap->db;
+      if (wrap->tier) {
+	result = wrap->tier->get(db, *key, key.length(), &vbuf, &vsiz);
+	return 0;
+      }
+
+      vbuf = db->get(*key, key.length(), &vsiz);
+      if (!vbuf) result = db->error().code();
+      return 0;
+    }
+
+    inline int after() {
+      int argc = 1;
+      Local<Value> argv[2];
+
+      argv[0] = error();
+      if (vbuf && wrap->cache) {
+	wrap->cache->insert(*key, key.length(), vbuf, vsiz, epoch);
+      }
+      if (result == PolyDB::Error::NOREC && wrap->bloom) {
+	wrap->bloom->false_positive();
+      }
+
+      if (vbuf && binary) {
+	// The Buffer owns Kyoto's allocation from here on.
+	argv[argc++] = AdoptKyotoValue(vbuf, vsiz);
+	vbuf = NULL;
+      }
+      else if (vbuf) {
+	argv[argc++] = String::New(vbuf, vsiz);
+      }
+
+      callback(argc, argv);
+      return 0;
+    }
+  };
+
+  
+  // ### GetBulk ###
+
+  // The keys may be a packed list. Then the items found come back as
+  // a packed list of alternating keys and values instead of an
+  // object.
+
+  DEFINE_METHOD(GetBulk, GetBulkRequest)
+  class GetBulkRequest: public Request {
+  protected:
+    Bytes* packed;
+    StringList keys;
+    StringMap items;
+    bool atomic;
+
+  public:
+    inline static bool validate(const Arguments& args) {
+      return (args.Length() >= 3
+	      && (args[0]->IsArray() || Buffer::HasInstance(args[0]))
+	      && args[1]->IsBoolean()
+	      && args[2]->IsFunction());
+    }
+
+    GetBulkRequest(const Arguments& args):
+      Request(args, 2),
+      packed(NULL),
+      atomic(V8_TO_BOOL(args[1]))
+    {
+      if (args[0]->IsArray())
+	ArrayToList(args[0], keys);
+      else
+	packed = new Bytes(args[0]);
+    }
+
+    ~GetBulkRequest() {
+      if (packed) delete packed;
+    }
+
+    inline int exec() {
+      PolyDB* db = wrap->db;
+
+      if (packed && !UnpackList(**packed, packed->length(), keys)) {
+	result = PolyDB::Error::INVALID;
+	return 0;
+      }
+
+      if (db->get_bulk(keys, &items, atomic) == -1) {
+	result = db->error().code();
+      }
+      return 0;
+    }
+
+    inline int after() {
+      Local<Value> argv[2] = {
+	error(),
+	packed ? PackMap(items) : MapToObj(items, binary)
+      };
+      callback(2, argv);
+      return 0;
+    }
+  };
+
+  
+  // ### SetBulk ###
+
+  // Kyoto needs a sorted map for an atomic update. Otherwise the items
+  // are set one by one, as `set_bulk()` would, so they're kept in a
+  // vector instead. The items may be a packed list of alternating keys
+  // and values, which is read on the worker thread.
+
+  DEFINE_METHOD(SetBulk, SetBulkRequest)
+  class SetBulkRequest: public Request {
+  protected:
+    Bytes* packed;
+    StringMap items;
+    StringPairs pairs;
+    bool atomic;
+    int64_t stored;
+
+  public:
+    inline static bool validate(const Arguments& args) {
+      return (args.Length() >= 3
+	      && args[0]->IsObject()
+	      && args[1]->IsBoolean()
+	      && args[2]->IsFunction());
+    }
+
+    SetBulkRequest(const Arguments& args):
+      Request(args, 2),
+      packed(NULL),
+      atomic(V8_TO_BOOL(args[1])),
+      stored(0)
+    {
+      touches_all();
+
+      if (Buffer::HasInstance(args[0]))
+	packed = new Bytes(args[0]);
+      else if (atomic)
+	ObjToMap(args[0], items);
+      else
+	ObjToPairs(args[0], pairs);
+    }
+
+    ~SetBulkRequest() {
+      if (packed) delete packed;
+    }
+
+    inline int exec() {
+      PolyDB* db = wrap->db;
+
+      if (packed && !unpack()) {
+	result = PolyDB::Error::INVALID;
+	return 0;
+      }
+
+      if (atomic) {
+	for (MapIterator item = items.begin(); item != items.end(); ++item) {
+	  adds(item->first);
+	}
+	stored = db->set_bulk(items, true);
+	if (stored == -1) result = db->error().code();
+	return 0;
+      }
+
+      for (size_t i = 0; i < pairs.size(); i++) {
+	const MapItem& item = pairs[i];
+	adds(item.first);
+	if (!db->set(item.first.data(), item.first.size(),
+		     item.second.data(), item.second.size())) {
+	  result = db->error().code();
+	  stored = -1;
+	  break;
+	}
+	stored++;
+      }
+
+      return 0;
+    }
+
+    // Move a packed list into `items` or `pairs`.
+    bool unpack() {
+      StringList keys, values;
+      if (!UnpackPairs(**packed, packed->length(), keys, values)) return false;
+
+      if (atomic) {
+	for (size_t i = 0; i < keys.size(); i++) {
+	  items[keys[i]].swap(values[i]);
+	}
+      }
+      else {
+	pairs.resize(keys.size());
+	for (size_t i = 0; i < keys.size(); i++) {
+	  pairs[i].first.swap(keys[i]);
+	  pairs[i].second.swap(values[i]);
+	}
+      }
+
+      return true;
+    }
+
+    inline int after() {
+      Local<Value> argv[2] = { error(), Integer::New(stored) };
+      callback(2, argv);
+      return 0;
+    }
+  };
+
   
-  // ### Clear ###
+  // ### RemoveBulk ###
+
+  DEFINE_METHOD(RemoveBulk, RemoveBulkRequest)
+  class RemoveBulkRequest: public Request {
+  protected:
+    StringList keys;
+    bool atomic;
+    int64_t removed;
 
-  DEFINE_METHOD(Clear, ClearRequest)
-  class ClearRequest: public CloseRequest {
   public:
+    inline static bool validate(const Arguments& args) {
+      return (args.Length() >= 3
+	      && args[0]->IsArray()
+	      && args[1]->IsBoolean()
+	      && args[2]->IsFunction());
+    }
 
-    ClearRequest(const Arguments& args):
-      CloseRequest(args)
-    {}
+    RemoveBulkRequest(const Arguments& args):
+      Request(args, 2),
+      atomic(V8_TO_BOOL(args[1]))
+    {
+      touches_all();
+      ArrayToList(args[0], keys);
+    }
 
     inline int exec() {
       PolyDB* db = wrap->db;
-      if (!db->clear()) result = db->error().code();
+      removed = db->remove_bulk(keys, atomic);
+      if (removed == -1) {
+	result = db->error().code();
+      }
+      return 0;
+    }
+
+    inline int after() {
+      Local<Value> argv[2] = { error(), Integer::New(removed) };
+      callback(2, argv);
       return 0;
     }
   };
 
   
-  // ### Set ###
+  // ### GetColumns ###
 
-  DEFINE_METHOD(Set, SetRequest)
-  class SetRequest: public Request {
+  // Like getBulk, but the keys are an Array or a packed list, and the
+  // values come back as an Array in the same order. A missing item is
+  // a hole in the Array. Keys stay in vectors; an atomic read still
+  // goes through Kyoto's `get_bulk()` map.
+
+  DEFINE_METHOD(GetColumns, GetColumnsRequest)
+  class GetColumnsRequest: public Request {
   protected:
-    String::Utf8Value key;
-    String::Utf8Value value;
+    Bytes* packed;
+    StringList keys;
+    StringList values;
+    std::vector<bool> found;
+    bool atomic;
 
   public:
     inline static bool validate(const Arguments& args) {
       return (args.Length() >= 3
-	      && args[0]->IsString()
-	      && args[1]->IsString()
+	      && (args[0]->IsArray() || Buffer::HasInstance(args[0]))
+	      && args[1]->IsBoolean()
 	      && args[2]->IsFunction());
     }
 
-    SetRequest(const Arguments& args):
+    GetColumnsRequest(const Arguments& args):
       Request(args, 2),
-      key(args[0]->ToString()),
-      value(args[1]->ToString())
-    {}
+      packed(NULL),
+      atomic(V8_TO_BOOL(args[1]))
+    {
+      if (args[0]->IsArray())
+	ArrayToList(args[0], keys);
+      else
+	packed = new Bytes(args[0]);
+    }
+
+    ~GetColumnsRequest() {
+      if (packed) delete packed;
+    }
 
     inline int exec() {
       PolyDB* db = wrap->db;
-      if (!db->set(*key, key.length(), *value, value.length())) {
+
+      if (packed && !UnpackList(**packed, packed->length(), keys)) {
+	result = PolyDB::Error::INVALID;
+	return 0;
+      }
+
+      values.resize(keys.size());
+      found.resize(keys.size(), false);
+
+      if (atomic) {
+	StringMap items;
+	if (db->get_bulk(keys, &items, true) == -1) {
+	  result = db->error().code();
+	  return 0;
+	}
+	for (size_t i = 0; i < keys.size(); i++) {
+	  MapIterator item = items.find(keys[i]);
+	  if (item != items.end()) {
+	    values[i] = item->second;
+	    found[i] = true;
+	  }
+	}
+	return 0;
+      }
+
+      for (size_t i = 0; i < keys.size(); i++) {
+	if (db->get(keys[i], &values[i])) {
+	  found[i] = true;
+	}
+	else if (db->error().code() != PolyDB::Error::NOREC) {
+	  result = db->error().code();
+	  break;
+	}
+      }
+
+      return 0;
+    }
+
+    inline int after() {
+      Local<Array> array = Array::New(values.size());
+      for (size_t i = 0; i < values.size(); i++) {
+	if (found[i]) {
+	  array->Set(i, BytesToValue(values[i].data(), values[i].size(), binary));
+	}
+      }
+
+      Local<Value> argv[2] = { error(), array };
+      callback(2, argv);
+      return 0;
+    }
+  };
+
+  
+  // ### SetColumns ###
+
+  // Set items from parallel Arrays of keys and values, or from a
+  // packed list of alternating keys and values (with `values` null).
+  // A packed list is only read on the worker thread. See SetBulk for
+  // how an atomic update is done.
+
+  DEFINE_METHOD(SetColumns, SetColumnsRequest)
+  class SetColumnsRequest: public Request {
+  protected:
+    Bytes* packed;
+    StringList keys;
+    StringList values;
+    bool atomic;
+    int64_t stored;
+
+  public:
+    inline static bool validate(const Arguments& args) {
+      if (!(args.Length() >= 4 && args[2]->IsBoolean() && args[3]->IsFunction()))
+	return false;
+
+      if (Buffer::HasInstance(args[0]))
+	return args[1]->IsNull();
+
+      return (args[0]->IsArray() && args[1]->IsArray()
+	      && (Local<Array>::Cast(args[0])->Length()
+		  == Local<Array>::Cast(args[1])->Length()));
+    }
+
+    SetColumnsRequest(const Arguments& args):
+      Request(args, 3),
+      packed(NULL),
+      atomic(V8_TO_BOOL(args[2])),
+      stored(0)
+    {
+      touches_all();
+
+      if (args[0]->IsArray()) {
+	ArrayToList(args[0], keys);
+	ArrayToList(args[1], values);
+      }
+      else {
+	packed = new Bytes(args[0]);
+      }
+    }
+
+    ~SetColumnsRequest() {
+      if (packed) delete packed;
+    }
+
+    inline int exec() {
+      PolyDB* db = wrap->db;
+
+      if (packed && !UnpackPairs(**packed, packed->length(), keys, values)) {
+	result = PolyDB::Error::INVALID;
+	return 0;
+      }
+
+      for (size_t i = 0; i < keys.size(); i++) {
+	adds(keys[i]);
+      }
+
+      if (atomic) {
+	StringMap items;
+	for (size_t i = 0; i < keys.size(); i++) {
+	  items[keys[i]] = values[i];
+	}
+	stored = db->set_bulk(items, true);
+	if (stored == -1) result = db->error().code();
+	return 0;
+      }
+
+      for (size_t i = 0; i < keys.size(); i++) {
+	if (!db->set(keys[i], values[i])) {
+	  result = db->error().code();
+	  stored = -1;
+	  break;
+	}
+	stored++;
+      }
+
+      return 0;
+    }
+
+    inline int after() {
+      Local<Value> argv[2] = { error(), Number::New(stored) };
+      callback(2, argv);
+      return 0;
+    }
+  };
+
+  
+  // ### WriteBatch ###
+
+  // Run a list of mutations one after another in a single job. The
+  // `ops` array is flat: each mutation is an operation (`BSET`,
+  // `BADD`, `BREPLACE`, `BAPPEND`, `BREMOVE`, `BINCREMENT` or `BCAS`),
+  // a key, and an argument. The argument is a value, ignored by
+  // `BREMOVE`; `[num, orig]` for `BINCREMENT`; or `[ovalue, nvalue]`
+  // for `BCAS`, where either may be null as in `cas()`.
+  //
+  // In a transaction, the first mutation that fails (including a
+  // `BCAS` whose comparison fails) aborts the transaction, and the
+  // ones after it aren't tried. The callback gets
+  // an array with an error or `null` for each mutation tried, and an
+  // array of results: the new number for `BINCREMENT`, whether the
+  // swap happened for `BCAS`, and `true` for the others if they
+  // succeeded.
+
+  DEFINE_METHOD(WriteBatch, WriteBatchRequest)
+  class WriteBatchRequest: public Request {
+  protected:
+    struct Item {
+      uint32_t op;
+      std::string key;
+      std::string value;
+      std::string nvalue;
+      bool hasValue;
+      bool hasNValue;
+      int64_t num;
+      int64_t orig;
+    };
+
+    std::vector<Item> items;
+    std::vector<PolyDB::Error::Code> codes;
+    bool transaction;
+
+  public:
+    inline static bool validate(const Arguments& args) {
+      return (args.Length() >= 3
+	      && args[0]->IsArray()
+	      && args[1]->IsBoolean()
+	      && args[2]->IsFunction());
+    }
+
+    WriteBatchRequest(const Arguments& args):
+      Request(args, 2),
+      transaction(V8_TO_BOOL(args[1]))
+    {
+      touches_all();
+
+      Local<Array> ops = Local<Array>::Cast(args[0]);
+      uint32_t len = ops->Length() / 3;
+
+      items.resize(len);
+      for (uint32_t i = 0; i < len; i++) {
+	Item& item = items[i];
+	Local<Value> arg = ops->Get(i * 3 + 2);
+
+	item.op = ops->Get(i * 3)->Uint32Value();
+	item.key = BytesToString(ops->Get(i * 3 + 1));
+	item.hasValue = item.hasNValue = true;
+
+	switch (item.op) {
+	case BREMOVE:
+	  break;
+	case BINCREMENT:
+	  item.num = Local<Array>::Cast(arg)->Get(0)->IntegerValue();
+	  item.orig = Local<Array>::Cast(arg)->Get(1)->IntegerValue();
+	  break;
+	case BCAS:
+	  item.hasValue = pairItem(arg, 0, item.value);
+	  item.hasNValue = pairItem(arg, 1, item.nvalue);
+	  break;
+	default:
+	  item.value = BytesToString(arg);
+	}
+
+	if (item.op != BREMOVE) adds(item.key);
+      }
+    }
+
+    int default_priority() {
+      return PHIGH;
+    }
+
+    inline int exec() {
+      PolyDB* db = wrap->db;
+
+      if (transaction && !db->begin_transaction()) {
+	result = db->error().code();
+	return 0;
+      }
+
+      codes.reserve(items.size());
+      for (size_t i = 0; i < items.size(); i++) {
+	PolyDB::Error::Code code = apply(db, items[i]);
+	codes.push_back(code);
+
+	if (transaction && code != PolyDB::Error::SUCCESS) {
+	  result = code;
+	  db->end_transaction(false);
+	  return 0;
+	}
+      }
+
+      if (transaction && !db->end_transaction(true)) {
 	result = db->error().code();
       }
-      return 0;
-    }
 
-    inline int after() {
-      Local<Value> argv[1] = { error() };
-      callback(1, argv);
-      return 0;
+      return 0;
+    }
+
+    // Apply one mutation. Its result replaces its arguments.
+    PolyDB::Error::Code apply(PolyDB* db, Item& item) {
+      bool ok;
+
+      switch (item.op) {
+      case BSET:
+	ok = db->set(item.key, item.value);
+	break;
+      case BADD:
+	ok = db->add(item.key, item.value);
+	break;
+      case BREPLACE:
+	ok = db->replace(item.key, item.value);
+	break;
+      case BAPPEND:
+	ok = db->append(item.key, item.value);
+	break;
+      case BREMOVE:
+	ok = db->remove(item.key);
+	break;
+      case BINCREMENT:
+	item.num = db->increment(item.key, item.num, item.orig);
+	ok = (item.num != INT64MIN);
+	break;
+      case BCAS:
+	ok = db->cas(item.key.data(), item.key.size(),
+		     item.hasValue ? item.value.data() : NULL, item.value.size(),
+		     item.hasNValue ? item.nvalue.data() : NULL, item.nvalue.size());
+	break;
+      default:
+	return PolyDB::Error::INVALID;
+      }
+
+      return ok ? PolyDB::Error::SUCCESS : db->error().code();
+    }
+
+    inline int after() {
+      Local<Array> errors = Array::New(codes.size());
+      Local<Array> results = Array::New(codes.size());
+
+      for (uint32_t i = 0; i < codes.size(); i++) {
+	PolyDB::Error::Code code = codes[i];
+	const Item& item = items[i];
+
+	if (item.op == BCAS) {
+	  // A failed comparison is a result, not an error.
+	  errors->Set(i, (code == PolyDB::Error::LOGIC) ? LNULL : KyotoError(code));
+	  results->Set(i, BOOL_TO_LOCAL_V8(code == PolyDB::Error::SUCCESS));
+	}
+	else {
+	  errors->Set(i, KyotoError(code));
+	  if (code != PolyDB::Error::SUCCESS)
+	    results->Set(i, v8::False());
+	  else if (item.op == BINCREMENT)
+	    results->Set(i, Number::New(item.num));
+	  else
+	    results->Set(i, v8::True());
+	}
+      }
+
+      Local<Value> argv[3] = { error(), errors, results };
+      callback(3, argv);
+      return 0;
+    }
+
+  private:
+    // Copy the `index` item of a `[ovalue, nvalue]` pair, if it isn't
+    // null.
+    static bool pairItem(Local<Value> pair, uint32_t index, std::string& result) {
+      Local<Value> value = Local<Array>::Cast(pair)->Get(index);
+      if (value->IsNull() || value->IsUndefined()) return false;
+      result = BytesToString(value);
+      return true;
+    }
+  };
+
+  
+  // ### Update ###
+
+  // Read-modify-write operations that run inside a visitor, so each
+  // one reads and writes its record under Kyoto's record lock in a
+  // single job, with no retries. The argument depends on the
+  // operation:
+  //
+  //   + `UMAX`, `UMIN` - a decimal number; the record, also a decimal
+  //     number, is replaced if the argument is larger (smaller). The
+  //     result is the record.
+  //   + `UPUSH` - `[item, limit]`; the record is a packed list (see
+  //     convert.h) and `item` goes on its end. If `limit` is positive,
+  //     items are dropped from the front to keep at most that many.
+  //     The result is the record.
+  //   + `UPOP` - ignored; the last item of a packed list is taken off
+  //     and is the result. The record is removed once it's empty.
+  //   + `USETADD`, `USETREMOVE` - an item to add to (remove from) a
+  //     packed list of distinct items. The result is whether it was
+  //     added (removed).
+  //   + `UCOUNT` - `[index, delta]`; the record is an array of 8-byte
+  //     big-endian counters, as `increment()` uses, and grows to hold
+  //     `index` (up to `MAX_COUNTERS`). The result is the new count.
+  //   + `UMERGE` - an Object of fields to set, with null for the ones
+  //     to delete; the record is a packed list of alternating fields
+  //     and values, and is removed once it has none. The result is the
+  //     record, if there is one.
+  //   + `UMERGEJSON` - a JSON merge patch (RFC 7386) for a record that
+  //     holds JSON; see JsonValue. The record is removed once it's an
+  //     empty object. The result is the record, if there is one. A
+  //     patch that isn't a JSON object, or nests too deep, is a bad
+  //     argument.
+  //
+  // A record in the wrong format fails with `INVALID`.
+
+  static const int64_t MAX_COUNTERS = 1 << 20;
+
+  // A JSON value, for `UMERGEJSON`. Objects are parsed into their
+  // members; anything else is checked against the JSON grammar and
+  // kept as the text it was written with, so numbers and strings go
+  // through untouched. Member names are compared unescaped. Nesting
+  // is limited to `MAX_DEPTH` so a deep value can't overflow a
+  // worker's stack; deeper values don't parse.
+  struct JsonValue {
+    static const int MAX_DEPTH = 64;
+
+    bool object;
+    std::string text;
+    std::vector<std::string> names;     // as written, quotes included
+    std::vector<std::string> keys;      // unescaped, for comparison
+    std::vector<JsonValue*> values;
+
+    JsonValue(): object(false) {}
+
+    ~JsonValue() {
+      for (size_t i = 0; i < values.size(); i++) delete values[i];
+    }
+
+    bool null() const {
+      return !object && text == "null";
+    }
+
+    int find(const std::string& key) const {
+      for (size_t i = 0; i < keys.size(); i++) {
+	if (keys[i] == key) return (int)i;
+      }
+      return -1;
+    }
+
+    void erase(int at) {
+      delete values[at];
+      names.erase(names.begin() + at);
+      keys.erase(keys.begin() + at);
+      values.erase(values.begin() + at);
+    }
+
+    // Parse a whole JSON text. Returns NULL if it's malformed or too
+    // deep.
+    static JsonValue* Read(const char* buf, size_t siz) {
+      const char* p = buf;
+      const char* end = buf + siz;
+      JsonValue* value = Parse(&p, end, 0);
+      Space(&p, end);
+      if (value && p != end) {
+	delete value;
+	return NULL;
+      }
+      return value;
+    }
+
+    void write(std::string& out) const {
+      if (!object) {
+	out.append(text);
+	return;
+      }
+
+      out.push_back('{');
+      for (size_t i = 0; i < names.size(); i++) {
+	if (i > 0) out.push_back(',');
+	out.append(names[i]);
+	out.push_back(':');
+	values[i]->write(out);
+      }
+      out.push_back('}');
+    }
+
+    // Apply `patch` to `target`, which may be NULL, as RFC 7386 does.
+    // Both are used up; returns the result. This recurses only as deep
+    // as `patch`, which parsed within `MAX_DEPTH`.
+    static JsonValue* Merge(JsonValue* target, JsonValue* patch) {
+      if (!patch->object) {
+	delete target;
+	return patch;
+      }
+
+      if (!target || !target->object) {
+	delete target;
+	target = new JsonValue();
+	target->object = true;
+      }
+
+      for (size_t i = 0; i < patch->keys.size(); i++) {
+	JsonValue* value = patch->values[i];
+	int at = target->find(patch->keys[i]);
+	patch->values[i] = NULL;
+
+	if (value->null()) {
+	  delete value;
+	  if (at >= 0) target->erase(at);
+	}
+	else if (at >= 0) {
+	  target->values[at] = Merge(target->values[at], value);
+	}
+	else {
+	  target->names.push_back(patch->names[i]);
+	  target->keys.push_back(patch->keys[i]);
+	  target->values.push_back(Merge(NULL, value));
+	}
+      }
+
+      delete patch;
+      return target;
+    }
+
+  private:
+    static void Space(const char** p, const char* end) {
+      while (*p < end && (**p == ' ' || **p == '\t' || **p == '\n' || **p == '\r')) (*p)++;
+    }
+
+    static bool Digit(const char* p, const char* end) {
+      return p < end && *p >= '0' && *p <= '9';
+    }
+
+    static int Hex(char c) {
+      if (c >= '0' && c <= '9') return c - '0';
+      if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+      if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+      return -1;
+    }
+
+    static bool Hex4(const char** p, const char* end, uint32_t* code) {
+      if (end - *p < 4) return false;
+      *code = 0;
+      for (int i = 0; i < 4; i++, (*p)++) {
+	int digit = Hex(**p);
+	if (digit < 0) return false;
+	*code = (*code << 4) | digit;
+      }
+      return true;
+    }
+
+    static void AppendUtf8(std::string* out, uint32_t code) {
+      if (code < 0x80) {
+	out->push_back((char)code);
+      }
+      else if (code < 0x800) {
+	out->push_back((char)(0xc0 | (code >> 6)));
+	out->push_back((char)(0x80 | (code & 0x3f)));
+      }
+      else if (code < 0x10000) {
+	out->push_back((char)(0xe0 | (code >> 12)));
+	out->push_back((char)(0x80 | ((code >> 6) & 0x3f)));
+	out->push_back((char)(0x80 | (code & 0x3f)));
+      }
+      else {
+	out->push_back((char)(0xf0 | (code >> 18)));
+	out->push_back((char)(0x80 | ((code >> 12) & 0x3f)));
+	out->push_back((char)(0x80 | ((code >> 6) & 0x3f)));
+	out->push_back((char)(0x80 | (code & 0x3f)));
+      }
+    }
+
+    // Read a string, unescaping it into `*out` if that isn't NULL.
+    static bool Quoted(const char** p, const char* end, std::string* out) {
+      if (*p >= end || **p != '"') return false;
+      (*p)++;
+
+      while (*p < end) {
+	unsigned char c = **p;
+	(*p)++;
+
+	if (c == '"') return true;
+	if (c < 0x20) return false;
+	if (c != '\\') {
+	  if (out) out->push_back(c);
+	  continue;
+	}
+
+	if (*p >= end) return false;
+	char escape = **p;
+	(*p)++;
+
+	uint32_t code;
+	switch (escape) {
+	case '"': code = '"'; break;
+	case '\\': code = '\\'; break;
+	case '/': code = '/'; break;
+	case 'b': code = '\b'; break;
+	case 'f': code = '\f'; break;
+	case 'n': code = '\n'; break;
+	case 'r': code = '\r'; break;
+	case 't': code = '\t'; break;
+	case 'u': {
+	  if (!Hex4(p, end, &code)) return false;
+
+	  // A surrogate pair is one character.
+	  uint32_t low;
+	  const char* next = *p;
+	  if (code >= 0xd800 && code < 0xdc00 && end - next >= 6
+	      && next[0] == '\\' && next[1] == 'u') {
+	    next += 2;
+	    if (Hex4(&next, end, &low) && low >= 0xdc00 && low < 0xe000) {
+	      code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+	      *p = next;
+	    }
+	  }
+	  break;
+	}
+	default:
+	  return false;
+	}
+
+	if (out) AppendUtf8(out, code);
+      }
+
+      return false;
     }
-  };
 
-  
-  // ### Add ###
+    static bool Literal(const char** p, const char* end, const char* word) {
+      size_t len = strlen(word);
+      if ((size_t)(end - *p) < len || memcmp(*p, word, len) != 0) return false;
+      *p += len;
+      return true;
+    }
 
-  DEFINE_METHOD(Add, AddRequest)
-  class AddRequest: public SetRequest {
-  public:
-    AddRequest(const Arguments& args) :
-      SetRequest(args)
-    {}
+    // -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+    static bool Number(const char** p, const char* end) {
+      if (*p < end && **p == '-') (*p)++;
 
-    inline int exec() {
-      PolyDB* db = wrap->db;
-      if (!db->add(*key, key.length(), *value, value.length())) {
-	result = db->error().code();
+      if (!Digit(*p, end)) return false;
+      if (**p == '0') {
+	(*p)++;
+      }
+      else {
+	while (Digit(*p, end)) (*p)++;
       }
-      return 0;
-    }
-  };
-
-  
-  // ### Replace ###
 
-  DEFINE_METHOD(Replace, ReplaceRequest)
-  class ReplaceRequest: public SetRequest {
-  public:
-    ReplaceRequest(const Arguments& args) :
-      SetRequest(args)
-    {}
+      if (*p < end && **p == '.') {
+	(*p)++;
+	if (!Digit(*p, end)) return false;
+	while (Digit(*p, end)) (*p)++;
+      }
 
-    inline int exec() {
-      PolyDB* db = wrap->db;
-      if (!db->replace(*key, key.length(), *value, value.length())) {
-	result = db->error().code();
+      if (*p < end && (**p == 'e' || **p == 'E')) {
+	(*p)++;
+	if (*p < end && (**p == '+' || **p == '-')) (*p)++;
+	if (!Digit(*p, end)) return false;
+	while (Digit(*p, end)) (*p)++;
       }
-      return 0;
+
+      return true;
     }
-  };
 
-  
-  // ### Append ###
+    // Check a value that's kept as text, and step over it. Objects
+    // inside arrays are checked here too.
+    static bool Skip(const char** p, const char* end, int depth) {
+      if (*p >= end) return false;
+
+      switch (**p) {
+      case '"':
+	return Quoted(p, end, NULL);
+      case 't':
+	return Literal(p, end, "true");
+      case 'f':
+	return Literal(p, end, "false");
+      case 'n':
+	return Literal(p, end, "null");
+      case '[':
+      case '{':
+	break;
+      default:
+	return Number(p, end);
+      }
 
-  DEFINE_METHOD(Append, AppendRequest)
-  class AppendRequest: public SetRequest {
-  public:
-    AppendRequest(const Arguments& args) :
-      SetRequest(args)
-    {}
+      if (depth >= MAX_DEPTH) return false;
 
-    inline int exec() {
-      PolyDB* db = wrap->db;
-      if (!db->append(*key, key.length(), *value, value.length())) {
-	result = db->error().code();
+      char close = (**p == '[') ? ']' : '}';
+      (*p)++;
+      Space(p, end);
+      if (*p < end && **p == close) {
+	(*p)++;
+	return true;
       }
-      return 0;
-    }
-  };
 
-  
-  // ### Increment ###
+      while (true) {
+	if (close == '}') {
+	  if (!Quoted(p, end, NULL)) return false;
+	  Space(p, end);
+	  if (*p >= end || **p != ':') return false;
+	  (*p)++;
+	  Space(p, end);
+	}
 
-  DEFINE_METHOD(Increment, IncrementRequest)
-  class IncrementRequest: public Request {
-  protected:
-    String::Utf8Value key;
-    int64_t num;
-    int64_t orig;
+	if (!Skip(p, end, depth + 1)) return false;
+	Space(p, end);
 
-  public:
-    inline static bool validate(const Arguments& args) {
-      return (args.Length() >= 3
-	      && args[0]->IsString()
-	      && args[1]->IsNumber()
-	      && args[2]->IsNumber()
-	      && args[3]->IsFunction());
+	if (*p < end && **p == ',') {
+	  (*p)++;
+	  Space(p, end);
+	}
+	else if (*p < end && **p == close) {
+	  (*p)++;
+	  return true;
+	}
+	else {
+	  return false;
+	}
+      }
     }
 
-    IncrementRequest(const Arguments& args):
-      Request(args, 3),
-      key(args[0]->ToString()),
-      num(args[1]->IntegerValue()),
-      orig(args[2]->IntegerValue())
-    {}
-
-    inline int exec() {
-      PolyDB* db = wrap->db;
+    static JsonValue* Parse(const char** p, const char* end, int depth) {
+      Space(p, end);
+      const char* start = *p;
 
-      num = db->increment(*key, key.length(), num, orig);
-      if (num == INT64MIN) {
-	result = db->error().code();
+      if (*p >= end || **p != '{') {
+	if (!Skip(p, end, depth)) return NULL;
+	JsonValue* value = new JsonValue();
+	value->text.assign(start, *p - start);
+	return value;
       }
 
-      return 0;
-    }
+      if (depth >= MAX_DEPTH) return NULL;
 
-    inline int after() {
-      int argc = 0;
-      Local<Value> argv[2];
+      JsonValue* value = new JsonValue();
+      value->object = true;
+      (*p)++;
+      Space(p, end);
+      if (*p < end && **p == '}') {
+	(*p)++;
+	return value;
+      }
 
-      argv[argc++] = error();
-      if (num != INT64MIN) {
-	argv[argc++] = Integer::New(num);
+      while (true) {
+	Space(p, end);
+	const char* name = *p;
+	std::string key;
+	if (!Quoted(p, end, &key)) break;
+	std::string quoted(name, *p - name);
+
+	Space(p, end);
+	if (*p >= end || **p != ':') break;
+	(*p)++;
+
+	JsonValue* member = Parse(p, end, depth + 1);
+	if (!member) break;
+	value->names.push_back(quoted);
+	value->keys.push_back(key);
+	value->values.push_back(member);
+
+	Space(p, end);
+	if (*p < end && **p == ',') {
+	  (*p)++;
+	}
+	else if (*p < end && **p == '}') {
+	  (*p)++;
+	  return value;
+	}
+	else {
+	  break;
+	}
       }
 
-      callback(argc, argv);
-      return 0;
+      delete value;
+      return NULL;
     }
   };
 
-  
-  // ### IncrementDouble ###
-
-  DEFINE_METHOD(IncrementDouble, IncrementDoubleRequest)
-  class IncrementDoubleRequest: public Request {
-  protected:
-    String::Utf8Value key;
-    double num;
-    double orig;
+  struct UpdateItem {
+    uint32_t op;
+    std::string key;
+    std::string arg;
+    int64_t index;              // the counter, or the limit for `UPUSH`
+    int64_t delta;
+    StringMap fields;
+    StringList removed;
+
+    std::string result;
+    bool has_result;
+    int64_t count;
+  };
 
-  public:
-    inline static bool validate(const Arguments& args) {
-      return (args.Length() >= 3
-	      && args[0]->IsString()
-	      && args[1]->IsNumber()
-	      && args[2]->IsNumber()
-	      && args[3]->IsFunction());
+  // Check an update's argument before it's copied. See `ReadUpdate()`.
+  static bool ValidUpdate(uint32_t op, Local<Value> arg) {
+    switch (op) {
+    case UMAX:
+    case UMIN:
+    case USETADD:
+    case USETREMOVE:
+      return IS_BYTES(arg);
+    case UMERGEJSON:
+      if (!IS_BYTES(arg)) return false;
+      else {
+	std::string text = BytesToString(arg);
+	JsonValue* patch = JsonValue::Read(text.data(), text.size());
+	bool valid = patch && patch->object;
+	delete patch;
+	return valid;
+      }
+    case UPOP:
+      return true;
+    case UPUSH:
+    case UCOUNT:
+      if (!arg->IsArray()) return false;
+      else {
+	Local<Array> pair = Local<Array>::Cast(arg);
+	return ((op == UPUSH ? IS_BYTES(pair->Get(0)) : pair->Get(0)->IsNumber())
+		&& pair->Get(1)->IsNumber());
+      }
+    case UMERGE:
+      return arg->IsObject() && !arg->IsArray();
+    default:
+      return false;
     }
+  }
 
-    IncrementDoubleRequest(const Arguments& args):
-      Request(args, 3),
-      key(args[0]->ToString()),
-      num(args[1]->NumberValue()),
-      orig(args[2]->NumberValue())
-    {}
+  static void ReadUpdate(uint32_t op, Local<Value> key, Local<Value> arg, UpdateItem& u) {
+    u.op = op;
+    u.key = BytesToString(key);
+    u.has_result = false;
+    u.count = 0;
+
+    switch (op) {
+    case UPOP:
+      break;
+    case UPUSH:
+      u.arg = BytesToString(Local<Array>::Cast(arg)->Get(0));
+      u.index = Local<Array>::Cast(arg)->Get(1)->IntegerValue();
+      break;
+    case UCOUNT:
+      u.index = Local<Array>::Cast(arg)->Get(0)->IntegerValue();
+      u.delta = Local<Array>::Cast(arg)->Get(1)->IntegerValue();
+      break;
+    case UMERGE: {
+      Local<Object> obj = arg->ToObject();
+      Local<Array> names = obj->GetPropertyNames();
+      for (uint32_t i = 0; i < names->Length(); i++) {
+	Local<Value> name = names->Get(i);
+	Local<Value> value = obj->Get(name);
+	if (value->IsNull() || value->IsUndefined())
+	  u.removed.push_back(BytesToString(name));
+	else
+	  u.fields[BytesToString(name)] = BytesToString(value);
+      }
+      break;
+    }
+    default:
+      u.arg = BytesToString(arg);
+    }
+  }
 
-    inline int exec() {
-      PolyDB* db = wrap->db;
+  // Only `UPOP` and `USETREMOVE` can't create a record.
+  static bool UpdateCreates(uint32_t op) {
+    return op != UPOP && op != USETREMOVE;
+  }
 
-      num = db->increment_double(*key, key.length(), num, orig);
-      if (std::isnan(num)) {
-	result = db->error().code();
-      }
+  static Local<Value> UpdateResult(const UpdateItem& u, bool binary) {
+    HandleScope scope;
 
-      return 0;
+    switch (u.op) {
+    case UCOUNT:
+      return scope.Close(Number::New(u.count));
+    case USETADD:
+    case USETREMOVE:
+      return scope.Close(BOOL_TO_LOCAL_V8(u.count != 0));
+    default:
+      if (!u.has_result) return scope.Close(Local<Value>::New(Undefined()));
+      return scope.Close(BytesToValue(u.result.data(), u.result.size(), binary));
     }
+  }
 
-    inline int after() {
-      int argc = 0;
-      Local<Value> argv[2];
+  class UpdateVisitor: public DB::Visitor {
+  public:
+    UpdateItem& u;
+    PolyDB::Error::Code code;
 
-      argv[argc++] = error();
-      if (!std::isnan(num)) {
-	argv[argc++] = Number::New(num);
-      }
+    explicit UpdateVisitor(UpdateItem& u):
+      u(u),
+      code(PolyDB::Error::SUCCESS)
+    {}
 
-      callback(argc, argv);
-      return 0;
+    // Run the update on `key`.
+    static PolyDB::Error::Code Run(PolyDB* db, UpdateItem& u) {
+      UpdateVisitor visitor(u);
+      if (!db->accept(u.key.data(), u.key.size(), &visitor, true))
+	return db->error().code();
+      return visitor.code;
     }
-  };
 
-  
-  // ### CAS ###
+  private:
+    std::string out;
 
-  DEFINE_METHOD(CAS, CASRequest)
-  class CASRequest: public Request {
-  protected:
-    String::Utf8Value key;
-    String::Utf8Value *ovalue;
-    String::Utf8Value *nvalue;
-    bool success;
+    const char* visit_full(const char* kbuf, size_t ksiz,
+			   const char* vbuf, size_t vsiz, size_t* sp) {
+      return apply(vbuf, vsiz, true, sp);
+    }
 
-  public:
-    inline static bool validate(const Arguments& args) {
-      return (args.Length() >= 3
-	      && args[0]->IsString()
-	      && (args[1]->IsString() || args[1]->IsNull())
-	      && (args[2]->IsString() || args[2]->IsNull())
-	      && args[3]->IsFunction());
+    const char* visit_empty(const char* kbuf, size_t ksiz, size_t* sp) {
+      return apply("", 0, false, sp);
     }
 
-    CASRequest(const Arguments& args):
-      Request(args, 3),
-      key(args[0]->ToString()),
-      ovalue(NULL),
-      nvalue(NULL)
-    {
-      if (args[1]->IsString()) {
-	ovalue = new String::Utf8Value(args[1]->ToString());
-      }
+    const char* invalid() {
+      code = PolyDB::Error::INVALID;
+      return NOP;
+    }
 
-      if (args[2]->IsString()) {
-	nvalue = new String::Utf8Value(args[2]->ToString());
-      }
+    // Write `out` as the new record.
+    const char* write(size_t* sp) {
+      *sp = out.size();
+      return out.data();
     }
 
-    ~CASRequest() {
-      if (ovalue) delete ovalue;
-      if (nvalue) delete nvalue;
+    const char* apply(const char* vbuf, size_t vsiz, bool exists, size_t* sp) {
+      switch (u.op) {
+      case UMAX:
+      case UMIN:
+	return extreme(vbuf, vsiz, exists, sp);
+      case UPUSH:
+	return push(vbuf, vsiz, sp);
+      case UPOP:
+	return pop(vbuf, vsiz, sp);
+      case USETADD:
+      case USETREMOVE:
+	return member(vbuf, vsiz, sp);
+      case UCOUNT:
+	return counter(vbuf, vsiz, sp);
+      case UMERGE:
+	return merge(vbuf, vsiz, sp);
+      case UMERGEJSON:
+	return merge_json(vbuf, vsiz, exists, sp);
+      default:
+	return invalid();
+      }
     }
 
-    inline int exec() {
-      PolyDB* db = wrap->db;
+    static bool number(const char* buf, size_t siz, double* result) {
+      std::string text(buf, siz);
+      char* end;
+      *result = strtod(text.c_str(), &end);
+      return siz > 0 && end == text.c_str() + siz;
+    }
 
-      success = db->cas(*key, key.length(),
-			(ovalue == NULL ? NULL : **ovalue),
-			(ovalue == NULL ? 0 : ovalue->length()),
-			(nvalue == NULL ? NULL : **nvalue),
-			(nvalue == NULL ? 0 : nvalue->length()));
+    const char* extreme(const char* vbuf, size_t vsiz, bool exists, size_t* sp) {
+      double arg, current;
+      if (!number(u.arg.data(), u.arg.size(), &arg)) return invalid();
 
-      if (!success) {
-	result = db->error().code();
+      u.has_result = true;
+      if (exists) {
+	if (!number(vbuf, vsiz, &current)) return invalid();
+	if (u.op == UMAX ? !(arg > current) : !(arg < current)) {
+	  u.result.assign(vbuf, vsiz);
+	  return NOP;
+	}
       }
 
-      return 0;
+      u.result = out = u.arg;
+      return write(sp);
     }
 
-    inline int after() {
-      Local<Value> argv[2] = {
-	(result == PolyDB::Error::LOGIC) ? LNULL : error(),
-	BOOL_TO_LOCAL_V8(success)
-      };
-      callback(2, argv);
-      return 0;
+    // Count the items of a packed list, and find where each starts.
+    static bool items(const char* vbuf, size_t vsiz, std::vector<size_t>* starts) {
+      size_t pos = 0;
+      const char* item;
+      uint32_t len;
+
+      while (pos < vsiz) {
+	starts->push_back(pos);
+	if (!PackedSpan(vbuf, vsiz, &pos, &item, &len) || len == PACKED_MISSING)
+	  return false;
+      }
+      return true;
     }
-  };
 
-  
-  // ### Get ###
+    const char* push(const char* vbuf, size_t vsiz, size_t* sp) {
+      std::vector<size_t> starts;
+      if (!items(vbuf, vsiz, &starts)) return invalid();
 
-  DEFINE_METHOD(Get, GetRequest)
-  class GetRequest: public Request {
-  protected:
-    String::Utf8Value key;
-    char *vbuf;
-    size_t vsiz;
+      // Drop enough items from the front to leave room for this one.
+      size_t from = 0, count = starts.size() + 1;
+      if (u.index > 0 && count > (size_t)u.index) {
+	size_t drop = count - u.index;
+	from = (drop < starts.size()) ? starts[drop] : vsiz;
+      }
 
-  public:
-    inline static bool validate(const Arguments& args) {
-      return (args.Length() >= 2
-	      && args[0]->IsString()
-	      && args[1]->IsFunction());
+      out.assign(vbuf + from, vsiz - from);
+      AppendPackedItem(out, u.arg.data(), u.arg.size());
+
+      u.result = out;
+      u.has_result = true;
+      return write(sp);
     }
 
-    GetRequest(const Arguments& args):
-      Request(args, 1),
-      key(args[0]->ToString())
-    {}
+    const char* pop(const char* vbuf, size_t vsiz, size_t* sp) {
+      std::vector<size_t> starts;
+      if (!items(vbuf, vsiz, &starts)) return invalid();
+      if (starts.empty()) return NOP;
 
-    ~GetRequest() {
-      if (vbuf) delete[] vbuf;
+      size_t last = starts.back();
+      u.result.assign(vbuf + last + 4, vsiz - last - 4);
+      u.has_result = true;
+
+      if (last == 0) return REMOVE;
+      out.assign(vbuf, last);
+      return write(sp);
     }
 
-    inline int exec() {
-      PolyDB* db = wrap->db;
-      vbuf = db->get(*key, key.length(), &vsiz);
-      if (!vbuf) result = db->error().code();
-      return 0;
+    const char* member(const char* vbuf, size_t vsiz, size_t* sp) {
+      size_t pos = 0, start;
+      const char* item;
+      uint32_t len;
+
+      while (pos < vsiz) {
+	start = pos;
+	if (!PackedSpan(vbuf, vsiz, &pos, &item, &len) || len == PACKED_MISSING)
+	  return invalid();
+	if (len != u.arg.size() || memcmp(item, u.arg.data(), len) != 0)
+	  continue;
+
+	// Found it.
+	if (u.op == USETADD) return NOP;
+	u.count = 1;
+	if (vsiz == pos - start) return REMOVE;
+	out.assign(vbuf, start);
+	out.append(vbuf + pos, vsiz - pos);
+	return write(sp);
+      }
+
+      if (u.op == USETREMOVE) return NOP;
+      u.count = 1;
+      out.assign(vbuf, vsiz);
+      AppendPackedItem(out, u.arg.data(), u.arg.size());
+      return write(sp);
     }
 
-    inline int after() {
-      int argc = 1;
-      Local<Value> argv[2];
+    const char* counter(const char* vbuf, size_t vsiz, size_t* sp) {
+      if (vsiz % 8 != 0 || u.index < 0 || u.index >= MAX_COUNTERS) return invalid();
 
-      argv[0] = error();
-      if (vbuf) argv[argc++] = String::New(vbuf, vsiz);
+      out.assign(vbuf, vsiz);
+      size_t at = u.index * 8;
+      if (out.size() < at + 8) out.resize(at + 8, '\0');
 
-      callback(argc, argv);
-      return 0;
+      unsigned char* p = reinterpret_cast<unsigned char*>(&out[at]);
+      uint64_t num = 0;
+      for (int i = 0; i < 8; i++) num = (num << 8) | p[i];
+      num += (uint64_t)u.delta;
+      u.count = (int64_t)num;
+      for (int i = 7; i >= 0; i--, num >>= 8) p[i] = (unsigned char)num;
+      return write(sp);
     }
-  };
 
-  
-  // ### GetBulk ###
+    const char* merge(const char* vbuf, size_t vsiz, size_t* sp) {
+      StringList keys, values;
+      if (!UnpackPairs(vbuf, vsiz, keys, values)) return invalid();
 
-  DEFINE_METHOD(GetBulk, GetBulkRequest)
-  class GetBulkRequest: public Request {
-  protected:
-    StringList keys;
-    StringMap items;
-    bool atomic;
+      StringMap record;
+      for (size_t i = 0; i < keys.size(); i++) {
+	record[keys[i]].swap(values[i]);
+      }
+      for (MapIterator field = u.fields.begin(); field != u.fields.end(); ++field) {
+	record[field->first] = field->second;
+      }
+      for (size_t i = 0; i < u.removed.size(); i++) {
+	record.erase(u.removed[i]);
+      }
 
-  public:
-    inline static bool validate(const Arguments& args) {
-      return (args.Length() >= 3
-	      && args[0]->IsArray()
-	      && args[1]->IsBoolean()
-	      && args[2]->IsFunction());
-    }
+      if (record.empty()) return REMOVE;
 
-    GetBulkRequest(const Arguments& args):
-      Request(args, 2),
-      atomic(V8_TO_BOOL(args[1]))
-    {
-      ArrayToList(args[0], keys);
+      out.clear();
+      for (MapIterator field = record.begin(); field != record.end(); ++field) {
+	AppendPackedItem(out, field->first.data(), field->first.size());
+	AppendPackedItem(out, field->second.data(), field->second.size());
+      }
+
+      u.result = out;
+      u.has_result = true;
+      return write(sp);
     }
 
-    inline int exec() {
-      PolyDB* db = wrap->db;
-      if (db->get_bulk(keys, &items, atomic) == -1) {
-	result = db->error().code();
+    const char* merge_json(const char* vbuf, size_t vsiz, bool exists, size_t* sp) {
+      JsonValue* target = NULL;
+      JsonValue* patch = JsonValue::Read(u.arg.data(), u.arg.size());
+      if (!patch || !patch->object || (exists && !(target = JsonValue::Read(vbuf, vsiz)))) {
+	delete patch;
+	return invalid();
       }
-      return 0;
-    }
 
-    inline int after() {
-      Local<Value> argv[2] = { error(), MapToObj(items) };
-      callback(2, argv);
-      return 0;
+      target = JsonValue::Merge(target, patch);
+      bool empty = target->names.empty();
+      out.clear();
+      target->write(out);
+      delete target;
+
+      if (empty) return REMOVE;
+      u.result = out;
+      u.has_result = true;
+      return write(sp);
     }
   };
 
-  
-  // ### SetBulk ###
+  // update(key, op, arg, next) calls back with an error and the
+  // operation's result.
 
-  DEFINE_METHOD(SetBulk, SetBulkRequest)
-  class SetBulkRequest: public Request {
+  DEFINE_METHOD(Update, UpdateRequest)
+  class UpdateRequest: public Request {
   protected:
-    StringMap items;
-    bool atomic;
-    int64_t stored;
+    UpdateItem update;
 
   public:
     inline static bool validate(const Arguments& args) {
-      return (args.Length() >= 3
-	      && args[0]->IsObject()
-	      && args[1]->IsBoolean()
-	      && args[2]->IsFunction());
+      return (args.Length() >= 4
+	      && IS_BYTES(args[0])
+	      && args[1]->IsUint32()
+	      && ValidUpdate(args[1]->Uint32Value(), args[2])
+	      && args[3]->IsFunction());
     }
 
-    SetBulkRequest(const Arguments& args):
-      Request(args, 2),
-      atomic(V8_TO_BOOL(args[1]))
+    UpdateRequest(const Arguments& args):
+      Request(args, 3)
     {
-      ObjToMap(args[0], items);
+      ReadUpdate(args[1]->Uint32Value(), args[0], args[2], update);
+      touches(update.key.data(), update.key.size());
+      if (UpdateCreates(update.op)) adds(update.key);
     }
 
-    inline int exec() {
-      PolyDB* db = wrap->db;
-
-      stored = db->set_bulk(items, atomic);
-      if (stored == -1) {
-	result = db->error().code();
-      }
+    int default_priority() {
+      return PHIGH;
+    }
 
+    inline int exec() {
+      result = UpdateVisitor::Run(wrap->db, update);
       return 0;
     }
 
     inline int after() {
-      Local<Value> argv[2] = { error(), Integer::New(stored) };
-      callback(2, argv);
+      int argc = 1;
+      Local<Value> argv[2];
+
+      argv[0] = error();
+      if (result == PolyDB::Error::SUCCESS)
+	argv[argc++] = UpdateResult(update, binary);
+
+      callback(argc, argv);
       return 0;
     }
   };
 
-  
-  // ### RemoveBulk ###
+  // updateBulk(ops, next) runs a flat array of updates (an operation,
+  // a key, and an argument for each) one after another in a single
+  // job. Each is atomic by itself. The callback gets an array with an
+  // error or null for each update, and an array of their results.
 
-  DEFINE_METHOD(RemoveBulk, RemoveBulkRequest)
-  class RemoveBulkRequest: public Request {
+  DEFINE_METHOD(UpdateBulk, UpdateBulkRequest)
+  class UpdateBulkRequest: public Request {
   protected:
-    StringList keys;
-    bool atomic;
-    int64_t removed;
+    std::vector<UpdateItem> updates;
+    std::vector<PolyDB::Error::Code> codes;
 
   public:
     inline static bool validate(const Arguments& args) {
-      return (args.Length() >= 3
-	      && args[0]->IsArray()
-	      && args[1]->IsBoolean()
-	      && args[2]->IsFunction());
+      if (!(args.Length() >= 2 && args[0]->IsArray() && args[1]->IsFunction()))
+	return false;
+
+      Local<Array> ops = Local<Array>::Cast(args[0]);
+      if (ops->Length() % 3 != 0) return false;
+
+      for (uint32_t i = 0; i < ops->Length(); i += 3) {
+	Local<Value> op = ops->Get(i);
+	if (!(op->IsUint32() && IS_BYTES(ops->Get(i + 1))
+	      && ValidUpdate(op->Uint32Value(), ops->Get(i + 2))))
+	  return false;
+      }
+      return true;
     }
 
-    RemoveBulkRequest(const Arguments& args):
-      Request(args, 2),
-      atomic(V8_TO_BOOL(args[1]))
+    UpdateBulkRequest(const Arguments& args):
+      Request(args, 1)
     {
-      ArrayToList(args[0], keys);
+      touches_all();
+
+      Local<Array> ops = Local<Array>::Cast(args[0]);
+      updates.resize(ops->Length() / 3);
+      for (uint32_t i = 0; i < updates.size(); i++) {
+	UpdateItem& u = updates[i];
+	ReadUpdate(ops->Get(i * 3)->Uint32Value(), ops->Get(i * 3 + 1), ops->Get(i * 3 + 2), u);
+	if (UpdateCreates(u.op)) adds(u.key);
+      }
     }
 
     inline int exec() {
-      PolyDB* db = wrap->db;
-      removed = db->remove_bulk(keys, atomic);
-      if (removed == -1) {
-	result = db->error().code();
+      codes.reserve(updates.size());
+      for (size_t i = 0; i < updates.size(); i++) {
+	codes.push_back(UpdateVisitor::Run(wrap->db, updates[i]));
       }
       return 0;
     }
 
     inline int after() {
-      Local<Value> argv[2] = { error(), Integer::New(removed) };
-      callback(2, argv);
+      Local<Array> errors = Array::New(codes.size());
+      Local<Array> results = Array::New(codes.size());
+
+      for (uint32_t i = 0; i < codes.size(); i++) {
+	errors->Set(i, KyotoError(codes[i]));
+	if (codes[i] == PolyDB::Error::SUCCESS)
+	  results->Set(i, UpdateResult(updates[i], binary));
+      }
+
+      Local<Value> argv[3] = { error(), errors, results };
+      callback(3, argv);
       return 0;
     }
   };
@@ -871,21 +4392,37 @@ public:
   DEFINE_METHOD(Remove, RemoveRequest)
   class RemoveRequest: public Request {
   protected:
-    String::Utf8Value key;
+    Bytes key;
 
   public:
     inline static bool validate(const Arguments& args) {
-      return (args.Length() >= 1
-	      && args[0]->IsString());
+      return (args.Length() >= 2
+	      && IS_BYTES(args[0])
+	      && args[1]->IsFunction());
     }
 
     RemoveRequest(const Arguments& args):
       Request(args, 1),
-      key(args[0]->ToString())
-    {}
+      key(args[0])
+    {
+      touches(*key, key.length());
+    }
+
+    int default_priority() {
+      return PHIGH;
+    }
+
+    bool tiered() {
+      return true;
+    }
 
     inline int exec() {
       PolyDB* db = wrap->db;
+      if (wrap->tier) {
+	result = wrap->tier->remove(db, *key, key.length());
+	return 0;
+      }
+
       if (!db->remove(*key, key.length())) {
 	result = db->error().code();
       }
@@ -905,21 +4442,21 @@ public:
   DEFINE_METHOD(MatchPrefix, MatchPrefixRequest)
   class MatchPrefixRequest: public Request {
   protected:
-    String::Utf8Value pattern;
+    Bytes pattern;
     int64_t max;
     StringList keys;
 
   public:
     inline static bool validate(const Arguments& args) {
       return (args.Length() >= 3
-	      && args[0]->IsString()
+	      && IS_BYTES(args[0])
 	      && args[1]->IsNumber()
 	      && args[2]->IsFunction());
     }
 
     MatchPrefixRequest(const Arguments& args):
       Request(args, 2),
-      pattern(args[0]->ToString()),
+      pattern(args[0]),
       max(args[1]->IntegerValue())
     {}
 
@@ -935,7 +4472,7 @@ public:
     }
 
     inline int after() {
-      Local<Value> argv[2] = { error(), ListToArray(keys) };
+      Local<Value> argv[2] = { error(), ListToArray(keys, binary) };
       callback(2, argv);
       return 0;
     }
@@ -977,7 +4514,209 @@ public:
     }
 
     inline int after() {
-      Local<Value> argv[2] = { error(), ListToArray(keys) };
+      Local<Value> argv[2] = { error(), ListToArray(keys, binary) };
+      callback(2, argv);
+      return 0;
+    }
+  };
+
+  
+  // ### ScanParallel ###
+
+  // Visit every record with `threads` threads at once and keep the
+  // ones that pass all of the filters: a key prefix, a key regex, and
+  // a substring of the value (an empty filter is skipped). Matches are
+  // handed to `onBatch` on the main thread, `batch` at a time, while
+  // the scan is running. If `limit` isn't -1, the scan stops after
+  // that many matches. `next` gets the scan's statistics.
+
+  DEFINE_METHOD(ScanParallel, ScanParallelRequest)
+  class ScanParallelRequest:
+    public Request, public DB::Visitor, public BasicDB::ProgressChecker {
+  protected:
+    struct Batch {
+      StringList keys;
+      StringList values;
+    };
+
+    uint32_t threads;
+    std::string prefix;
+    std::string pattern;
+    std::string contains;
+    int64_t limit;
+    uint32_t batch_size;
+    Persistent<Function> on_batch;
+    Regex regex;
+
+    pthread_mutex_t lock;
+    Batch* current;
+    std::vector<Batch*> ready;
+    ev_async notifier;
+    AtomicInt64 scanned;
+    AtomicInt64 scanned_bytes;
+    int64_t matched;
+    bool stopped;
+    uint64_t elapsed;
+
+  public:
+    inline static bool validate(const Arguments& args) {
+      return (args.Length() >= 8
+	      && args[0]->IsUint32() && args[0]->Uint32Value() > 0
+	      && IS_BYTES(args[1])
+	      && args[2]->IsString()
+	      && IS_BYTES(args[3])
+	      && args[4]->IsNumber()
+	      && args[5]->IsUint32() && args[5]->Uint32Value() > 0
+	      && args[6]->IsFunction()
+	      && args[7]->IsFunction());
+    }
+
+    ScanParallelRequest(const Arguments& args):
+      Request(args, 7),
+      threads(args[0]->Uint32Value()),
+      prefix(BytesToString(args[1])),
+      pattern(BytesToString(args[2])),
+      contains(BytesToString(args[3])),
+      limit(args[4]->IntegerValue()),
+      batch_size(args[5]->Uint32Value()),
+      current(new Batch()),
+      matched(0),
+      stopped(false),
+      elapsed(0)
+    {
+      on_batch = Persistent<Function>::New(Handle<Function>::Cast(args[6]));
+      pthread_mutex_init(&lock, NULL);
+
+      // Like the pool's watcher, this one leaves keeping the loop
+      // alive to the request itself.
+      ev_async_init(&notifier, Deliver);
+      notifier.data = this;
+      ev_async_start(EV_DEFAULT_UC_ &notifier);
+      ev_unref(EV_DEFAULT_UC);
+    }
+
+    ~ScanParallelRequest() {
+      ev_ref(EV_DEFAULT_UC);
+      ev_async_stop(EV_DEFAULT_UC_ &notifier);
+      pthread_mutex_destroy(&lock);
+      on_batch.Dispose();
+
+      delete current;
+      for (size_t i = 0; i < ready.size(); i++) delete ready[i];
+    }
+
+    int default_priority() {
+      return PLOW;
+    }
+
+    inline int exec() {
+      PolyDB* db = wrap->db;
+      uint64_t start = NowMicros();
+
+      if (!pattern.empty() && !regex.compile(pattern)) {
+	result = PolyDB::Error::INVALID;
+	return 0;
+      }
+
+      if (!db->scan_parallel(this, threads, this) && !stopped) {
+	result = db->error().code();
+      }
+
+      elapsed = NowMicros() - start;
+      return 0;
+    }
+
+    // Called by all of the scanning threads at once. The filters only
+    // read shared state; matches are collected under the lock.
+    const char* visit_full(const char* kbuf, size_t ksiz,
+			   const char* vbuf, size_t vsiz, size_t* sp) {
+      scanned.add(1);
+      scanned_bytes.add(ksiz + vsiz);
+
+      if (!prefix.empty()
+	  && (ksiz < prefix.size() || memcmp(kbuf, prefix.data(), prefix.size()) != 0))
+	return NOP;
+
+      if (!contains.empty()
+	  && std::search(vbuf, vbuf + vsiz, contains.begin(), contains.end()) == vbuf + vsiz)
+	return NOP;
+
+      if (!pattern.empty() && !regex.match(std::string(kbuf, ksiz)))
+	return NOP;
+
+      pthread_mutex_lock(&lock);
+      if (!stopped) {
+	current->keys.push_back(std::string(kbuf, ksiz));
+	current->values.push_back(std::string(vbuf, vsiz));
+	if (current->keys.size() >= batch_size) {
+	  ready.push_back(current);
+	  current = new Batch();
+	  ev_async_send(EV_DEFAULT_UC_ &notifier);
+	}
+	if (++matched == limit) stopped = true;
+      }
+      pthread_mutex_unlock(&lock);
+
+      return NOP;
+    }
+
+    // Returning false stops the scan once the limit has been reached.
+    bool check(const char* name, const char* message, int64_t curcnt, int64_t allcnt) {
+      pthread_mutex_lock(&lock);
+      bool going = !stopped;
+      pthread_mutex_unlock(&lock);
+      return going;
+    }
+
+    static void Deliver(EV_P_ ev_async* watcher, int revents) {
+      static_cast<ScanParallelRequest*>(watcher->data)->deliver();
+    }
+
+    // Hand finished batches to `onBatch`. Runs on the main thread.
+    void deliver() {
+      std::vector<Batch*> batches;
+
+      pthread_mutex_lock(&lock);
+      batches.swap(ready);
+      pthread_mutex_unlock(&lock);
+
+      for (size_t i = 0; i < batches.size(); i++) {
+	HandleScope scope;
+	Local<Value> argv[2] = {
+	  ListToArray(batches[i]->keys, binary),
+	  ListToArray(batches[i]->values, binary)
+	};
+	delete batches[i];
+
+	TryCatch try_catch;
+	on_batch->Call(Context::GetCurrent()->Global(), 2, argv);
+	if (try_catch.HasCaught()) {
+	  FatalException(try_catch);
+	}
+      }
+    }
+
+    inline int after() {
+      if (!current->keys.empty()) {
+	ready.push_back(current);
+	current = new Batch();
+      }
+      deliver();
+
+      double seconds = elapsed / 1000000.0;
+      int64_t count = scanned.get();
+      int64_t bytes = scanned_bytes.get();
+
+      Local<Object> stats = Object::New();
+      stats->Set(String::NewSymbol("threads"), Integer::NewFromUnsigned(threads));
+      stats->Set(String::NewSymbol("scanned"), Number::New(count));
+      stats->Set(String::NewSymbol("bytes"), Number::New(bytes));
+      stats->Set(String::NewSymbol("matched"), Number::New(matched));
+      stats->Set(String::NewSymbol("elapsed"), Number::New(elapsed / 1000.0));
+      stats->Set(String::NewSymbol("recordsPerSec"), Number::New(seconds > 0 ? count / seconds : 0));
+      stats->Set(String::NewSymbol("bytesPerSec"), Number::New(seconds > 0 ? bytes / seconds : 0));
+
+      Local<Value> argv[2] = { error(), stats };
       callback(2, argv);
       return 0;
     }
@@ -986,10 +4725,33 @@ public:
   
   // ### Synchronize ###
 
-  DEFINE_METHOD(Synchronize, SynchronizeRequest)
+  // Concurrent requests share physical syncs; see SyncGroup. Only a
+  // request that runs a sync is submitted; the others wait in the
+  // group without a thread.
+
+  static Handle<Value> Synchronize(const Arguments& args) {
+    HandleScope scope;
+
+    if (!SynchronizeRequest::validate(args)) {
+      return THROW_BAD_ARGS;
+    }
+
+    static int op = Metrics::Register(SynchronizeRequest::scope(), "Synchronize");
+    SynchronizeRequest* req = new SynchronizeRequest(args);
+
+    req->dispatch(op);
+    ev_ref(EV_DEFAULT_UC);
+    req->join();
+
+    return args.This();
+  }
+
+  DEFINE_EXEC(Synchronize, SynchronizeRequest)
   class SynchronizeRequest: public Request {
   protected:
     bool hard;
+    bool leading;
+    std::vector<Job*> followers;
 
   public:
     inline static bool validate(const Arguments& args) {
@@ -999,24 +4761,87 @@ public:
 
     SynchronizeRequest(const Arguments& args):
       Request(args, 1),
-      hard(args[0]->ToBoolean() == v8::True())
+      hard(args[0]->ToBoolean() == v8::True()),
+      leading(false)
     {}
 
-    inline int exec() {
-      PolyDB* db = wrap->db;
-      if (!db->synchronize(hard)) {
-	result = db->error().code();
+    int default_priority() {
+      return PLOW;
+    }
+
+    void join() {
+      if (wrap->sync_group.join(this, hard)) {
+	lead();
+      }
+    }
+
+    // Run a sync for this request and its followers.
+    void lead() {
+      WorkerPool* pool = wrap->workers;
+
+      leading = true;
+      if (pool) {
+	pool->submit(this, priority());
+      }
+      else {
+	eio_custom(EIO_ExecSynchronize, EioPriority::Queue(priority()),
+		   NULL, this);
       }
+    }
+
+    inline int exec() {
+      result = wrap->db->synchronize(hard)
+	? PolyDB::Error::SUCCESS
+	: wrap->db->error().code();
       return 0;
     }
 
     inline int after() {
       Local<Value> argv[1] = { error() };
       callback(1, argv);
+      if (!leading) return 0;
+
+      for (size_t i = 0; i < followers.size(); i++) {
+	HandleScope scope;
+	SynchronizeRequest* req = static_cast<SynchronizeRequest*>(followers[i]);
+	req->result = result;
+	req->ran_with(*this);
+	ev_unref(EV_DEFAULT_UC);
+	req->complete();
+	delete req;
+      }
+      followers.clear();
+
+      std::vector<Job*> held;
+      bool held_hard;
+      wrap->sync_group.finished(held, &held_hard);
+
+      if (!held.empty()) {
+	SynchronizeRequest* next = static_cast<SynchronizeRequest*>(held[0]);
+	next->hard = held_hard;
+	next->followers.assign(held.begin() + 1, held.end());
+	next->lead();
+      }
+
       return 0;
     }
   };
 
+  // Get the number of synchronize requests and of the physical syncs
+  // that served them.
+  static Handle<Value> SyncStats(const Arguments& args) {
+    HandleScope scope;
+    PolyDBWrap* wrap = ObjectWrap::Unwrap<PolyDBWrap>(args.This());
+    uint64_t requests, syncs;
+
+    wrap->sync_group.stats(&requests, &syncs);
+
+    Local<Object> result = Object::New();
+    result->Set(String::NewSymbol("requests"), Number::New(requests));
+    result->Set(String::NewSymbol("syncs"), Number::New(syncs));
+    return scope.Close(result);
+  }
+
   
   // ### Copy ###
 
@@ -1037,6 +4862,11 @@ public:
       path(args[0]->ToString())
     {}
 
+    // Also for DumpSnapshot and LoadSnapshot.
+    int default_priority() {
+      return PLOW;
+    }
+
     inline int exec() {
       PolyDB* db = wrap->db;
       if (!db->copy(std::string(*path, path.length()))) {
@@ -1062,30 +4892,233 @@ public:
       CopyRequest(args)
     {}
 
-    inline int exec() {
+    inline int exec() {
+      PolyDB* db = wrap->db;
+      if (!db->dump_snapshot(std::string(*path, path.length()))) {
+	result = db->error().code();
+      }
+      return 0;
+    }
+  };
+
+  
+  // ### LoadSnapshot ###
+
+  DEFINE_METHOD(LoadSnapshot, LoadSnapshotRequest)
+  class LoadSnapshotRequest: public CopyRequest {
+  public:
+    LoadSnapshotRequest(const Arguments& args):
+      CopyRequest(args)
+    {
+      touches_all();
+    }
+
+    inline int exec() {
+      PolyDB* db = wrap->db;
+      if (!db->load_snapshot(std::string(*path, path.length()))) {
+	result = db->error().code();
+      }
+      if (wrap->bloom) wrap->bloom->merge(db);
+      return 0;
+    }
+  };
+
+  
+  // ### LoadSorted ###
+
+  // Load a packed list of alternating keys and values (see convert.h)
+  // whose keys are in strictly increasing order. The source is a
+  // Buffer or the path of a file. Records are set one by one, with no
+  // transaction, straight from the source; each key lands just after
+  // the last, so a tree database only ever touches its last leaf.
+  //
+  // Each key is checked against the one before it, and the first key
+  // against `after` (the last key of the previous chunk, or null).
+  // Loading stops with `INVALID` at a key that is out of order or a
+  // truncated list. A Buffer is checked before anything is written;
+  // a file is checked as it's read. The callback gets the number of
+  // records written, the last key written, and the bytes read.
+  //
+  // Only ordered databases can check the order, so the others refuse
+  // with `NOIMPL`.
+
+  DEFINE_METHOD(LoadSorted, LoadSortedRequest)
+  class LoadSortedRequest: public Request {
+  protected:
+    Bytes* packed;
+    Bytes* path;
+    Bytes* prior;
+    Comparator* comp;
+    std::string last;
+    bool started;
+    int64_t loaded;
+    int64_t bytes;
+
+  public:
+    inline static bool validate(const Arguments& args) {
+      return (args.Length() >= 3
+	      && (args[0]->IsString() || Buffer::HasInstance(args[0]))
+	      && args[2]->IsFunction());
+    }
+
+    LoadSortedRequest(const Arguments& args):
+      Request(args, 2),
+      packed(NULL),
+      path(NULL),
+      prior(NULL),
+      comp(NULL),
+      started(false),
+      loaded(0),
+      bytes(0)
+    {
+      touches_all();
+
+      if (args[0]->IsString())
+	path = new Bytes(args[0]);
+      else
+	packed = new Bytes(args[0]);
+
+      if (!(args[1]->IsNull() || args[1]->IsUndefined()))
+	prior = new Bytes(args[1]);
+    }
+
+    ~LoadSortedRequest() {
+      if (packed) delete packed;
+      if (path) delete path;
+      if (prior) delete prior;
+    }
+
+    int default_priority() {
+      return PLOW;
+    }
+
+    inline int exec() {
+      if (!(comp = wrap->comparator())) {
+	result = PolyDB::Error::NOIMPL;
+	return 0;
+      }
+
+      if (prior) {
+	last.assign(**prior, prior->length());
+	started = true;
+      }
+
+      if (packed) {
+	if (check(**packed, packed->length()))
+	  load(**packed, packed->length());
+      }
+      else {
+	loadFile();
+      }
+
+      return 0;
+    }
+
+    // Check that a whole chunk is in order and not truncated. Returns
+    // the end of the last whole record, or 0 if there's a problem.
+    size_t check(const char* buf, size_t siz, bool partial=false) {
+      const char* prev = started ? last.data() : NULL;
+      uint32_t prevlen = last.size();
+      size_t pos = 0, end = 0;
+      const char* kbuf; const char* vbuf;
+      uint32_t ksiz, vsiz;
+
+      while (pos < siz) {
+	if (!PackedSpan(buf, siz, &pos, &kbuf, &ksiz)
+	    || !PackedSpan(buf, siz, &pos, &vbuf, &vsiz)) {
+	  if (partial) return end;
+	  result = PolyDB::Error::INVALID;
+	  return 0;
+	}
+
+	if (ksiz == PACKED_MISSING || vsiz == PACKED_MISSING
+	    || (prev && comp->compare(prev, prevlen, kbuf, ksiz) >= 0)) {
+	  result = PolyDB::Error::INVALID;
+	  return 0;
+	}
+
+	prev = kbuf;
+	prevlen = ksiz;
+	end = pos;
+      }
+
+      return end;
+    }
+
+    // Write the records of a chunk that has been checked.
+    void load(const char* buf, size_t siz) {
       PolyDB* db = wrap->db;
-      if (!db->dump_snapshot(std::string(*path, path.length()))) {
-	result = db->error().code();
+      size_t pos = 0;
+      const char* kbuf; const char* vbuf;
+      uint32_t ksiz, vsiz;
+
+      const char* lbuf = NULL;
+      uint32_t lsiz = 0;
+
+      while (pos < siz) {
+	PackedSpan(buf, siz, &pos, &kbuf, &ksiz);
+	PackedSpan(buf, siz, &pos, &vbuf, &vsiz);
+	if (!db->set(kbuf, ksiz, vbuf, vsiz)) {
+	  result = db->error().code();
+	  break;
+	}
+	adds(kbuf, ksiz);
+	loaded++;
+	lbuf = kbuf;
+	lsiz = ksiz;
       }
-      return 0;
+
+      if (lbuf) {
+	last.assign(lbuf, lsiz);
+	started = true;
+      }
+
+      bytes += siz;
     }
-  };
 
-  
-  // ### LoadSnapshot ###
+    // Read the file in large chunks, loading the whole records in each
+    // and carrying a partial record over to the next.
+    void loadFile() {
+      std::string name(**path, path->length());
+      FILE* file = fopen(name.c_str(), "rb");
+      if (!file) {
+	result = PolyDB::Error::NOREPOS;
+	return;
+      }
 
-  DEFINE_METHOD(LoadSnapshot, LoadSnapshotRequest)
-  class LoadSnapshotRequest: public CopyRequest {
-  public:
-    LoadSnapshotRequest(const Arguments& args):
-      CopyRequest(args)
-    {}
+      std::vector<char> buf(1 << 22);
+      size_t have = 0;
 
-    inline int exec() {
-      PolyDB* db = wrap->db;
-      if (!db->load_snapshot(std::string(*path, path.length()))) {
-	result = db->error().code();
+      while (result == PolyDB::Error::SUCCESS) {
+	if (have == buf.size()) buf.resize(buf.size() * 2);
+
+	size_t got = fread(&buf[have], 1, buf.size() - have, file);
+	if (got == 0) {
+	  if (have > 0 || ferror(file)) result = PolyDB::Error::INVALID;
+	  break;
+	}
+	have += got;
+
+	size_t end = check(&buf[0], have, true);
+	if (result != PolyDB::Error::SUCCESS) break;
+	if (end == 0) continue;
+
+	load(&buf[0], end);
+	memmove(&buf[0], &buf[end], have - end);
+	have -= end;
       }
+
+      fclose(file);
+    }
+
+    inline int after() {
+      Local<Value> argv[4] = {
+	error(),
+	Number::New(loaded),
+	loaded ? BytesToValue(last.data(), last.size(), true) : LNULL,
+	Number::New(bytes)
+      };
+      callback(4, argv);
       return 0;
     }
   };
@@ -1241,11 +5274,11 @@ public:
 
   class ApplyIndexVisitor : public DB::Visitor {
   public:
-    String::Utf8Value& key;
+    Bytes& key;
     const StringMap& index;
     StringMap& errors;
 
-    explicit ApplyIndexVisitor(String::Utf8Value &key, const StringMap& index, StringMap& errors) :
+    explicit ApplyIndexVisitor(Bytes &key, const StringMap& index, StringMap& errors) :
       key(key),
       index(index),
       errors(errors)
@@ -1282,10 +5315,10 @@ public:
 
   class RemoveIndexVisitor : public DB::Visitor {
   public:
-    String::Utf8Value& key;
+    Bytes& key;
     StringMap& errors;
 
-    explicit RemoveIndexVisitor(String::Utf8Value &key, StringMap& errors) :
+    explicit RemoveIndexVisitor(Bytes &key, StringMap& errors) :
       key(key),
       errors(errors)
     {}
@@ -1297,7 +5330,7 @@ public:
     {
       // It's an error to remove an index entry when it doesn't
       // point to this object.
-      if (!EQ_UTF8_BUF(key, vbuf, vsiz)) {
+      if (!EQ_BYTES_BUF(key, vbuf, vsiz)) {
 	errors.insert(MapItem(std::string(kbuf, ksiz), std::string(vbuf, vsiz)));
 	return NOP;
       }
@@ -1306,11 +5339,8 @@ public:
   };
 
   class IndexedRequest: public Request {
-  private:
-    Persistent<String> invalid_symbol;
-
   protected:
-    String::Utf8Value key;
+    Bytes key;
 
     StringMap toIndex;
     StringList toRemove;
@@ -1320,11 +5350,25 @@ public:
 
     IndexedRequest(const Arguments &args, int nextIndex) :
       Request(args, nextIndex),
-      key(args[0]->ToString())
-    {}
+      key(args[0])
+    {
+      touches_all();
+    }
+
+    int default_priority() {
+      return PHIGH;
+    }
 
     virtual bool main_operation() = 0;
 
+    // The object and its index entries may be created.
+    void adds_indexed() {
+      adds(*key, key.length());
+      for (MapIterator item = toIndex.begin(); item != toIndex.end(); ++item) {
+	adds(item->first);
+      }
+    }
+
     inline bool apply_index() {
       PolyDB* db = wrap->db;
 
@@ -1428,25 +5472,26 @@ public:
   DEFINE_METHOD(AddIndexed, AddIndexedRequest)
   class AddIndexedRequest: virtual public IndexedRequest {
   protected:
-    String::Utf8Value value;
+    Bytes value;
 
   public:
 
     inline static bool validate(const Arguments& args) {
       return (args.Length() >= 4
-	      && args[0]->IsString()
-	      && args[1]->IsString()
+	      && IS_BYTES(args[0])
+	      && IS_BYTES(args[1])
 	      && (args[2]->IsObject() || args[2]->IsNull())
 	      && args[3]->IsFunction());
     }
 
     AddIndexedRequest(const Arguments& args):
       IndexedRequest(args, 3),
-      value(args[1]->ToString())
+      value(args[1])
     {
       if (!args[2]->IsNull()) {
 	ObjToMap(args[2], toIndex);
       }
+      adds_indexed();
     }
 
     bool main_operation() {
@@ -1461,13 +5506,13 @@ public:
   DEFINE_METHOD(ReplaceIndexed, ReplaceIndexedRequest)
   class ReplaceIndexedRequest: public IndexedRequest {
   protected:
-    String::Utf8Value value;
+    Bytes value;
 
   public:
     inline static bool validate(const Arguments& args) {
       return (args.Length() >= 5
-	      && args[0]->IsString()
-	      && args[1]->IsString()
+	      && IS_BYTES(args[0])
+	      && IS_BYTES(args[1])
 	      && (args[2]->IsObject() || args[2]->IsNull())
 	      && (args[3]->IsArray() || args[3]->IsNull())
 	      && args[4]->IsFunction());
@@ -1475,7 +5520,7 @@ public:
 
     ReplaceIndexedRequest(const Arguments& args):
       IndexedRequest(args, 4),
-      value(args[1]->ToString())
+      value(args[1])
     {
       if (!args[2]->IsNull()) {
 	ObjToMap(args[2], toIndex);
@@ -1483,6 +5528,7 @@ public:
       if (!args[3]->IsNull()) {
 	ArrayToList(args[3], toRemove);
       }
+      adds_indexed();
     }
 
     bool main_operation() {
@@ -1499,7 +5545,7 @@ public:
   public:
     inline static bool validate(const Arguments& args) {
       return (args.Length() >= 3
-	      && args[0]->IsString()
+	      && IS_BYTES(args[0])
 	      && (args[1]->IsArray() || args[1]->IsNull())
 	      && args[2]->IsFunction());
     }
@@ -1528,10 +5574,24 @@ public:
 
 class CursorWrap: ObjectWrap {
 private:
+  PolyDBWrap* owner;
   DB::Cursor* cursor;
+  bool binary;
+  int priority_override;
 
 public:
 
+  // Flags for `getRange()`.
+  enum RangeFlag {
+    RJUMP = 1,			// jump to the start before reading
+    RSTART = 2,			// there is a start bound
+    RSTARTX = 4,		// the start bound is exclusive
+    REND = 8,			// there is an end bound
+    RENDX = 16,			// the end bound is exclusive
+    RBACK = 32,			// walk backward
+    RKEYS = 64			// read keys only
+  };
+
   
   // ### Initialization ###
 
@@ -1549,6 +5609,9 @@ public:
     NODE_SET_PROTOTYPE_METHOD(ctor, "get", Get);
     NODE_SET_PROTOTYPE_METHOD(ctor, "getKey", GetKey);
     NODE_SET_PROTOTYPE_METHOD(ctor, "getKeyBlock", GetKeyBlock);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "getBlock", GetBlock);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "getPackedBlock", GetPackedBlock);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "getRange", GetRange);
     NODE_SET_PROTOTYPE_METHOD(ctor, "getValue", GetValue);
     NODE_SET_PROTOTYPE_METHOD(ctor, "setValue", SetValue);
     NODE_SET_PROTOTYPE_METHOD(ctor, "remove", Remove);
@@ -1559,6 +5622,16 @@ public:
     NODE_SET_PROTOTYPE_METHOD(ctor, "jumpBackTo", JumpBackTo);
     NODE_SET_PROTOTYPE_METHOD(ctor, "step", Step);
     NODE_SET_PROTOTYPE_METHOD(ctor, "stepBack", StepBack);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "setBinary", SetBinary);
+    NODE_SET_PROTOTYPE_METHOD(ctor, "setPriority", SetPriority);
+
+    SET_CONSTANT(ctor, RJUMP);
+    SET_CONSTANT(ctor, RSTART);
+    SET_CONSTANT(ctor, RSTARTX);
+    SET_CONSTANT(ctor, REND);
+    SET_CONSTANT(ctor, RENDX);
+    SET_CONSTANT(ctor, RBACK);
+    SET_CONSTANT(ctor, RKEYS);
 
     target->Set(String::NewSymbol("Cursor"), ctor->GetFunction());
   }
@@ -1566,12 +5639,18 @@ public:
   
   // ### Construction ###
 
-  CursorWrap(DB::Cursor* cur):
-    cursor(cur)
-  {}
+  CursorWrap(PolyDBWrap* owner):
+    owner(owner),
+    cursor(owner->cursor()),
+    binary(owner->is_binary()),
+    priority_override(owner->current_priority())
+  {
+    owner->retain();
+  }
 
   ~CursorWrap() {
     delete cursor;
+    owner->release();
   }
 
   static Handle<Value> New(const Arguments& args) {
@@ -1580,30 +5659,64 @@ public:
     if (args.Length() < 1 && args[0]->IsObject()) return THROW_BAD_ARGS;
 
     PolyDBWrap* dbWrap = ObjectWrap::Unwrap<PolyDBWrap>(args[0]->ToObject());
-    CursorWrap* cursorWrap = new CursorWrap(dbWrap->cursor());
+    CursorWrap* cursorWrap = new CursorWrap(dbWrap);
     cursorWrap->Wrap(args.This());
     return args.This();
   }
 
+  // A cursor starts out in the same mode as its database. See
+  // `PolyDBWrap::SetBinary()`.
+  static Handle<Value> SetBinary(const Arguments& args) {
+    HandleScope scope;
+
+    if (!(args.Length() >= 1 && args[0]->IsBoolean())) {
+      return THROW_BAD_ARGS;
+    }
+
+    CursorWrap* wrap = ObjectWrap::Unwrap<CursorWrap>(args.This());
+    wrap->binary = V8_TO_BOOL(args[0]);
+
+    return args.This();
+  }
+
+  // Like binary mode, a cursor starts with the priority override of
+  // its database. See `PolyDBWrap::SetPriority()`.
+  static Handle<Value> SetPriority(const Arguments& args) {
+    HandleScope scope;
+
+    if (!(args.Length() >= 1 && args[0]->IsInt32()
+	  && args[0]->Int32Value() >= -1 && args[0]->Int32Value() < PRIORITIES)) {
+      return THROW_BAD_ARGS;
+    }
+
+    CursorWrap* wrap = ObjectWrap::Unwrap<CursorWrap>(args.This());
+    wrap->priority_override = args[0]->Int32Value();
+
+    return args.This();
+  }
+
   
   // ### Helpers ###
 
-  class Request {
-  private:
-    Persistent<String> code_symbol;
-
+  class Request: public Job {
   protected:
     CursorWrap* wrap;
     Persistent<Function> next;
     PolyDB::Error::Code result;
+    bool binary;
+    int priority_override;
+    bool touched_all;
 
   public:
     Request(const Arguments& args, int nextIndex):
-      result(PolyDB::Error::SUCCESS) {
+      result(PolyDB::Error::SUCCESS),
+      touched_all(false) {
       HandleScope scope;
 
       wrap = ObjectWrap::Unwrap<CursorWrap>(args.This());
       next = Persistent<Function>::New(Handle<Function>::Cast(args[nextIndex]));
+      binary = wrap->binary;
+      priority_override = wrap->priority_override;
 
       wrap->Ref();
     }
@@ -1613,6 +5726,49 @@ public:
       next.Dispose();
     }
 
+    // Cursor requests run in their database's pool, and are timed
+    // with its requests.
+    WorkerPool* pool() {
+      return wrap->owner->pool();
+    }
+
+    // The key a cursor changes isn't known until it runs, so a
+    // cursor mutation empties the database's read cache.
+    void touches_all() {
+      ReadCache* cache = wrap->owner->read_cache();
+      touched_all = true;
+      if (cache) cache->clear();
+    }
+
+    void finishing() {
+      ReadCache* cache = wrap->owner->read_cache();
+      if (touched_all && cache) cache->clear();
+    }
+
+    // Cursors walk the file, so a write-back tier is flushed first.
+    void starting() {
+      Tier* tier = wrap->owner->hot_tier();
+      if (tier && tier->is_write_back()) tier->flush(wrap->owner->database());
+    }
+
+    void stopping() {
+      Tier* tier = wrap->owner->hot_tier();
+      if (tier && touched_all) tier->invalidate_all(wrap->owner->database());
+    }
+
+    static const char* scope() {
+      return "cursor.";
+    }
+
+    Metrics* metrics() {
+      return wrap->owner->metrics();
+    }
+
+    // Cursors walk through the database, so they're scans.
+    int priority() {
+      return (priority_override < 0) ? PNORMAL : priority_override;
+    }
+
     inline void callback(int argc, Handle<Value> argv[]) {
       TryCatch try_catch;
       next->Call(Context::GetCurrent()->Global(), argc, argv);
@@ -1622,21 +5778,7 @@ public:
     }
 
     Local<Value> error() {
-      if (result == PolyDB::Error::SUCCESS)
-	return LNULL;
-
-      const char* name = PolyDB::Error::codename(result);
-      Local<String> message = String::NewSymbol(name);
-      Local<Value> err = Exception::Error(message);
-
-      if (code_symbol.IsEmpty()) {
-	code_symbol = NODE_PSYMBOL("code");
-      }
-
-      Local<Object> obj = err->ToObject();
-      obj->Set(code_symbol, Integer::New(result));
-
-      return err;
+      return KyotoError(result);
     }
   };
 
@@ -1677,8 +5819,8 @@ public:
       if (result == PolyDB::Error::SUCCESS) {
   	argc = 3;
   	argv[0] = LNULL;
-  	argv[1] = WRAP_STRING(value);
-  	argv[2] = WRAP_STRING(key);
+  	argv[1] = BytesToValue(value.data(), value.size(), binary);
+  	argv[2] = BytesToValue(key.data(), key.size(), binary);
       }
       else {
   	argc = 1;
@@ -1727,7 +5869,7 @@ public:
       if (result == PolyDB::Error::SUCCESS) {
   	argc = 2;
   	argv[0] = LNULL;
-  	argv[1] = WRAP_STRING(value);
+  	argv[1] = BytesToValue(value.data(), value.size(), binary);
       }
       else {
   	argc = 1;
@@ -1764,23 +5906,25 @@ public:
   DEFINE_METHOD(SetValue, SetValueRequest)
   class SetValueRequest: public Request {
   protected:
-    String::Utf8Value value;
+    Bytes value;
     bool step;
 
   public:
 
     inline static bool validate(const Arguments& args) {
       return (args.Length() >= 3
-	      && args[0]->IsString()
+	      && IS_BYTES(args[0])
 	      && args[1]->IsBoolean()
 	      && args[2]->IsFunction());
     }
 
     SetValueRequest(const Arguments& args):
       Request(args, 2),
-      value(args[0]->ToString()),
+      value(args[0]),
       step(V8_TO_BOOL(args[1]))
-    {}
+    {
+      touches_all();
+    }
 
     inline int exec() {
       DB::Cursor* cursor = wrap->cursor;
@@ -1811,7 +5955,9 @@ public:
 
     RemoveRequest(const Arguments& args):
       Request(args, 0)
-    {}
+    {
+      touches_all();
+    }
 
     inline int exec() {
       DB::Cursor* cursor = wrap->cursor;
@@ -1918,7 +6064,7 @@ public:
       if (result == PolyDB::Error::SUCCESS) {
   	argc = 2;
   	argv[0] = LNULL;
-  	argv[1] = ListToArray(keys);
+  	argv[1] = ListToArray(keys, binary);
       }
       else {
   	argc = 1;
@@ -1930,6 +6076,291 @@ public:
     }
   };
 
+  
+  // ### Get Block ###
+
+  // Read records starting at the current one, moving forward (or
+  // backward if `back` is true). Stop after `max` records, or once
+  // `maxBytes` bytes of keys and values have been read if `maxBytes`
+  // isn't 0. The callback gets an array of keys, an array of values,
+  // and whether the scan reached the end.
+
+  DEFINE_METHOD(GetBlock, GetBlockRequest)
+  class GetBlockRequest: public Request {
+  protected:
+    uint32_t max;
+    uint32_t max_bytes;
+    bool back;
+    StringList keys;
+    StringList values;
+    bool ended;
+
+  public:
+
+    inline static bool validate(const Arguments& args) {
+      return (args.Length() >= 4
+	      && args[0]->IsUint32()
+	      && args[1]->IsUint32()
+	      && args[2]->IsBoolean()
+	      && args[3]->IsFunction());
+    }
+
+    GetBlockRequest(const Arguments& args):
+      Request(args, 3),
+      max(args[0]->Uint32Value()),
+      max_bytes(args[1]->Uint32Value()),
+      back(V8_TO_BOOL(args[2])),
+      ended(false)
+    {}
+
+    inline int exec() {
+      DB::Cursor* cursor = wrap->cursor;
+      std::string key, value;
+      size_t bytes = 0;
+
+      keys.reserve(max);
+      values.reserve(max);
+
+      while (keys.size() < max && (max_bytes == 0 || bytes < max_bytes)) {
+	if (!cursor->get(&key, &value, !back)) {
+	  finish(CURSOR_ERROR(cursor));
+	  break;
+	}
+
+	bytes += key.size() + value.size();
+	keys.push_back(std::string());
+	keys.back().swap(key);
+	values.push_back(std::string());
+	values.back().swap(value);
+
+	if (back && !cursor->step_back()) {
+	  finish(CURSOR_ERROR(cursor));
+	  break;
+	}
+      }
+
+      return 0;
+    }
+
+    // Running out of records is the end of the scan, not an error.
+    inline void finish(PolyDB::Error::Code code) {
+      if (code == PolyDB::Error::NOREC)
+	ended = true;
+      else
+	result = code;
+    }
+
+    inline int after() {
+      int argc;
+      Local<Value> argv[4];
+
+      if (result == PolyDB::Error::SUCCESS) {
+	argc = 4;
+	argv[0] = LNULL;
+	argv[1] = ListToArray(keys, binary);
+	argv[2] = ListToArray(values, binary);
+	argv[3] = BOOL_TO_LOCAL_V8(ended);
+      }
+      else {
+	argc = 1;
+	argv[0] = error();
+      }
+
+      callback(argc, argv);
+      return 0;
+    }
+  };
+
+  
+  // ### Get Packed Block ###
+
+  // Like `getBlock()`, but the records come back as one packed list of
+  // alternating keys and values, followed by the number of records.
+
+  DEFINE_METHOD(GetPackedBlock, GetPackedBlockRequest)
+  class GetPackedBlockRequest: public GetBlockRequest {
+  public:
+
+    GetPackedBlockRequest(const Arguments& args):
+      GetBlockRequest(args)
+    {}
+
+    inline int after() {
+      int argc;
+      Local<Value> argv[4];
+
+      if (result == PolyDB::Error::SUCCESS) {
+	argc = 4;
+	argv[0] = LNULL;
+	argv[1] = PackPairs(keys, values);
+	argv[2] = Integer::NewFromUnsigned(keys.size());
+	argv[3] = BOOL_TO_LOCAL_V8(ended);
+      }
+      else {
+	argc = 1;
+	argv[0] = error();
+      }
+
+      callback(argc, argv);
+      return 0;
+    }
+  };
+
+  
+  // ### Get Range ###
+
+  // Walk the records between two keys, comparing them with the
+  // database's comparator. When `RJUMP` is set, the cursor first
+  // jumps to the start bound (or to the first or last record if there
+  // isn't one); otherwise the walk continues from the current record.
+  // Like `getBlock()`, a call reads at most `max` records or about
+  // `maxBytes` bytes, so a long range is read in several calls.
+  //
+  // Bounds are ignored by unordered databases, so they refuse with
+  // `NOIMPL`.
+
+  DEFINE_METHOD(GetRange, GetRangeRequest)
+  class GetRangeRequest: public Request {
+  protected:
+    Bytes start;
+    Bytes end;
+    uint32_t flags;
+    uint32_t max;
+    uint32_t max_bytes;
+    StringList keys;
+    StringList values;
+    bool ended;
+
+  public:
+
+    inline static bool validate(const Arguments& args) {
+      return (args.Length() >= 6
+	      && IS_BYTES(args[0])
+	      && IS_BYTES(args[1])
+	      && args[2]->IsUint32()
+	      && args[3]->IsUint32()
+	      && args[4]->IsUint32()
+	      && args[5]->IsFunction());
+    }
+
+    GetRangeRequest(const Arguments& args):
+      Request(args, 5),
+      start(args[0]),
+      end(args[1]),
+      flags(args[2]->Uint32Value()),
+      max(args[3]->Uint32Value()),
+      max_bytes(args[4]->Uint32Value()),
+      ended(false)
+    {}
+
+    inline int exec() {
+      DB::Cursor* cursor = wrap->cursor;
+      Comparator* comp = wrap->owner->comparator();
+      bool back = flags & RBACK;
+      bool keys_only = flags & RKEYS;
+      bool skip = (flags & RJUMP) && (flags & RSTARTX);
+      std::string key, value;
+      size_t bytes = 0;
+
+      if (!comp) {
+	result = PolyDB::Error::NOIMPL;
+	return 0;
+      }
+
+      if ((flags & RJUMP) && !jump(cursor, back)) {
+	finish(CURSOR_ERROR(cursor));
+	return 0;
+      }
+
+      while (keys.size() < max && (max_bytes == 0 || bytes < max_bytes)) {
+	bool found = keys_only
+	  ? cursor->get_key(&key, !back)
+	  : cursor->get(&key, &value, !back);
+
+	if (!found) {
+	  finish(CURSOR_ERROR(cursor));
+	  break;
+	}
+
+	if (skip) {
+	  skip = false;
+	  if (compare(comp, key, start) == 0) {
+	    if (back && !step_back(cursor)) break;
+	    continue;
+	  }
+	}
+
+	if (flags & REND) {
+	  int order = compare(comp, key, end);
+	  if (back) order = -order;
+	  if (order > 0 || (order == 0 && (flags & RENDX))) {
+	    ended = true;
+	    break;
+	  }
+	}
+
+	bytes += key.size() + value.size();
+	keys.push_back(std::string());
+	keys.back().swap(key);
+	if (!keys_only) {
+	  values.push_back(std::string());
+	  values.back().swap(value);
+	}
+
+	if (back && !step_back(cursor)) break;
+      }
+
+      return 0;
+    }
+
+    inline bool jump(DB::Cursor* cursor, bool back) {
+      if (flags & RSTART) {
+	return back
+	  ? cursor->jump_back(*start, start.length())
+	  : cursor->jump(*start, start.length());
+      }
+      return back ? cursor->jump_back() : cursor->jump();
+    }
+
+    inline bool step_back(DB::Cursor* cursor) {
+      if (cursor->step_back()) return true;
+      finish(CURSOR_ERROR(cursor));
+      return false;
+    }
+
+    inline static int compare(Comparator* comp, const std::string& key, const Bytes& bound) {
+      return comp->compare(key.data(), key.size(), *bound, bound.length());
+    }
+
+    // Running out of records is the end of the range, not an error.
+    inline void finish(PolyDB::Error::Code code) {
+      if (code == PolyDB::Error::NOREC)
+	ended = true;
+      else
+	result = code;
+    }
+
+    inline int after() {
+      int argc;
+      Local<Value> argv[4];
+
+      if (result == PolyDB::Error::SUCCESS) {
+	argc = 4;
+	argv[0] = LNULL;
+	argv[1] = ListToArray(keys, binary);
+	argv[2] = (flags & RKEYS) ? LNULL : ListToArray(values, binary);
+	argv[3] = BOOL_TO_LOCAL_V8(ended);
+      }
+      else {
+	argc = 1;
+	argv[0] = error();
+      }
+
+      callback(argc, argv);
+      return 0;
+    }
+  };
+
   
   // ### Jump ###
 
@@ -1964,19 +6395,19 @@ public:
   DEFINE_METHOD(JumpTo, JumpToRequest)
   class JumpToRequest: public Request {
   protected:
-    String::Utf8Value key;
+    Bytes key;
 
   public:
 
     inline static bool validate(const Arguments& args) {
       return (args.Length() >= 2
-	      && args[0]->IsString()
+	      && IS_BYTES(args[0])
 	      && args[1]->IsFunction());
     }
 
     JumpToRequest(const Arguments& args):
       Request(args, 1),
-      key(args[0]->ToString())
+      key(args[0])
     {}
 
     inline int exec() {
@@ -2077,6 +6508,71 @@ public:
 
 };
 
+
+// ## Sharding ##
+
+// A ShardedKyotoDB spreads keys over its shards by their MurmurHash,
+// which Kyoto also uses for its hash databases. These helpers are
+// here so the hashing, and the splitting of bulk arguments, doesn't
+// run as JavaScript for every key.
+
+static inline uint32_t ShardOf(const char* buf, size_t siz, uint32_t shards) {
+  return (uint32_t)(hashmurmur(buf, siz) % shards);
+}
+
+static inline bool ValidShards(const Handle<Value> value) {
+  return value->IsUint32() && value->Uint32Value() > 0;
+}
+
+// shardOf(key, shards) returns the shard for a String or Buffer key.
+static Handle<Value> ShardOfKey(const Arguments& args) {
+  HandleScope scope;
+
+  if (!(args.Length() >= 2 && IS_BYTES(args[0]) && ValidShards(args[1]))) {
+    return THROW_BAD_ARGS;
+  }
+
+  Bytes key(args[0]);
+  return scope.Close(Integer::NewFromUnsigned(ShardOf(*key, key.length(), args[1]->Uint32Value())));
+}
+
+// partition(what, shards) splits an Array of keys into an Array of
+// key Arrays, or an Object of items into an Array of Objects, one for
+// each shard. Order is kept within each shard.
+static Handle<Value> Partition(const Arguments& args) {
+  HandleScope scope;
+
+  if (!(args.Length() >= 2 && args[0]->IsObject() && ValidShards(args[1]))) {
+    return THROW_BAD_ARGS;
+  }
+
+  uint32_t shards = args[1]->Uint32Value();
+  bool is_array = args[0]->IsArray();
+  Local<Object> input = args[0]->ToObject();
+  Local<Array> keys = is_array ? Local<Array>::Cast(input) : input->GetPropertyNames();
+  uint32_t len = keys->Length();
+
+  Local<Array> result = Array::New(shards);
+  std::vector<uint32_t> sizes(shards, 0);
+  for (uint32_t i = 0; i < shards; i++) {
+    result->Set(i, is_array ? Local<Object>(Array::New()) : Object::New());
+  }
+
+  for (uint32_t i = 0; i < len; i++) {
+    Local<Value> key = keys->Get(i);
+    Bytes bytes(key);
+    uint32_t shard = ShardOf(*bytes, bytes.length(), shards);
+    Local<Object> group = result->Get(shard)->ToObject();
+
+    if (is_array)
+      group->Set(sizes[shard]++, key);
+    else
+      group->Set(key, input->Get(key));
+  }
+
+  return scope.Close(result);
+}
+
 
 // ## Init ##
 
@@ -2085,8 +6581,14 @@ Persistent<FunctionTemplate> CursorWrap::ctor;
 
 extern "C" {
   static void init (Handle<Object> target) {
+    Completions::Init();
     PolyDBWrap::Init(target);
     CursorWrap::Init(target);
+
+    NODE_SET_METHOD(target, "shardOf", ShardOfKey);
+    NODE_SET_METHOD(target, "partition", Partition);
+    NODE_SET_METHOD(target, "allocStats", AllocStats);
+    NODE_SET_METHOD(target, "completionStats", CompletionStats);
   }
 
   NODE_MODULE(_kyoto, init);
@@ -0,0 +1,165 @@
+// # bench.cc #
+//
+// Microbenchmarks for the conversions in convert.h, built as the
+// `_kyoto_bench` addon and driven by `bench/convert.js`. Each bulk
+// request converts its arguments on the main thread in its
+// constructor and its results in `after()`, so these are the costs a
+// bulk call adds to the main thread. The original versions of the
+// helpers are kept here for comparison.
+//
+// + Legacy - the helpers as they were
+// + Cases  - one benchmark per helper
+// + Init   - module initialization
+
+#include "convert.h"
+#include <sys/time.h>
+#include <string.h>
+
+
+// ## Legacy ##
+
+static void LegacyObjToMap(const Local<Value> value, StringMap &result) {
+  HandleScope scope;
+
+  Local<Object> obj = Local<Object>::Cast(value);
+  Local<Array> names = obj->GetPropertyNames();
+  int names_len = names->Length();
+
+  for (int i = 0; i < names_len; i++) {
+    Local<Value> name = names->Get(Integer::New(i));
+    String::Utf8Value key(name);
+    std::string std_key = std::string(*key, key.length());
+    result.insert(MapItem(std_key, BytesToString(obj->Get(name))));
+  }
+}
+
+static void LegacyArrayToList(const Local<Value> obj, StringList &result) {
+  HandleScope scope;
+
+  Local<Array> array = Local<Array>::Cast(obj);
+  int alen = array->Length();
+  for (int i = 0; i < alen; i++) {
+    result.push_back(BytesToString(array->Get(Integer::New(i))));
+  }
+}
+
+
+// ## Cases ##
+
+// Each case converts `input` once per iteration. Cases that produce
+// V8 values convert `input` to stdlib types first, outside the timer.
+enum Case {
+  OBJ_TO_MAP,
+  OBJ_TO_MAP_LEGACY,
+  OBJ_TO_PAIRS,
+  ARRAY_TO_LIST,
+  ARRAY_TO_LIST_LEGACY,
+  MAP_TO_OBJ,
+  LIST_TO_ARRAY,
+  CASES
+};
+
+static const char* case_names[CASES] = {
+  "objToMap",
+  "objToMapLegacy",
+  "objToPairs",
+  "arrayToList",
+  "arrayToListLegacy",
+  "mapToObj",
+  "listToArray"
+};
+
+static inline uint64_t NowMicros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void RunCase(int which, Local<Value> input, uint32_t iterations) {
+  StringMap map;
+  StringList list;
+
+  if (which == MAP_TO_OBJ) ObjToMap(input, map);
+  if (which == LIST_TO_ARRAY) ArrayToList(input, list);
+
+  for (uint32_t i = 0; i < iterations; i++) {
+    HandleScope scope;
+
+    switch (which) {
+    case OBJ_TO_MAP: {
+      StringMap result;
+      ObjToMap(input, result);
+      break;
+    }
+    case OBJ_TO_MAP_LEGACY: {
+      StringMap result;
+      LegacyObjToMap(input, result);
+      break;
+    }
+    case OBJ_TO_PAIRS: {
+      StringPairs result;
+      ObjToPairs(input, result);
+      break;
+    }
+    case ARRAY_TO_LIST: {
+      StringList result;
+      ArrayToList(input, result);
+      break;
+    }
+    case ARRAY_TO_LIST_LEGACY: {
+      StringList result;
+      LegacyArrayToList(input, result);
+      break;
+    }
+    case MAP_TO_OBJ:
+      MapToObj(map);
+      break;
+    case LIST_TO_ARRAY:
+      ListToArray(list);
+      break;
+    }
+  }
+}
+
+// run(name, input, iterations) returns the nanoseconds per iteration.
+static Handle<Value> Run(const Arguments& args) {
+  HandleScope scope;
+
+  if (!(args.Length() >= 3 && args[0]->IsString() && args[1]->IsObject()
+	&& args[2]->IsUint32() && args[2]->Uint32Value() > 0)) {
+    return ThrowException(Exception::TypeError(String::New("Bad argument")));
+  }
+
+  String::Utf8Value name(args[0]);
+  uint32_t iterations = args[2]->Uint32Value();
+
+  for (int which = 0; which < CASES; which++) {
+    if (strcmp(*name, case_names[which]) == 0) {
+      uint64_t start = NowMicros();
+      RunCase(which, args[1], iterations);
+      double elapsed = NowMicros() - start;
+      return scope.Close(Number::New(elapsed * 1000 / iterations));
+    }
+  }
+
+  return ThrowException(Exception::Error(String::New("Unknown case")));
+}
+
+
+// ## Init ##
+
+extern "C" {
+  static void init (Handle<Object> target) {
+    HandleScope scope;
+
+    Local<Array> names = Array::New(CASES);
+    for (int i = 0; i < CASES; i++) {
+      names->Set(i, String::NewSymbol(case_names[i]));
+    }
+
+    target->Set(String::NewSymbol("cases"), names);
+    NODE_SET_METHOD(target, "run", Run);
+  }
+
+  NODE_MODULE(_kyoto_bench, init);
+}
@@ -0,0 +1,378 @@
+// # convert.h #
+//
+// Conversions between V8 values and the stdlib types Kyoto uses.
+// They're shared by the bindings in `_kyoto.cc` and the conversion
+// benchmarks in `bench.cc`.
+//
+// + Bytes      - String or Buffer keys and values
+// + Maps/Lists - convert between stdlib and V8
+// + Packed     - length-prefixed lists in a Buffer
+
+#ifndef KYOTO_CONVERT_H
+#define KYOTO_CONVERT_H
+
+#include <v8.h>
+#include <node.h>
+#include <node_buffer.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <string.h>
+
+using namespace std;
+using namespace node;
+using namespace v8;
+
+
+// ## Bytes ##
+
+// Keys and values may be given as a String or a Buffer. Small ones
+// are copied into the Bytes itself, so they cost no allocation or
+// handle. A larger String is transcoded to UTF-8 once into the heap;
+// a larger Buffer is used in place and held by a persistent handle
+// until the request is finished with it. Except for a held Buffer,
+// the data is followed by a NUL. The interface mirrors
+// `String::Utf8Value` so requests can use either.
+//
+// Bytes are only made on the main thread, which keeps the counters in
+// `BytesCounters()` simple.
+struct BytesStats {
+  uint64_t made;
+  uint64_t inlined;
+  uint64_t heap;
+  uint64_t held;
+};
+
+inline BytesStats& BytesCounters() {
+  static BytesStats stats = { 0, 0, 0, 0 };
+  return stats;
+}
+
+class Bytes {
+public:
+  static const size_t INLINE = 64;
+
+private:
+  char small[INLINE];
+  char* heap;
+  Persistent<Object> buffer;
+  const char* buf;
+  size_t siz;
+
+public:
+  explicit Bytes(Handle<Value> value):
+    heap(NULL)
+  {
+    BytesStats& stats = BytesCounters();
+    stats.made++;
+
+    if (Buffer::HasInstance(value)) {
+      Local<Object> obj = value->ToObject();
+      siz = Buffer::Length(obj);
+      if (siz < INLINE) {
+	memcpy(small, Buffer::Data(obj), siz);
+	small[siz] = '\0';
+	buf = small;
+	stats.inlined++;
+      }
+      else {
+	buffer = Persistent<Object>::New(obj);
+	buf = Buffer::Data(obj);
+	stats.held++;
+      }
+    }
+    else {
+      Local<String> str = value->ToString();
+      siz = str->Utf8Length();
+      char* dst = small;
+      if (siz < INLINE) {
+	stats.inlined++;
+      }
+      else {
+	dst = heap = new char[siz + 1];
+	stats.heap++;
+      }
+      str->WriteUtf8(dst, siz + 1);
+      dst[siz] = '\0';
+      buf = dst;
+    }
+  }
+
+  ~Bytes() {
+    if (heap) delete[] heap;
+    if (!buffer.IsEmpty()) buffer.Dispose();
+  }
+
+  inline const char* operator*() const { return buf; }
+  inline size_t length() const { return siz; }
+};
+
+// Copy a String or Buffer into a std::string.
+inline std::string BytesToString(const Handle<Value> value) {
+  if (Buffer::HasInstance(value)) {
+    Local<Object> obj = value->ToObject();
+    return std::string(Buffer::Data(obj), Buffer::Length(obj));
+  }
+
+  String::Utf8Value utf(value->ToString());
+  return std::string(*utf, utf.length());
+}
+
+// Make a V8 value from a result: a Buffer in binary mode, otherwise a
+// String.
+inline Local<Value> BytesToValue(const char* buf, size_t siz, bool binary) {
+  HandleScope scope;
+
+  if (binary) {
+    Buffer* result = Buffer::New(const_cast<char*>(buf), siz);
+    return scope.Close(Local<Object>::New(result->handle_));
+  }
+
+  return scope.Close(String::New(buf, siz));
+}
+
+static void FreeKyotoValue(char* data, void* hint) {
+  delete[] data;
+}
+
+// Wrap a value allocated by Kyoto in a Buffer without copying it. The
+// Buffer takes ownership and frees it when collected.
+inline Local<Value> AdoptKyotoValue(char* vbuf, size_t vsiz) {
+  HandleScope scope;
+  Buffer* result = Buffer::New(vbuf, vsiz, FreeKyotoValue, NULL);
+  return scope.Close(Local<Object>::New(result->handle_));
+}
+
+
+// ## Maps and Lists ##
+
+typedef std::vector<std::string> StringList;
+typedef StringList::const_iterator StringIterator;
+typedef std::map<std::string, std::string> StringMap;
+typedef pair<std::string, std::string> MapItem;
+typedef StringMap::const_iterator MapIterator;
+typedef std::vector<MapItem> StringPairs;
+
+// Objects are read by index into their property names; `Get(i)`
+// avoids allocating an Integer handle for every index.
+inline void ObjToMap(const Local<Value> value, StringMap &result) {
+  HandleScope scope;
+
+  Local<Object> obj = Local<Object>::Cast(value);
+  Local<Array> names = obj->GetPropertyNames();
+  uint32_t names_len = names->Length();
+
+  for (uint32_t i = 0; i < names_len; i++) {
+    Local<Value> name = names->Get(i);
+    result.insert(MapItem(BytesToString(name), BytesToString(obj->Get(name))));
+  }
+}
+
+// Like `ObjToMap()`, but the items stay in property order in a
+// presized vector. Use this when Kyoto doesn't need a sorted map.
+inline void ObjToPairs(const Local<Value> value, StringPairs &result) {
+  HandleScope scope;
+
+  Local<Object> obj = Local<Object>::Cast(value);
+  Local<Array> names = obj->GetPropertyNames();
+  uint32_t names_len = names->Length();
+
+  result.resize(names_len);
+  for (uint32_t i = 0; i < names_len; i++) {
+    Local<Value> name = names->Get(i);
+    result[i].first = BytesToString(name);
+    result[i].second = BytesToString(obj->Get(name));
+  }
+}
+
+inline Local<Object> MapToObj(const StringMap &map, bool binary = false) {
+  HandleScope scope;
+
+  MapIterator item = map.begin();
+  MapIterator end = map.end();
+
+  Local<Object> result = Object::New();
+  while (item != end) {
+    Local<String> key = String::New(item->first.c_str(), item->first.length());
+    Local<Value> val = BytesToValue(item->second.data(), item->second.length(), binary);
+    result->Set(key, val);
+    ++item;
+  }
+
+  return scope.Close(result);
+}
+
+inline void MapKeys(const StringMap &map, StringList &keys) {
+  keys.reserve(map.size());
+  MapIterator item = map.begin();
+  MapIterator end = map.end();
+  while(item != end) {
+    keys.push_back(item->first);
+    ++item;
+  }
+}
+
+inline void ArrayToList(const Local<Value> obj, StringList &result) {
+  HandleScope scope;
+
+  Local<Array> array = Local<Array>::Cast(obj);
+  uint32_t alen = array->Length();
+  result.reserve(result.size() + alen);
+  for (uint32_t i = 0; i < alen; i++) {
+    result.push_back(BytesToString(array->Get(i)));
+  }
+}
+
+inline Local<Object> ListToArray(const StringList &list, bool binary = false) {
+  HandleScope scope;
+
+  StringIterator item = list.begin();
+  StringIterator end = list.end();
+
+  Local<Array> result = Array::New(list.size());
+  uint32_t index = 0;
+  while(item != end) {
+    Local<Value> val = BytesToValue(item->data(), item->length(), binary);
+    result->Set(index++, val);
+    ++item;
+  }
+
+  return scope.Close(result);
+}
+
+
+
+// ## Packed Lists ##
+
+// A packed list is a Buffer of items, each a 32-bit big-endian length
+// followed by that many bytes. A length of `PACKED_MISSING` stands
+// for a missing item and has no bytes. Packed lists are read on the
+// worker threads, without making a V8 value per item.
+
+static const uint32_t PACKED_MISSING = 0xFFFFFFFF;
+
+// Find the item at `*pos` in place, advancing `*pos` past it. Returns
+// false if the list is truncated. A missing item has length
+// `PACKED_MISSING`.
+inline bool PackedSpan(const char* buf, size_t siz, size_t* pos,
+		       const char** item, uint32_t* len) {
+  if (siz - *pos < 4) return false;
+
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(buf + *pos);
+  *len = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+    | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+  *pos += 4;
+  *item = buf + *pos;
+
+  if (*len == PACKED_MISSING) return true;
+  if (siz - *pos < *len) return false;
+  *pos += *len;
+  return true;
+}
+
+// Read the item at `*pos`, advancing `*pos` past it. Returns false if
+// the list is truncated; `*missing` is set for a missing item.
+inline bool UnpackItem(const char* buf, size_t siz, size_t* pos,
+		       std::string* item, bool* missing) {
+  const char* data;
+  uint32_t len;
+
+  if (!PackedSpan(buf, siz, pos, &data, &len)) return false;
+
+  *missing = (len == PACKED_MISSING);
+  if (*missing)
+    item->clear();
+  else
+    item->assign(data, len);
+  return true;
+}
+
+// Read a packed list that has no missing items.
+inline bool UnpackList(const char* buf, size_t siz, StringList& result) {
+  size_t pos = 0;
+  bool missing;
+
+  while (pos < siz) {
+    result.push_back(std::string());
+    if (!UnpackItem(buf, siz, &pos, &result.back(), &missing) || missing)
+      return false;
+  }
+
+  return true;
+}
+
+// Read a packed list of alternating keys and values.
+inline bool UnpackPairs(const char* buf, size_t siz, StringList& keys, StringList& values) {
+  size_t pos = 0;
+  bool missing;
+
+  while (pos < siz) {
+    keys.push_back(std::string());
+    values.push_back(std::string());
+    if (!UnpackItem(buf, siz, &pos, &keys.back(), &missing) || missing
+	|| !UnpackItem(buf, siz, &pos, &values.back(), &missing) || missing)
+      return false;
+  }
+
+  return true;
+}
+
+inline char* PackItem(char* p, const std::string& item) {
+  uint32_t len = item.size();
+  p[0] = (char)(len >> 24);
+  p[1] = (char)(len >> 16);
+  p[2] = (char)(len >> 8);
+  p[3] = (char)len;
+  memcpy(p + 4, item.data(), len);
+  return p + 4 + len;
+}
+
+// Append an item to a packed list being built in a std::string.
+inline void AppendPackedItem(std::string& out, const char* buf, uint32_t len) {
+  char prefix[4] = { (char)(len >> 24), (char)(len >> 16), (char)(len >> 8), (char)len };
+  out.append(prefix, 4);
+  out.append(buf, len);
+}
+
+// Pack parallel lists of keys and values into one Buffer of
+// alternating keys and values. The Buffer is sized once and filled in
+// place.
+inline Local<Value> PackPairs(const StringList& keys, const StringList& values) {
+  HandleScope scope;
+
+  size_t size = 0;
+  for (size_t i = 0; i < keys.size(); i++) {
+    size += 8 + keys[i].size() + values[i].size();
+  }
+
+  Buffer* result = Buffer::New(size);
+  char* p = Buffer::Data(result->handle_);
+  for (size_t i = 0; i < keys.size(); i++) {
+    p = PackItem(p, keys[i]);
+    p = PackItem(p, values[i]);
+  }
+
+  return scope.Close(Local<Object>::New(result->handle_));
+}
+
+// Like `PackPairs()`, for the items of a map.
+inline Local<Value> PackMap(const StringMap& map) {
+  HandleScope scope;
+
+  size_t size = 0;
+  for (MapIterator item = map.begin(); item != map.end(); ++item) {
+    size += 8 + item->first.size() + item->second.size();
+  }
+
+  Buffer* result = Buffer::New(size);
+  char* p = Buffer::Data(result->handle_);
+  for (MapIterator item = map.begin(); item != map.end(); ++item) {
+    p = PackItem(p, item->first);
+    p = PackItem(p, item->second);
+  }
+
+  return scope.Close(Local<Object>::New(result->handle_));
+}
+
+
+#endif
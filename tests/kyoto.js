@@ -396,6 +396,136 @@ module.exports = {
     }
   },
 
+  'cursor get block': function(done) {
+    (cursor = db.cursor()).jump(function(err) {
+      if (err) throw err;
+      cursor.getBlock(3, firstBlock);
+    });
+
+    function firstBlock(err, keys, values, ended) {
+      if (err) throw err;
+      Assert.deepEqual(['aardvark', 'active', 'air'], keys);
+      Assert.deepEqual(['4', '6', '5'], values);
+      Assert.ok(!ended);
+      cursor.getBlock(10, restBlock);
+    }
+
+    function restBlock(err, keys, values, ended) {
+      if (err) throw err;
+      Assert.deepEqual(['allow', 'api', 'apple', 'arrest'], keys);
+      Assert.ok(ended);
+      cursor.jumpBack(function(err) {
+        if (err) throw err;
+        cursor.getBlock(2, 0, true, backBlock);
+      });
+    }
+
+    function backBlock(err, keys, values, ended) {
+      if (err) throw err;
+      Assert.deepEqual(['arrest', 'apple'], keys);
+      Assert.deepEqual(['7', '2'], values);
+      Assert.ok(!ended);
+      done();
+    }
+  },
+
+  'range': function(done) {
+    db.range({ gte: 'active', lt: 'api' }, function(err, keys, values) {
+      if (err) throw err;
+      Assert.deepEqual(['active', 'air', 'allow'], keys);
+      Assert.deepEqual(['6', '5', '8'], values);
+      reversed();
+    });
+
+    function reversed() {
+      var opts = { gt: 'active', lte: 'apple', reverse: true, limit: 2, keysOnly: true };
+      db.range(opts, function(err, keys, values) {
+        if (err) throw err;
+        Assert.deepEqual(['apple', 'api'], keys);
+        Assert.equal(null, values);
+        chunked();
+      });
+    }
+
+    function chunked() {
+      var chunks = [];
+      db.range({ gt: 'aardvark', chunk: 2 }, function(keys, values, next) {
+        chunks.push(keys);
+        next();
+      }, function(err) {
+        if (err) throw err;
+        Assert.deepEqual([['active', 'air'], ['allow', 'api'], ['apple', 'arrest']], chunks);
+        done();
+      });
+    }
+  },
+
+  'iterator': function(done) {
+    var it = db.iterator({ start: 'api', highWaterMark: 2 }),
+        keys = [];
+
+    it.next(function step(err, val, key) {
+      if (err) throw err;
+      if (key === undefined) {
+        Assert.deepEqual(['api', 'apple', 'arrest'], keys);
+        return done();
+      }
+      keys.push(key);
+      it.next(step);
+    });
+  },
+
+  'read stream': function(done) {
+    var items = [];
+
+    db.createReadStream({ reverse: true, highWaterMark: 3 })
+      .on('data', function(item) { items.push(item.key + '=' + item.value); })
+      .on('error', function(err) { throw err; })
+      .on('end', function() {
+        Assert.deepEqual(['arrest=7', 'apple=2', 'api=3', 'allow=8', 'air=5', 'active=6', 'aardvark=4'], items);
+        done();
+      });
+  },
+
+  'scan parallel': function(done) {
+    db.scanParallel({ threads: 2, keyPrefix: 'a', valueContains: '2' }, function(err, stats, keys, values) {
+      if (err) throw err;
+      Assert.deepEqual(['apple'], keys);
+      Assert.deepEqual(['2'], values);
+      Assert.equal(7, stats.scanned);
+      Assert.equal(1, stats.matched);
+      limited();
+    });
+
+    function limited() {
+      var batches = 0;
+      db.scanParallel({ keyRegex: /^a/, limit: 3, batch: 2 }, function(keys, values) {
+        batches++;
+        Assert.ok(keys.length <= 2);
+      }, function(err, stats) {
+        if (err) throw err;
+        Assert.equal(3, stats.matched);
+        Assert.equal(2, batches);
+        done();
+      });
+    }
+  },
+
+  'metrics': function(done) {
+    db.metrics(true);
+    db.get('apple', function(err) {
+      if (err) throw err;
+      process.nextTick(function() {
+        var get = db.metrics().get;
+        Assert.equal(0, get.inflight);
+        Assert.equal(1, get.exec.count);
+        Assert.ok(get.exec.p50 <= get.exec.max);
+        Assert.equal(get.queue.count, get.callback.count);
+        done();
+      });
+    });
+  },
+
   'match prefix': function(done) {
     db.matchPrefix('ap', function(err, keys) {
       if (err) throw err;
@@ -483,6 +613,602 @@ module.exports = {
     });
   },
 
+  'binary': function(done) {
+    var key = new Buffer([0, 1, 2, 255]),
+        val = new Buffer([255, 0, 128, 10, 0]);
+
+    freshDB('-', {}, function(err, store) {
+      if (err) throw err;
+      store.set(key, val, function(err) {
+        if (err) throw err;
+        store.getBuffer(key, verify);
+      });
+    });
+
+    function verify(err, result) {
+      if (err) throw err;
+      Assert.ok(Buffer.isBuffer(result));
+      Assert.equal(val.toString('base64'), result.toString('base64'));
+      this.get(key, function(err, result) {
+        if (err) throw err;
+        Assert.equal('string', typeof result);
+        done();
+      });
+    }
+  },
+
+  'coalesce': function(done) {
+    var pending = 4;
+
+    freshDB('-', {}, function(err, store) {
+      if (err) throw err;
+      store.setCoalescing({ maxOps: 16 });
+      store.set('a', '1', check(null));
+      store.add('a', '2', check(Kyoto.DUPREC));
+      store.append('a', '3', check(null));
+      store.remove('missing', check(Kyoto.NOREC));
+    });
+
+    function check(code) {
+      return function(err) {
+        code ? Assert.equal(code, err.code) : Assert.ok(!err);
+        if (--pending === 0)
+          verify(this);
+      };
+    }
+
+    function verify(store) {
+      Assert.deepEqual({ batches: 1, ops: 4, sizes: { 4: 1 } }, store.coalesceStats());
+      store.get('a', function(err, val) {
+        if (err) throw err;
+        Assert.equal('13', val);
+        done();
+      });
+    }
+  },
+
+  'inline': function(done) {
+    Kyoto.open('-', 'w+', { inline: true }, function(err) {
+      if (err) throw err;
+      var store = this,
+          sync = false;
+
+      Assert.ok(store.inline);
+      store.set('a', '1', function(err) {
+        if (err) throw err;
+        Assert.ok(sync);
+        Assert.equal('1', store.db.getSync('a'));
+        store.getBulk(['a', 'b'], function(err, items) {
+          if (err) throw err;
+          Assert.deepEqual({ a: '1' }, items);
+          store.remove('b', function(err) {
+            Assert.equal(Kyoto.NOREC, err.code);
+            Assert.equal(undefined, store.db.getSync('b'));
+            done();
+          });
+        });
+      });
+      sync = true;
+    });
+  },
+
+  'workers': function(done) {
+    Kyoto.open('-', 'w+', { workers: 2 }, function(err) {
+      if (err) throw err;
+      var store = this;
+
+      function lowGet(err, val) {
+        if (err) throw err;
+        Assert.equal('1', val);
+        Assert.equal(2, store.workerStats().low.jobs);
+        done();
+      }
+
+      store.set('a', '1', function(err) {
+        if (err) throw err;
+        store.synchronize(function(err) {
+          if (err) throw err;
+          var stats = store.workerStats();
+          Assert.equal(2, stats.high.threads);
+          Assert.equal(1, stats.low.threads);
+          Assert.equal(0, stats.high.depth);
+          Assert.equal(1, stats.normal.jobs);
+          Assert.equal(1, stats.high.jobs);
+          Assert.equal(1, stats.low.jobs);
+          store.priority(Kyoto.PLOW).get('a', lowGet);
+        });
+      });
+    });
+  },
+
+  'columns': function(done) {
+    Kyoto.open('+', 'w+', function(err) {
+      if (err) throw err;
+      var store = this;
+
+      store.setColumns(['a', 'b'], ['1', '2'], function(err, stored) {
+        if (err) throw err;
+        Assert.equal(2, stored);
+        store.setColumns(Kyoto.pack(['c', '3', 'd', '4']), true, packed);
+      });
+
+      function packed(err, stored) {
+        if (err) throw err;
+        Assert.equal(2, stored);
+        store.getColumns(['d', 'x', 'a'], function(err, values) {
+          if (err) throw err;
+          Assert.equal(3, values.length);
+          Assert.equal('4', values[0]);
+          Assert.ok(!(1 in values));
+          Assert.equal('1', values[2]);
+          store.getColumns(Kyoto.pack(['c', 'b']), true, function(err, values) {
+            if (err) throw err;
+            Assert.deepEqual(['3', '2'], values);
+            done();
+          });
+        });
+      }
+    });
+  },
+
+  'packed': function(done) {
+    Kyoto.open('+', 'w+', function(err) {
+      if (err) throw err;
+      var store = this;
+
+      store.setBulk(Kyoto.pack(['a', '1', 'b', '2']), function(err, stored) {
+        if (err) throw err;
+        Assert.equal(2, stored);
+        store.getBulk(Kyoto.pack(['a', 'x', 'b']), gotBulk);
+      });
+
+      function gotBulk(err, items) {
+        if (err) throw err;
+        Assert.deepEqual(['a', '1', 'b', '2'], Kyoto.unpack(items));
+        store.cursor().jump(function(err) {
+          if (err) throw err;
+          this.getPackedBlock(10, gotBlock);
+        });
+      }
+
+      function gotBlock(err, items, count, ended) {
+        if (err) throw err;
+        Assert.equal(2, count);
+        Assert.ok(ended);
+        Assert.deepEqual(['a', '1', 'b', '2'], Kyoto.unpack(items));
+        streams();
+      }
+    });
+
+    function streams() {
+      var encoder = new Kyoto.PackedEncoder(),
+          decoder = new Kyoto.PackedDecoder(),
+          chunks = [];
+
+      encoder.on('data', function(buf) {
+        // Split the list mid-item on its way to the decoder.
+        decoder.write(buf.slice(0, 7));
+        decoder.write(buf.slice(7));
+        decoder.end();
+      });
+
+      decoder.on('data', function(buf) { chunks.push(Kyoto.unpack(buf)); });
+      decoder.on('end', function() {
+        Assert.deepEqual([['k1', 'v1', 'k2', 'v2']], chunks);
+        done();
+      });
+
+      encoder.write({ key: 'k1', value: 'v1' });
+      encoder.write(['k2', 'v2']);
+      encoder.end();
+    }
+  },
+
+  'load sorted': function(done) {
+    Kyoto.open('+', 'w+', function(err) {
+      if (err) throw err;
+      var store = this,
+          encoder = new Kyoto.PackedEncoder({ maxBytes: 20 });
+
+      store.loadSorted(Kyoto.pack(['a', '1', 'b', '2']), function(err, stats) {
+        if (err) throw err;
+        Assert.equal(2, stats.records);
+        Assert.equal(20, stats.bytes);
+        store.loadSorted(encoder, loadedStream);
+        encoder.write(['c', '3']);
+        encoder.write(['d', '4']);
+        encoder.write(['e', '5']);
+        encoder.end();
+      });
+
+      function loadedStream(err, stats) {
+        if (err) throw err;
+        Assert.equal(3, stats.records);
+        store.loadSorted(Kyoto.pack(['g', '7', 'f', '6']), outOfOrder);
+      }
+
+      function outOfOrder(err, stats) {
+        Assert.equal(Kyoto.INVALID, err.code);
+        Assert.equal(0, stats.records);
+        store.count(function(err, count) {
+          if (err) throw err;
+          Assert.equal(5, count);
+          done();
+        });
+      }
+    });
+  },
+
+  'batch': function(done) {
+    Kyoto.open('+', 'w+', function(err) {
+      if (err) throw err;
+      var store = this;
+
+      store.batch()
+        .set('a', '1')
+        .increment('n', 5, 10)
+        .cas('a', '1', '2')
+        .append('a', '3')
+        .commit(function(err, results, errors) {
+          if (err) throw err;
+          Assert.deepEqual([true, 15, true, true], results);
+          Assert.deepEqual([null, null, null, null], errors);
+          rollback();
+        });
+
+      // A failed cas rolls the whole batch back.
+      function rollback() {
+        store.batch()
+          .set('b', '1')
+          .cas('a', 'wrong', '4')
+          .set('c', '1')
+          .commit(function(err, results, errors) {
+            Assert.equal(Kyoto.LOGIC, err.code);
+            Assert.equal(2, errors.length);
+            Assert.strictEqual(false, results[1]);
+            store.getBulk(['a', 'b', 'c'], function(err, items) {
+              if (err) throw err;
+              Assert.deepEqual({ a: '23' }, items);
+              noTransaction();
+            });
+          });
+      }
+
+      function noTransaction() {
+        store.batch({ transaction: false })
+          .add('a', 'x')
+          .remove('a')
+          .commit(function(err, results, errors) {
+            if (err) throw err;
+            Assert.equal(Kyoto.DUPREC, errors[0].code);
+            Assert.deepEqual([false, true], results);
+            done();
+          });
+      }
+    });
+  },
+
+  'durability': function(done) {
+    Kyoto.open('+', 'w+', { durability: 'write' }, function(err) {
+      if (err) throw err;
+      var store = this,
+          acked = 0;
+
+      for (var i = 0; i < 10; i++)
+        store.set('k' + i, 'v', ack);
+
+      function ack(err) {
+        if (err) throw err;
+        if (++acked < 10) return;
+
+        var stats = store.syncStats();
+        Assert.equal(10, stats.held);
+        Assert.ok(stats.syncs >= 1 && stats.syncs <= 10);
+        Assert.equal(stats.requests, stats.syncs);
+
+        // Concurrent requests share syncs.
+        var synced = 0;
+        for (var j = 0; j < 10; j++)
+          store.synchronize(true, function(err) {
+            if (err) throw err;
+            if (++synced == 10) {
+              Assert.ok(store.syncStats().requests >= stats.requests + 10);
+
+              // A write below `bytes` is still acked after `interval`.
+              store.setDurability({ policy: 'bytes', interval: 5 });
+              store.set('small', 'v', function(err) {
+                if (err) throw err;
+                store.close(done);
+              });
+            }
+          });
+      }
+    });
+  },
+
+  'sharded': function(done) {
+    Kyoto.openSharded('+', 'w+', { shards: 3 }, function(err) {
+      if (err) throw err;
+      var store = this;
+
+      Assert.equal(3, store.shards.length);
+      Assert.equal(Kyoto.shardOf('a', 3), Kyoto.shardOf('a', 3));
+      Assert.ok(store.compare('b', 'a') > 0);
+      Assert.ok(store.compare('\uffff', '\ud83d\ude00') < 0);
+
+      store.setBulk({ a: '1', b: '2', c: '3', d: '4', e: '5' }, function(err, stored) {
+        if (err) throw err;
+        Assert.equal(5, stored);
+        store.set('f', '6', function(err) {
+          if (err) throw err;
+          store.get('f', gotOne);
+        });
+      });
+
+      function gotOne(err, value) {
+        if (err) throw err;
+        Assert.equal('6', value);
+        store.getBulk(['a', 'c', 'x'], gotBulk);
+      }
+
+      function gotBulk(err, items) {
+        if (err) throw err;
+        Assert.deepEqual({ a: '1', c: '3' }, items);
+        store.removeBulk(['a', 'b', 'c', 'd', 'e'], true, function(err) {
+          Assert.ok(err);
+        });
+        store.count(function(err, count) {
+          if (err) throw err;
+          Assert.equal(6, count);
+          store.range({ gte: 'b', limit: 3 }, gotRange);
+        });
+      }
+
+      function gotRange(err, keys, values) {
+        if (err) throw err;
+        Assert.deepEqual(['b', 'c', 'd'], keys);
+        Assert.deepEqual(['2', '3', '4'], values);
+
+        var streamed = [];
+        store.range({ chunk: 1 }, function(keys, values, next) {
+          streamed.push.apply(streamed, keys);
+          next();
+        }, function(err) {
+          if (err) throw err;
+          Assert.deepEqual(['a', 'b', 'c', 'd', 'e', 'f'], streamed);
+          store.updateBulk([['m', 'max', 2], ['n', 'max', 4], ['m', 'max', 1]], closed);
+        });
+      }
+
+      function closed(err, errors, results) {
+        if (err) throw err;
+        Assert.deepEqual([null, null, null], errors);
+        Assert.deepEqual(['2', '4', '2'], results);
+        store.close(function(err) {
+          if (err) throw err;
+          store.get('a', function(err) {
+            Assert.ok(/closed/.test(err.message));
+            done();
+          });
+        });
+      }
+    });
+  },
+
+  'read cache': function(done) {
+    Kyoto.open('+', 'w+', { cache: 1024 }, function(err) {
+      if (err) throw err;
+      var store = this;
+
+      store.set('a', '1', function(err) {
+        if (err) throw err;
+        store.get('a', function(err, value) {
+          if (err) throw err;
+          Assert.equal('1', value);
+          store.get('a', cachedHit);
+        });
+      });
+
+      function cachedHit(err, value) {
+        if (err) throw err;
+        Assert.equal('1', value);
+        Assert.equal(1, store.cacheStats().hits);
+        store.append('a', '2', function(err) {
+          if (err) throw err;
+          store.get('a', afterWrite);
+        });
+      }
+
+      function afterWrite(err, value) {
+        if (err) throw err;
+        Assert.equal('12', value);
+        store.batch().set('a', '3').commit(function(err) {
+          if (err) throw err;
+          store.get('a', function(err, value) {
+            if (err) throw err;
+            Assert.equal('3', value);
+            var stats = store.cacheStats();
+            Assert.equal(1, stats.hits);
+            Assert.equal(1, stats.entries);
+            Assert.ok(stats.invalidations >= 2);
+            store.close(done);
+          });
+        });
+      }
+    });
+  },
+
+  'tiered': function(done) {
+    var options = { tier: { mode: 'back', count: 100, flushInterval: 0 } };
+    Kyoto.open('+', 'w+', options, function(err) {
+      if (err) throw err;
+      var store = this;
+
+      store.set('a', '1', function(err) {
+        if (err) throw err;
+        Assert.equal(1, store.tierStats().dirty);
+        store.get('a', function(err, value) {
+          if (err) throw err;
+          Assert.equal('1', value);
+          Assert.equal(1, store.tierStats().hits);
+          // Bulk reads go to the file, so the tier is flushed first.
+          store.getBulk(['a'], function(err, items) {
+            if (err) throw err;
+            Assert.deepEqual({ a: '1' }, items);
+            var stats = store.tierStats();
+            Assert.equal(0, stats.dirty);
+            Assert.equal(1, stats.flushes);
+            store.close(done);
+          });
+        });
+      });
+    });
+  },
+
+  'inline tiered': function(done) {
+    var options = { inline: true, tier: { mode: 'back', flushInterval: 0 } };
+    Kyoto.open('+', 'w+', options, function(err) {
+      if (err) throw err;
+      var store = this;
+
+      store.append('a', 'old', function(err) {
+        if (err) throw err;
+        store.set('a', 'new', function(err) {
+          if (err) throw err;
+          store.flushTier(function(err) {
+            if (err) throw err;
+            store.get('a', function(err, value) {
+              if (err) throw err;
+              Assert.equal('new', value);
+              store.close(done);
+            });
+          });
+        });
+      });
+    });
+  },
+
+  'bloom': function(done) {
+    Kyoto.open('+', 'w+', { bloom: { bits: 4096, hashes: 3 } }, function(err) {
+      if (err) throw err;
+      var store = this;
+
+      store.set('a', '1', function(err) {
+        if (err) throw err;
+        store.get('missing', function(err, value) {
+          if (err) throw err;
+          Assert.equal(undefined, value);
+          store.getBulk(['a', 'b'], function(err, items) {
+            if (err) throw err;
+            Assert.deepEqual({ a: '1' }, items);
+            var stats = store.bloomStats();
+            Assert.equal(1, stats.keys);
+            Assert.equal(2, stats.negatives);
+            Assert.ok(stats.fpRate < 0.01);
+            store.close(done);
+          });
+        });
+      });
+    });
+  },
+
+  'inline bloom': function(done) {
+    Kyoto.open('+', 'w+', { inline: true, bloom: { bits: 4096, hashes: 3 } }, function(err) {
+      if (err) throw err;
+      var store = this;
+
+      store.set('a', '1', function(err) {
+        if (err) throw err;
+        store.get('a', function(err, value) {
+          if (err) throw err;
+          Assert.equal('1', value);
+          store.close(done);
+        });
+      });
+    });
+  },
+
+  'alloc stats': function(done) {
+    var before = Kyoto.allocStats();
+    db.set('alloc', 'small', function(err) {
+      if (err) throw err;
+      db.get('alloc', function(err) {
+        if (err) throw err;
+        var after = Kyoto.allocStats();
+        Assert.equal(2, after.requests.made - before.requests.made);
+        Assert.ok(after.requests.reused > before.requests.reused);
+        Assert.equal(3, after.bytes.inline - before.bytes.inline);
+        Assert.equal(after.bytes.heap, before.bytes.heap);
+        done();
+      });
+    });
+  },
+
+  'completion stats': function(done) {
+    var pending = 20,
+        before = Kyoto.completionStats();
+
+    for (var i = 0; i < 20; i++)
+      db.get('completion' + i, function(err) {
+        if (err) throw err;
+        if (--pending > 0) return;
+        var after = Kyoto.completionStats();
+        Assert.ok(after.count > before.count);
+        Assert.ok(after.count <= before.count + 20);
+        Assert.ok(after.max >= 1);
+        done();
+      });
+  },
+
+  'update': function(done) {
+    db.updateBulk([
+      ['u-max', 'max', 5],
+      ['u-max', 'max', 3],
+      ['u-list', 'push', { value: 'a', limit: 2 }],
+      ['u-list', 'push', { value: 'b', limit: 2 }],
+      ['u-list', 'push', { value: 'c', limit: 2 }],
+      ['u-set', 'addToSet', 'x'],
+      ['u-set', 'addToSet', 'x'],
+      ['u-count', 'count', { index: 2, delta: 7 }],
+      ['u-doc', 'merge', { a: '1', b: '2' }],
+      ['u-doc', 'merge', { a: null }],
+      ['u-json', 'mergeJSON', { a: { b: 1, c: 2 }, d: [3] }],
+      ['u-json', 'mergeJSON', { a: { c: null }, d: null }]
+    ], function(err, errors, results) {
+      if (err) throw err;
+      Assert.deepEqual([null, null, null, null, null, null, null, null, null, null, null, null], errors);
+      Assert.equal('5', results[1]);
+      Assert.deepEqual([true, false], results.slice(5, 7));
+      Assert.equal(7, results[7]);
+      Assert.deepEqual({ a: { b: 1 } }, JSON.parse(results[11]));
+
+      for (var deep = 1, i = 0; i < 100; i++)
+        deep = { a: deep };
+      Assert.throws(function() { db.update('u-json', 'mergeJSON', deep); });
+      Assert.throws(function() { db.update('u-json', 'mergeJSON', [1]); });
+
+      db.getBuffer('u-list', function(err, list) {
+        if (err) throw err;
+        Assert.deepEqual(['b', 'c'], Kyoto.unpack(list));
+        db.update('u-list', 'pop', function(err, item) {
+          if (err) throw err;
+          Assert.equal('c', item);
+          db.update('u-max', 'push', 'x', function(err) {
+            Assert.equal(Kyoto.INVALID, err.code);
+            db.update('u-doc', 'merge', { b: null }, function(err, record) {
+              if (err) throw err;
+              Assert.equal(undefined, record);
+              db.get('u-doc', function(err, value) {
+                Assert.equal(undefined, value);
+                done();
+              });
+            });
+          });
+        });
+      });
+    });
+  },
+
   'close': function(done) {
     db.close(function(err) {
       if (err) throw err;